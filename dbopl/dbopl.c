@@ -101,24 +101,23 @@
 #ifdef PRECALC_TBL
 
 #include "precalc.inc"
-#define FreqMul 		PrecalcFreqMul
-#define LinearRates 	PrecalcLinearRates
-#define AttackRates 	PrecalcAttackRates
-#define LfoAdd			PrecalcLfoAdd
-#define NoiseAdd		PrecalcNoiseAdd
+#include "precalc12.inc"
+//Rate the tables in precalc.inc are for, precalc12.inc has half of it
+#define PRECALC_RATE	24000UL
 
 #else
 
 #include <math.h>
 
+#endif
+
+//Chip_Setup fills these in or points them at the precalculated tables
 #define FreqMul 		chip->freqMul
 #define LinearRates 	chip->linearRates
 #define AttackRates 	chip->attackRates
 #define LfoAdd			chip->lfoAdd
 #define NoiseAdd		chip->noiseAdd
 
-#endif
-
 #ifndef PRECALC_TBL
 //How much to subtract from the base value for the final attenuation
 static const uint8_t KslCreateTable[16] = {
@@ -151,11 +150,11 @@ static const uint8_t EnvelopeIncreaseTable[13] = {
 	32, 
 };
 
-#if ( DBOPL_WAVE == WAVE_HANDLER ) || ( DBOPL_WAVE == WAVE_TABLELOG )
+#if (( DBOPL_WAVE == WAVE_HANDLER ) && !defined( SHARED_TBL )) || ( DBOPL_WAVE == WAVE_TABLELOG )
 static uint16_t ExpTable[ 256 ];
 #endif
 
-#if ( DBOPL_WAVE == WAVE_HANDLER )
+#if ( DBOPL_WAVE == WAVE_HANDLER ) && !defined( SHARED_TBL )
 //PI table used by WAVEHANDLER
 static uint16_t SinTable[ 512 ];
 #endif
@@ -232,70 +231,87 @@ static const int8_t VibratoTable[ 8 ] = {
 
 
 #if ( DBOPL_WAVE == WAVE_HANDLER )
+#ifdef SHARED_TBL
+//Nuked-OPL3 (opl3.c) carries the same tables: a quarter wave of the log-sin table
+//and the exp table without the preshift, so use them instead of our own copies
+extern const uint16_t logsinrom[ 256 ];
+extern const uint16_t exprom[ 256 ];
+
+//The second quarter of the half wave is the first one mirrored, fold it with the index
+#define SIN_HALF( _I_ )		logsinrom[ ( ( _I_ ) ^ ( 0 - ( ( ( _I_ ) >> 8 ) & 1 ) ) ) & 255 ]
+#define SIN_QUARTER( _I_ )	logsinrom[ ( _I_ ) & 255 ]
+#define EXP_TABLE( _I_ )	( (WaveBitu) exprom[ _I_ ] << 1 )
+#else
+#define SIN_HALF( _I_ )		SinTable[ ( _I_ ) & 511 ]
+#define SIN_QUARTER( _I_ )	SinTable[ ( _I_ ) & 255 ]
+#define EXP_TABLE( _I_ )	ExpTable[ _I_ ]
+#endif
+
+//All 12 bits of a wave table entry set when bit _B_ of the index is, silences that half of the wave.
+//Built from the bit itself, so it works the same for 16 and 32 bit wave math.
+#define WAVE_HALF_MUTE( _I_, _B_ )	( (WaveBitu)( 0 - ( ( (_I_) >> (_B_) ) & 1 ) ) & 4095 )
+
 /*
 	Generate the different waveforms out of the sine/exponential table using handlers
 */
-static inline Bits MakeVolume( Bitu wave, Bitu volume ) {
-	Bitu total = wave + volume;
-	Bitu index = total & 0xff;
-	Bitu sig = ExpTable[ index ];
-	Bitu exp = total >> 8;
-#if 0
-	//Check if we overflow the 31 shift limit
-	if ( exp >= 32 ) {
-		LOG_MSG( "WTF %d %d", total, exp );
-	}
-#endif
-	return (sig >> exp);
+static inline WaveBits MakeVolume( WaveBitu wave, WaveBitu volume ) {
+	WaveBitu total = wave + volume;
+	WaveBitu index = total & 0xff;
+	WaveBitu sig = EXP_TABLE( index );
+	WaveBitu exp = total >> 8;
+	//Everything is shifted out by then, a 16-bit shift can't go that far
+	if ( exp >= 16 )
+		return 0;
+	return (WaveBits)(sig >> exp);
 }
 
-static Bits DB_FASTCALL WaveForm0( Bitu i, Bitu volume ) {
-	Bits neg = 0 - (( i >> 9) & 1);//Create ~0 or 0
-	Bitu wave = SinTable[i & 511];
+static WaveBits DB_FASTCALL WaveForm0( WaveBitu i, WaveBitu volume ) {
+	WaveBits neg = (WaveBits)( 0 - (( i >> 9) & 1) );//Create ~0 or 0
+	WaveBitu wave = SIN_HALF( i );
 	return (MakeVolume( wave, volume ) ^ neg) - neg;
 }
-static Bits DB_FASTCALL WaveForm1( Bitu i, Bitu volume ) {
-	uint32_t wave = SinTable[i & 511];
-	wave |= ( ( ( i ^ 512UL ) & 512UL) - 1UL) >> ( 32 - 12 );
+static WaveBits DB_FASTCALL WaveForm1( WaveBitu i, WaveBitu volume ) {
+	WaveBitu wave = SIN_HALF( i );
+	wave |= WAVE_HALF_MUTE( i, 9 );
 	return MakeVolume( wave, volume );
 }
-static Bits DB_FASTCALL WaveForm2( Bitu i, Bitu volume ) {
-	Bitu wave = SinTable[i & 511];
+static WaveBits DB_FASTCALL WaveForm2( WaveBitu i, WaveBitu volume ) {
+	WaveBitu wave = SIN_HALF( i );
 	return MakeVolume( wave, volume );
 }
-static Bits DB_FASTCALL WaveForm3( Bitu i, Bitu volume ) {
-	Bitu wave = SinTable[i & 255];
-	wave |= ( ( ( i ^ 256UL) & 256UL) - 1UL) >> ( 32 - 12 );
+static WaveBits DB_FASTCALL WaveForm3( WaveBitu i, WaveBitu volume ) {
+	WaveBitu wave = SIN_QUARTER( i );
+	wave |= WAVE_HALF_MUTE( i, 8 );
 	return MakeVolume( wave, volume );
 }
-static Bits DB_FASTCALL WaveForm4( Bitu i, Bitu volume ) {
-	Bits neg;
-	Bitu wave;
+static WaveBits DB_FASTCALL WaveForm4( WaveBitu i, WaveBitu volume ) {
+	WaveBits neg;
+	WaveBitu wave;
 	//Twice as fast
 	i <<= 1;
-	neg = 0UL - (( i >> 9 ) & 1);//Create ~0 or 0
-	wave = SinTable[i & 511];
-	wave |= ( ( ( i ^ 512UL ) & 512UL) - 1UL) >> ( 32 - 12 );
+	neg = (WaveBits)( 0 - (( i >> 9 ) & 1) );//Create ~0 or 0
+	wave = SIN_HALF( i );
+	wave |= WAVE_HALF_MUTE( i, 9 );
 	return (MakeVolume( wave, volume ) ^ neg) - neg;
 }
-static Bits DB_FASTCALL WaveForm5( Bitu i, Bitu volume ) {
-	Bitu wave;
+static WaveBits DB_FASTCALL WaveForm5( WaveBitu i, WaveBitu volume ) {
+	WaveBitu wave;
 	//Twice as fast
 	i <<= 1;
-	wave = SinTable[i & 511];
-	wave |= ( ( ( i ^ 512UL ) & 512UL) - 1UL) >> ( 32 - 12 );
+	wave = SIN_HALF( i );
+	wave |= WAVE_HALF_MUTE( i, 9 );
 	return MakeVolume( wave, volume );
 }
-static Bits DB_FASTCALL WaveForm6( Bitu i, Bitu volume ) {
-	Bits neg = 0 - (( i >> 9) & 1);//Create ~0 or 0
+static WaveBits DB_FASTCALL WaveForm6( WaveBitu i, WaveBitu volume ) {
+	WaveBits neg = (WaveBits)( 0 - (( i >> 9) & 1) );//Create ~0 or 0
 	return (MakeVolume( 0, volume ) ^ neg) - neg;
 }
-static Bits DB_FASTCALL WaveForm7( Bitu i, Bitu volume ) {
+static WaveBits DB_FASTCALL WaveForm7( WaveBitu i, WaveBitu volume ) {
 	//Negative is reversed here
-	Bits neg = (( i >> 9) & 1L) - 1L;
-	Bitu wave = (i << 3);
+	WaveBits neg = (WaveBits)( (( i >> 9) & 1) - 1 );
+	WaveBitu wave = (WaveBitu)(i << 3);
 	//When negative the volume also runs backwards
-	wave = ((wave ^ neg) - neg) & 4095UL;
+	wave = (WaveBitu)( ((wave ^ neg) - neg) & 4095 );
 	return (MakeVolume( wave, volume ) ^ neg) - neg;
 }
 
@@ -361,14 +377,21 @@ static inline void Operator_UpdateAttenuation( Operator* op ) {
 	op->totalLevel += ( ((uint32_t)kslBase) << ENV_EXTRA ) >> kslShift;
 }
 
+//The frequency multiplier shifted up by the block, has to follow both of them.
+//F-number changes then only take a multiply, no long shifts.
+static inline void Operator_UpdateBlockMul( Operator* op ) {
+#ifndef WAVE_PRECISION
+	op->blockMul = op->freqMul << ( (op->chanData >> 10) & 7 );
+#endif
+}
+
 static inline void Operator_UpdateFrequency( Operator* op ) {
-	uint32_t freq = op->chanData & (( 1 << 10 ) - 1);
-	uint32_t block = (op->chanData >> 10) & 0xff;
+	uint16_t freq = (uint16_t)op->chanData & (( 1 << 10 ) - 1);
 #ifdef WAVE_PRECISION
-	block = 7UL - block;
+	uint32_t block = 7UL - ((op->chanData >> 10) & 0xff);
 	op->waveAdd = ( freq * op->freqMul ) >> block;
 #else
-	op->waveAdd = ( freq << block ) * op->freqMul;
+	op->waveAdd = freq * op->blockMul;
 #endif
 	if ( op->reg20 & MASK_VIBRATO ) {
 		op->vibStrength = (uint8_t)(freq >> 7u);
@@ -376,7 +399,7 @@ static inline void Operator_UpdateFrequency( Operator* op ) {
 #ifdef WAVE_PRECISION
 		op->vibrato = ( (uint32_t)op->vibStrength * op->freqMul ) >> block;
 #else
-		op->vibrato = ( (uint32_t)op->vibStrength << block ) * op->freqMul;
+		op->vibrato = op->vibStrength * op->blockMul;
 #endif
 	} else {
 		op->vibStrength = 0;
@@ -510,7 +533,12 @@ static inline Bitu Operator_ForwardVolume(Operator *op) {
 
 static inline Bitu Operator_ForwardWave(Operator *op) {
 	op->waveIndex += op->waveCurrent;	
+#ifdef DBOPL_WAVE16
+	//The index is in the upper word, the rest of the shift is a 16-bit one
+	return (WaveBitu)( op->waveIndex >> 16 ) >> ( WAVE_SH - 16 );
+#else
 	return op->waveIndex >> WAVE_SH;
+#endif
 }
 
 
@@ -522,7 +550,70 @@ static inline bool Operator_Silent(Operator *op) {
 	return true;
 }
 
+//Volume handler for block rate envelopes, Operator_ForwardEnvelope already did the work
+static Bits Operator_Volume_HOLD(Operator* op) {
+	return op->volume;
+}
+
+//Same as Operator_RateForward for <samples> samples at once, split up so it doesn't overflow
+static inline int32_t Operator_RateForwardBlock( Operator *op, uint32_t add, uint16_t samples ) {
+	uint32_t high = ( add >> 16 ) * samples;
+	uint32_t low = ( add & 0xffff ) * samples + op->rateIndex;
+	low += ( high & 0xff ) << 16;
+	op->rateIndex = low & RATE_MASK;
+	return (int32_t)( ( high >> 8 ) + ( low >> RATE_SH ) );
+}
+
+//Moves the envelope a whole block ahead at once, the volume then holds for the block (block rate envelopes)
+static void Operator_ForwardEnvelope( Operator* op, uint16_t samples ) {
+	int32_t vol;
+
+	//The attack is short and its curve matters, it still goes sample by sample
+	while ( op->state == ATTACK && samples ) {
+		Operator_Volume_ATTACK( op );
+		samples--;
+	}
+	vol = op->volume;
+
+	switch ( op->state ) {
+	case DECAY:
+		if ( !samples )
+			break;
+		vol += Operator_RateForwardBlock( op, op->decayAdd, samples );
+		if ( vol >= op->sustainLevel ) {
+			//Stop at the sustain level, the rest of the block would overshoot it by a lot
+			if ( vol >= ENV_MAX && op->sustainLevel >= ENV_MAX ) {
+				op->volume = ENV_MAX;
+				Operator_SetState( op, OFF );
+				break;
+			}
+			//Unless it was already past it (sustain level lowered during the decay)
+			vol = op->volume > op->sustainLevel ? op->volume : op->sustainLevel;
+			op->rateIndex = 0;
+			Operator_SetState( op, SUSTAIN );
+		}
+		op->volume = vol;
+		break;
+	case SUSTAIN:
+		if ( op->reg20 & MASK_SUSTAIN )
+			break;
+		//In sustain phase, but not sustaining, do regular release
+	case RELEASE:
+		vol += Operator_RateForwardBlock( op, op->releaseAdd, samples );
+		if ( vol >= ENV_MAX ) {
+			op->volume = ENV_MAX;
+			Operator_SetState( op, OFF );
+		} else {
+			op->volume = vol;
+		}
+		break;
+	}
+	op->volHandler = Operator_Volume_HOLD;
+}
+
 static inline void Operator_Prepare( Operator* op, const Chip* chip )  {
+	if ( chip->blockEnvelope )
+		Operator_ForwardEnvelope( op, chip->blockSamples );
 	op->currentLevel = (uint32_t)(op->totalLevel + (int32_t)(chip->tremoloValue & op->tremoloMask));
 	op->waveCurrent = op->waveAdd;
 	if ( op->vibStrength >> chip->vibratoShift ) {
@@ -560,7 +651,8 @@ static inline void Operator_KeyOff( Operator *op, uint8_t mask ) {
 
 static inline Bits Operator_GetWave( Operator* op, Bitu index, Bitu vol ) {
 #if ( DBOPL_WAVE == WAVE_HANDLER )
-	return op->waveHandler( index, vol << ( 3 - ENV_EXTRA ) );
+	//Only the low 10 bits of the index and a volume below ENV_LIMIT make it to the handler
+	return op->waveHandler( (WaveBitu)index, (WaveBitu)vol << ( 3 - ENV_EXTRA ) );
 #elif ( DBOPL_WAVE == WAVE_TABLEMUL )
 	return ((Bits)op->waveBase[ index & op->waveMask ] * (Bits)MulTable[ vol >> ENV_EXTRA ]) >> MUL_SH;
 #elif ( DBOPL_WAVE == WAVE_TABLELOG )
@@ -613,6 +705,7 @@ static void Operator_Write20( Operator* op, const Chip* chip, uint8_t val ) {
 	//Frequency multiplier or vibrato changed
 	if ( change & (0xf | MASK_VIBRATO) ) {
 		op->freqMul = FreqMul[ val & 0xf ];
+		Operator_UpdateBlockMul( op );
 		Operator_UpdateFrequency( op );
 	}
 }
@@ -671,6 +764,7 @@ static void Operator_WriteE0( Operator* op, const Chip* chip, uint8_t val ) {
 static void Operator_Reset(Operator *op) {
 	op->chanData = 0;
 	op->freqMul = 0;
+	op->blockMul = 0;
 	op->waveIndex = 0;
 	op->waveAdd = 0;
 	op->waveCurrent = 0;
@@ -704,8 +798,154 @@ static void Operator_Reset(Operator *op) {
 
 #define CH_OP(c, x) (((c) + (x>>1))->op[x & 1])
 
-static Channel* Channel_Block_sm2AM( Channel* ch, Chip* chip, uint16_t samples, int16_t* output ) {
+//Stores the first mono channel block of a block into the stereo mix, so it doesn't have to be cleared
+static void Chip_StoreChannel( int32_t* output, const int16_t* input, uint16_t samples, int16_t maskLeft, int16_t maskRight ) {
+	while ( samples-- ) {
+		output[ 0 ] = *input & maskLeft;
+		output[ 1 ] = *input & maskRight;
+		input++;
+		output += 2;
+	}
+}
+
+//Default mixer, adds a mono channel block into the stereo mix
+static void Chip_MixChannelC( int32_t* output, const int16_t* input, uint16_t samples, int16_t maskLeft, int16_t maskRight ) {
+	while ( samples-- ) {
+		output[ 0 ] += *input & maskLeft;
+		output[ 1 ] += *input & maskRight;
+		input++;
+		output += 2;
+	}
+}
+
+//Default packer, clips the stereo mix to 16 bits
+static void Chip_PackC( int16_t* output, const int32_t* input, uint16_t count ) {
+	while ( count-- ) {
+		int32_t sample = *input++;
+		if ( sample > 32767 )
+			sample = 32767;
+		else if ( sample < -32768 )
+			sample = -32768;
+		*output++ = (int16_t)sample;
+	}
+}
+
+//Channel blocks render into chip->mixBuf first, then the first one is stored into the mix and the mix handler adds the rest
+#define Chip_MixChannel( chip, output, samples, left, right ) \
+	( (chip)->mixChannels++ ? \
+		(chip)->mixHandler( output, (chip)->mixBuf, samples, left, right ) : \
+		Chip_StoreChannel( output, (chip)->mixBuf, samples, left, right ) )
+
+#ifdef DBOPL_SSCACHE
+/*
+	Steady state cache
+	An operator that sits in sustain (or is off) without tremolo has the same volume and waveform
+	for as long as the note is held, so its sample only depends on the phase. The samples are stored
+	in a table indexed by phase as the phases come by, and looked up from there until the volume
+	or waveform changes. Vibrato and feedback only move the phase, so they don't matter.
+*/
+
+static inline bool Operator_Steady( const Operator* op ) {
+	if ( op->tremoloMask )
+		return false;
+	if ( op->state == OFF )
+		return true;
+	return op->state == SUSTAIN && ( op->rateZero & ( 1 << SUSTAIN ) );
+}
+
+//Clears the table of an operator if it was generated with a different volume or waveform
+static inline void SteadyCache_Update( SteadyCache* cache, uint8_t index, const Operator* op ) {
+	//Same as Operator_ForwardVolume, which doesn't change the volume in these states
+	uint32_t level = op->currentLevel + ( op->state == OFF ? ENV_MAX : op->volume );
+	if ( cache->level[ index ] == level && cache->handler[ index ] == op->waveHandler )
+		return;
+	cache->level[ index ] = level;
+	cache->handler[ index ] = op->waveHandler;
+	memset( cache->wave[ index ], 0x80, sizeof( cache->wave[ index ] ) );
+}
+
+//Gets the cache slot of a channel whose operators are both steady, NULL if it has to be generated.
+//Operator_Prepare must have been called for this block.
+static SteadyCache* Channel_SteadyCache( const Channel* ch, Chip* chip ) {
+	SteadyCache* cache = chip->steady;
+	SteadyCache* unused = 0;
+	uint8_t i;
+
+	if ( !Operator_Steady( &CH_OP(ch, 0) ) || !Operator_Steady( &CH_OP(ch, 1) ) )
+		return 0;
+
+	for ( i = 0; i < DBOPL_SSCACHE; i++, cache++ ) {
+		if ( cache->owner == ch )
+			break;
+		//Slots not used in this block or the one before belong to channels that changed
+		if ( !unused && ( !cache->owner || (uint16_t)( chip->steadyBlock - cache->used ) > 1 ) )
+			unused = cache;
+	}
+
+	if ( i == DBOPL_SSCACHE ) {
+		if ( !unused )
+			return 0;
+		cache = unused;
+		cache->owner = ch;
+		cache->level[0] = cache->level[1] = ~(uint32_t)0;
+	}
+
+	cache->used = chip->steadyBlock;
+	SteadyCache_Update( cache, 0, &CH_OP(ch, 0) );
+	SteadyCache_Update( cache, 1, &CH_OP(ch, 1) );
+	return cache;
+}
+
+//Same as Operator_GetSample for a steady operator, generating the table entries as needed
+static inline Bits Operator_GetSteadySample( Operator* op, SteadyCache* cache, uint8_t index, Bits modulation ) {
+	int16_t* wave = cache->wave[ index ];
+	//The wave handlers only use the lower 10 bits of the index
+	Bitu i = ( Operator_ForwardWave( op ) + (Bitu)modulation ) & ( DBOPL_SS_WAVE - 1 );
+	if ( wave[ i ] == DBOPL_SS_EMPTY ) {
+		Bitu vol = cache->level[ index ];
+		wave[ i ] = ENV_SILENT( vol ) ? 0 : (int16_t)Operator_GetWave( op, i, vol );
+	}
+	return wave[ i ];
+}
+
+//Renders a block of a 2 operator channel from its cache slot
+static Channel* Channel_Block_Steady( Channel* ch, Chip* chip, SteadyCache* cache, uint16_t samples, int32_t* output, bool am, int16_t left, int16_t right ) {
+	uint16_t i;
+	int16_t* mix = chip->mixBuf;
+
+	if ( am ) {
+		for ( i = 0; i < samples; i++ ) {
+			int32_t mod = (int32_t)((uint32_t)((ch->old[0] + ch->old[1])) >> ch->feedback);
+			ch->old[0] = ch->old[1];
+			ch->old[1] = (int32_t)Operator_GetSteadySample( &CH_OP(ch, 0), cache, 0, mod );
+			mix[ i ] = (int16_t)( ch->old[0] + Operator_GetSteadySample( &CH_OP(ch, 1), cache, 1, 0 ) );
+		}
+	} else {
+		for ( i = 0; i < samples; i++ ) {
+			int32_t mod = (int32_t)((uint32_t)((ch->old[0] + ch->old[1])) >> ch->feedback);
+			ch->old[0] = ch->old[1];
+			ch->old[1] = (int32_t)Operator_GetSteadySample( &CH_OP(ch, 0), cache, 0, mod );
+			mix[ i ] = (int16_t)Operator_GetSteadySample( &CH_OP(ch, 1), cache, 1, ch->old[0] );
+		}
+	}
+	Chip_MixChannel( chip, output, samples, left, right );
+
+	return ( ch + 1 );
+}
+
+//Hands a 2 operator block over to the cache if the channel is steady
+#define Channel_TrySteady( ch, chip, samples, output, am, left, right ) {		\
+	SteadyCache* cache = Channel_SteadyCache( ch, chip );					\
+	if ( cache )															\
+		return Channel_Block_Steady( ch, chip, cache, samples, output, am, left, right );	\
+}
+#else
+#define Channel_TrySteady( ch, chip, samples, output, am, left, right )
+#endif
+
+static Channel* Channel_Block_sm2AM( Channel* ch, Chip* chip, uint16_t samples, int32_t* output ) {
 	uint16_t i;
+	int16_t* mix = chip->mixBuf;
 	if (Operator_Silent(&CH_OP(ch, 0)) && Operator_Silent(&CH_OP(ch, 1))) {
 		ch->old[0] = ch->old[1] = 0L;
 		return ch + 1;
@@ -713,6 +953,7 @@ static Channel* Channel_Block_sm2AM( Channel* ch, Chip* chip, uint16_t samples,
 	//Init the operators with the the current vibrato and tremolo values
 	Operator_Prepare( &CH_OP(ch, 0), chip );
 	Operator_Prepare( &CH_OP(ch, 1), chip );
+	Channel_TrySteady( ch, chip, samples, output, true, -1, -1 );
 
 	for ( i = 0; i < samples; i++ ) {
 		//Do unsigned shift so we can shift out all bits but still stay in 10 bit range otherwise
@@ -724,16 +965,16 @@ static Channel* Channel_Block_sm2AM( Channel* ch, Chip* chip, uint16_t samples,
 		out0 = ch->old[0];
 		sample = (int32_t)(out0 + Operator_GetSample( &CH_OP(ch, 1), 0 ));
 
-		output[ 0 ] += (int16_t) sample;
-		output[ 1 ] += (int16_t) sample;
-		output += 2;
+		mix[ i ] = (int16_t) sample;
 	}
+	Chip_MixChannel( chip, output, samples, -1, -1 );
 
 	return ( ch + 1 );
 }
 
-static Channel* Channel_Block_sm2FM( Channel* ch, Chip* chip, uint16_t samples, int16_t* output ) {
+static Channel* Channel_Block_sm2FM( Channel* ch, Chip* chip, uint16_t samples, int32_t* output ) {
 	uint16_t i;
+	int16_t* mix = chip->mixBuf;
 
 	if ( Operator_Silent(&CH_OP(ch, 1)) ) {
 		ch->old[0] = ch->old[1] = 0L;
@@ -742,6 +983,7 @@ static Channel* Channel_Block_sm2FM( Channel* ch, Chip* chip, uint16_t samples,
 	//Init the operators with the the current vibrato and tremolo values
 	Operator_Prepare( &CH_OP(ch, 0), chip );
 	Operator_Prepare( &CH_OP(ch, 1), chip );
+	Channel_TrySteady( ch, chip, samples, output, false, -1, -1 );
 
 	for ( i = 0; i < samples; i++ ) {
 		//Do unsigned shift so we can shift out all bits but still stay in 10 bit range otherwise
@@ -754,16 +996,16 @@ static Channel* Channel_Block_sm2FM( Channel* ch, Chip* chip, uint16_t samples,
 		out0 = ch->old[0];
 		sample = (int32_t)Operator_GetSample( &CH_OP(ch, 1), out0 );
 
-		output[ 0 ] += (int16_t) sample;
-		output[ 1 ] += (int16_t) sample;
-		output += 2;
+		mix[ i ] = (int16_t) sample;
 	}
+	Chip_MixChannel( chip, output, samples, -1, -1 );
 
 	return ( ch + 1 );
 }
 
-static Channel* Channel_Block_sm3AM( Channel* ch, Chip* chip, uint16_t samples, int16_t* output ) {
+static Channel* Channel_Block_sm3AM( Channel* ch, Chip* chip, uint16_t samples, int32_t* output ) {
 	uint16_t i;
+	int16_t* mix = chip->mixBuf;
 	
 	if ( Operator_Silent(&CH_OP(ch, 0)) && Operator_Silent(&CH_OP(ch, 1)) ) {
 		ch->old[0] = ch->old[1] = 0L;
@@ -773,6 +1015,7 @@ static Channel* Channel_Block_sm3AM( Channel* ch, Chip* chip, uint16_t samples,
 	//Init the operators with the the current vibrato and tremolo values
 	Operator_Prepare( &CH_OP(ch, 0), chip );
 	Operator_Prepare( &CH_OP(ch, 1), chip );
+	Channel_TrySteady( ch, chip, samples, output, true, ch->maskLeft, ch->maskRight );
 
 	for ( i = 0; i < samples; i++ ) {
 		//Do unsigned shift so we can shift out all bits but still stay in 10 bit range otherwise
@@ -784,16 +1027,16 @@ static Channel* Channel_Block_sm3AM( Channel* ch, Chip* chip, uint16_t samples,
 		out0 = ch->old[0];
 		sample = (int32_t)(out0 + Operator_GetSample( &CH_OP(ch, 1), 0 ));
 
-		output[ 0 ] += (int16_t) sample & ch->maskLeft;
-		output[ 1 ] += (int16_t) sample & ch->maskRight;
-		output += 2;
+		mix[ i ] = (int16_t) sample;
 	}
+	Chip_MixChannel( chip, output, samples, ch->maskLeft, ch->maskRight );
 
 	return ( ch + 1 );
 }
 
-static Channel* Channel_Block_sm3FM( Channel* ch, Chip* chip, uint16_t samples, int16_t* output ) {
+static Channel* Channel_Block_sm3FM( Channel* ch, Chip* chip, uint16_t samples, int32_t* output ) {
 	uint16_t i;
+	int16_t* mix = chip->mixBuf;
 	
 	if ( Operator_Silent(&CH_OP(ch, 1)) ) {
 		ch->old[0] = ch->old[1] = 0L;
@@ -803,6 +1046,7 @@ static Channel* Channel_Block_sm3FM( Channel* ch, Chip* chip, uint16_t samples,
 	//Init the operators with the the current vibrato and tremolo values
 	Operator_Prepare( &CH_OP(ch, 0), chip );
 	Operator_Prepare( &CH_OP(ch, 1), chip );
+	Channel_TrySteady( ch, chip, samples, output, false, ch->maskLeft, ch->maskRight );
 
 	for ( i = 0; i < samples; i++ ) {
 		//Do unsigned shift so we can shift out all bits but still stay in 10 bit range otherwise
@@ -814,16 +1058,16 @@ static Channel* Channel_Block_sm3FM( Channel* ch, Chip* chip, uint16_t samples,
 		out0 = ch->old[0];
 		sample = (int32_t)Operator_GetSample( &CH_OP(ch, 1), out0 );
 
-		output[ 0 ] += (int16_t) sample & ch->maskLeft;
-		output[ 1 ] += (int16_t) sample & ch->maskRight;
-		output += 2;
+		mix[ i ] = (int16_t) sample;
 	}
+	Chip_MixChannel( chip, output, samples, ch->maskLeft, ch->maskRight );
 
 	return ( ch + 1 );
 }
 
-static Channel* Channel_Block_sm3FMFM( Channel* ch, Chip* chip, uint16_t samples, int16_t* output ) {
+static Channel* Channel_Block_sm3FMFM( Channel* ch, Chip* chip, uint16_t samples, int32_t* output ) {
 	uint16_t i;
+	int16_t* mix = chip->mixBuf;
 	
 	if ( Operator_Silent(&CH_OP(ch, 3)) ) {
 		ch->old[0] = ch->old[1] = 0L;
@@ -851,15 +1095,16 @@ static Channel* Channel_Block_sm3FMFM( Channel* ch, Chip* chip, uint16_t samples
 		next = Operator_GetSample( &CH_OP(ch, 2), next );
 		sample = (int32_t)Operator_GetSample( &CH_OP(ch, 3), next );
 
-		output[ 0 ] += (int16_t) sample & ch->maskLeft;
-		output[ 1 ] += (int16_t) sample & ch->maskRight;
-		output += 2;
+		mix[ i ] = (int16_t) sample;
 	}
+	Chip_MixChannel( chip, output, samples, ch->maskLeft, ch->maskRight );
+
 	return( ch + 2 );
 }
 
-static Channel* Channel_Block_sm3AMFM( Channel* ch, Chip* chip, uint16_t samples, int16_t* output ) {
+static Channel* Channel_Block_sm3AMFM( Channel* ch, Chip* chip, uint16_t samples, int32_t* output ) {
 	uint16_t i;
+	int16_t* mix = chip->mixBuf;
 	
 	if ( Operator_Silent(&CH_OP(ch, 0)) && Operator_Silent(&CH_OP(ch, 3)) ) {
 		ch->old[0] = ch->old[1] = 0L;
@@ -887,15 +1132,16 @@ static Channel* Channel_Block_sm3AMFM( Channel* ch, Chip* chip, uint16_t samples
 		next = Operator_GetSample( &CH_OP(ch, 2), next );
 		sample += (int32_t)Operator_GetSample( &CH_OP(ch, 3), next );
 
-		output[ 0 ] += (int16_t) sample & ch->maskLeft;
-		output[ 1 ] += (int16_t) sample & ch->maskRight;
-		output += 2;
+		mix[ i ] = (int16_t) sample;
 	}
+	Chip_MixChannel( chip, output, samples, ch->maskLeft, ch->maskRight );
+
 	return( ch + 2 );
 }
 
-static Channel* Channel_Block_sm3FMAM( Channel* ch, Chip* chip, uint16_t samples, int16_t* output ) {
+static Channel* Channel_Block_sm3FMAM( Channel* ch, Chip* chip, uint16_t samples, int32_t* output ) {
 	uint16_t i;
+	int16_t* mix = chip->mixBuf;
 	
 	if ( Operator_Silent(&CH_OP(ch, 1)) && Operator_Silent(&CH_OP(ch, 3)) ) {
 		ch->old[0] = ch->old[1] = 0;
@@ -922,16 +1168,16 @@ static Channel* Channel_Block_sm3FMAM( Channel* ch, Chip* chip, uint16_t samples
 		next = Operator_GetSample( &CH_OP(ch, 2), 0 );
 		sample += (int32_t)Operator_GetSample( &CH_OP(ch, 3), next );
 
-		output[ 0 ] += (int16_t) sample & ch->maskLeft;
-		output[ 1 ] += (int16_t) sample & ch->maskRight;
-		output += 2;
+		mix[ i ] = (int16_t) sample;
 	}
+	Chip_MixChannel( chip, output, samples, ch->maskLeft, ch->maskRight );
 
 	return( ch + 2 );
 }
 
-static Channel* Channel_Block_sm3AMAM( Channel* ch, Chip* chip, uint16_t samples, int16_t* output ) {
+static Channel* Channel_Block_sm3AMAM( Channel* ch, Chip* chip, uint16_t samples, int32_t* output ) {
 	uint16_t i;
+	int16_t* mix = chip->mixBuf;
 	
 	if ( Operator_Silent(&CH_OP(ch, 0)) && Operator_Silent(&CH_OP(ch, 2)) && Operator_Silent(&CH_OP(ch, 3)) ) {
 		ch->old[0] = ch->old[1] = 0;
@@ -959,106 +1205,253 @@ static Channel* Channel_Block_sm3AMAM( Channel* ch, Chip* chip, uint16_t samples
 		sample += (int32_t)Operator_GetSample( &CH_OP(ch, 2), next );
 		sample += (int32_t)Operator_GetSample( &CH_OP(ch, 3), 0 );
 
-		output[ 0 ] += (int16_t) sample & ch->maskLeft;
-		output[ 1 ] += (int16_t) sample & ch->maskRight;
-		output += 2;
+		mix[ i ] = (int16_t) sample;
 	}
+	Chip_MixChannel( chip, output, samples, ch->maskLeft, ch->maskRight );
 
 	return( ch + 2 );
 }
 
-static inline uint32_t Chip_ForwardNoise( Chip* chip ) {
-	uint32_t count;
-	chip->noiseCounter += NoiseAdd;
-	count = chip->noiseCounter >> LFO_SH;
-	chip->noiseCounter &= ((1UL<<LFO_SH) - 1);
-	for ( ; count > 0; --count ) {
-		//Noise calculation from mame
-		chip->noiseValue ^= ( 0x800302UL ) & ( 0UL - (chip->noiseValue & 1UL ) );
-		chip->noiseValue >>= 1;
+//Gets the operators of the voice starting at <ch> that are heard (bit per operator, 0 = percussion)
+//and the channels it takes up
+static uint8_t Channel_Carriers( const Channel* ch, uint8_t* stride ) {
+	Channel_SynthHandler handler = ch->synthHandler;
+
+	*stride = 2;
+	if ( handler == Channel_Block_sm3FMFM )
+		return 0x8;
+	if ( handler == Channel_Block_sm3AMFM )
+		return 0x9;
+	if ( handler == Channel_Block_sm3FMAM )
+		return 0xa;
+	if ( handler == Channel_Block_sm3AMAM )
+		return 0xd;
+
+	*stride = 1;
+	if ( handler == Channel_Block_sm2AM || handler == Channel_Block_sm3AM )
+		return 0x3;
+	if ( handler == Channel_Block_sm2FM || handler == Channel_Block_sm3FM )
+		return 0x2;
+
+	*stride = 3;
+	return 0;
+}
+
+//Keeps a voice going that isn't rendered, its envelopes and phases move on as if it was
+static Channel* Channel_Block_Dropped( Channel* ch, Chip* chip, uint16_t samples ) {
+	uint8_t stride;
+	uint8_t i;
+
+	Channel_Carriers( ch, &stride );
+	for ( i = 0; i < stride * 2; i++ ) {
+		Operator* op = &CH_OP(ch, i);
+		Operator_ForwardEnvelope( op, samples );
+		if ( !chip->blockEnvelope )
+			op->volHandler = VolumeHandlerTable[ op->state ];
+		op->waveIndex += op->waveAdd * samples;
+	}
+	ch->old[0] = ch->old[1] = 0L;
+
+	return ch + stride;
+}
+
+//Marks the voices that don't fit into the voice limit for this block
+static void Chip_DropVoices( Chip* chip, Channel* upperBound ) {
+	Channel* voice[ 18 ];
+	uint16_t priority[ 18 ];
+	uint8_t count = 0;
+	uint8_t stride;
+	Channel* ch;
+
+	for ( ch = chip->chan; ch < upperBound; ch += stride ) {
+		uint8_t carriers = Channel_Carriers( ch, &stride );
+		//Percussion always stays
+		uint16_t prio = 0xffff;
+		ch->dropped = false;
+
+		if ( carriers ) {
+			int32_t loudest = ENV_MAX << 1;
+			bool audible = false;
+			bool released = true;
+			uint8_t i;
+
+			for ( i = 0; i < 4; i++ ) {
+				Operator* op = &CH_OP(ch, i);
+				if ( !( carriers & ( 1 << i ) ) )
+					continue;
+				if ( !Operator_Silent( op ) )
+					audible = true;
+				if ( op->state > RELEASE )
+					released = false;
+				if ( op->totalLevel + op->volume < loudest )
+					loudest = op->totalLevel + op->volume;
+			}
+			//Silent voices don't cost anything
+			if ( !audible )
+				continue;
+			//Released voices go first, louder ones last
+			prio = (uint16_t)( ( released ? 0 : 0x4000 ) + ( 0x3fff - loudest ) );
+		}
+		voice[ count ] = ch;
+		priority[ count ] = prio;
+		count++;
+	}
+
+	while ( count > chip->voiceLimit ) {
+		uint8_t quietest = 0;
+		uint8_t i;
+		for ( i = 1; i < count; i++ ) {
+			if ( priority[ i ] < priority[ quietest ] )
+				quietest = i;
+		}
+		voice[ quietest ]->dropped = true;
+		count--;
+		voice[ quietest ] = voice[ count ];
+		priority[ quietest ] = priority[ count ];
 	}
-	return chip->noiseValue;
 }
 
-// Inline here because we optimized this to only have one instance
-static inline void Channel_GeneratePercussion( Channel *ch, Chip* chip, int16_t* output ) {
-	//BassDrum
-	int32_t mod = (int32_t)((uint32_t)(ch->old[0] + ch->old[1]) >> ch->feedback);
+//Runs the noise generator for <samples> samples, bit ( i & 15 ) of bits[ i >> 4 ] is its output bit for sample i
+static void Chip_ForwardNoiseBlock( Chip* chip, uint16_t samples, uint16_t* bits ) {
+	uint32_t counter = chip->noiseCounter;
+	uint32_t value = chip->noiseValue;
+	uint16_t i;
+	for ( i = 0; i < samples; i++ ) {
+		uint16_t count;
+		counter += NoiseAdd;
+		count = (uint16_t)( counter >> LFO_SH );
+		counter &= ((1UL<<LFO_SH) - 1);
+		for ( ; count > 0; --count ) {
+			//Noise calculation from mame
+			value ^= ( 0x800302UL ) & ( 0UL - (value & 1UL ) );
+			value >>= 1;
+		}
+		if ( !( i & 15 ) )
+			bits[ i >> 4 ] = 0;
+		bits[ i >> 4 ] |= (uint16_t)( value & 1 ) << ( i & 15 );
+	}
+	chip->noiseCounter = counter;
+	chip->noiseValue = value;
+}
 
-	ch->old[0] = ch->old[1];
-	ch->old[1] = (int32_t)Operator_GetSample( &CH_OP(ch, 0), mod );
+//An operator that is off stays silent for the whole block, only its phase moves on
+static inline void Operator_SkipBlock( Operator* op, uint16_t samples ) {
+	op->waveIndex += op->waveCurrent * samples;
+}
 
-	//When bassdrum is in AM mode first operator is ignoed
-	if ( ch->regC0 & 1 ) {
-		mod = 0;
-	} else {
-		mod = ch->old[0];
-	}
+//The drums don't depend on each other's output, so each one is done for the whole block at once.
+//Only the hi-hat, snare drum and top cymbal share the noise and the phase bit of operators 2 and 5.
+static Channel* Channel_Block_smPercussion( Channel* ch, Chip* chip, uint16_t samples, int32_t* output ) {
+	uint16_t noise[ DBOPL_MIX_CHUNK / 16 ];
+	uint16_t i;
+	int16_t* mix = chip->mixBuf;
+	Operator* hh = &CH_OP(ch, 2);
+	Operator* sd = &CH_OP(ch, 3);
+	Operator* tt = &CH_OP(ch, 4);
+	Operator* tc = &CH_OP(ch, 5);
+	bool hhOn = hh->state != OFF;
+	bool sdOn = sd->state != OFF;
+	bool tcOn = tc->state != OFF;
 
-	{
-		int32_t sample = (int32_t)Operator_GetSample( &CH_OP(ch, 1), mod );
+	//Init the operators with the the current vibrato and tremolo values
+	Operator_Prepare( &CH_OP(ch, 0), chip );
+	Operator_Prepare( &CH_OP(ch, 1), chip );
 
-		//Precalculate stuff used by other outputs
-		uint32_t noiseBit = Chip_ForwardNoise(chip) & 0x1;
-		uint32_t c2 = (uint32_t)Operator_ForwardWave(&CH_OP(ch, 2));
-		uint32_t c5 = (uint32_t)Operator_ForwardWave(&CH_OP(ch, 5));
-		uint32_t phaseBit = (((c2 & 0x88) ^ ((c2<<5) & 0x80)) | ((c5 ^ (c5<<2)) & 0x20)) ? 0x02 : 0x00;
-	
-		{
-			//Hi-Hat
-			uint32_t hhVol = (uint32_t)Operator_ForwardVolume(&CH_OP(ch, 2));
-			if ( !ENV_SILENT( hhVol ) ) {
-				uint32_t hhIndex = (phaseBit<<8) | (0x34 << ( phaseBit ^ (noiseBit << 1 )));
-				sample += (int32_t)Operator_GetWave(&CH_OP(ch, 2), hhIndex, hhVol );
-			}
-		}
+	Operator_Prepare( hh, chip );
+	Operator_Prepare( sd, chip );
 
-		{
-			//Snare Drum
-			uint32_t sdVol = (uint32_t)Operator_ForwardVolume(&CH_OP(ch, 3));
-			if ( !ENV_SILENT( sdVol ) ) {
-				uint32_t sdIndex = ( 0x100 + (c2 & 0x100) ) ^ ( noiseBit << 8 );
-				sample += (int32_t)Operator_GetWave(&CH_OP(ch, 3), sdIndex, sdVol );
-			}
-		}
+	Operator_Prepare( tt, chip );
+	Operator_Prepare( tc, chip );
 
-		{
-			//Tom-tom
-			sample += (int32_t)Operator_GetSample(&CH_OP(ch, 4), 0);
-		}
+	//BassDrum
+	if ( CH_OP(ch, 0).state == OFF && CH_OP(ch, 1).state == OFF ) {
+		Operator_SkipBlock( &CH_OP(ch, 0), samples );
+		Operator_SkipBlock( &CH_OP(ch, 1), samples );
+		//The modulator output history is all silence after two samples
+		ch->old[0] = ( samples > 1 ) ? 0 : ch->old[1];
+		ch->old[1] = 0;
+		memset( mix, 0, samples * sizeof( mix[ 0 ] ) );
+	} else {
+		for ( i = 0; i < samples; i++ ) {
+			int32_t mod = (int32_t)((uint32_t)(ch->old[0] + ch->old[1]) >> ch->feedback);
 
-		{
-			//Top-Cymbal
-			uint32_t tcVol = (uint32_t)Operator_ForwardVolume(&CH_OP(ch, 5));
-			if ( !ENV_SILENT( tcVol ) ) {
-				uint32_t tcIndex = (1 + phaseBit) << 8;
-				sample += (int32_t)Operator_GetWave( &CH_OP(ch, 5), tcIndex, tcVol );
+			ch->old[0] = ch->old[1];
+			ch->old[1] = (int32_t)Operator_GetSample( &CH_OP(ch, 0), mod );
+
+			//When bassdrum is in AM mode first operator is ignoed
+			if ( ch->regC0 & 1 ) {
+				mod = 0;
+			} else {
+				mod = ch->old[0];
 			}
+			mix[ i ] = (int16_t)Operator_GetSample( &CH_OP(ch, 1), mod );
 		}
+	}
 
-		sample <<= 1;
-		output[0] += (int16_t) sample;
-		output[1] += (int16_t) sample;
+	//Tom-tom
+	if ( tt->state == OFF ) {
+		Operator_SkipBlock( tt, samples );
+	} else {
+		for ( i = 0; i < samples; i++ )
+			mix[ i ] += (int16_t)Operator_GetSample( tt, 0 );
 	}
-}
 
-static Channel* Channel_Block_smPercussion( Channel* ch, Chip* chip, uint16_t samples, int16_t* output ) {
-	uint16_t i;
+	//The noise keeps running even when nothing uses it
+	Chip_ForwardNoiseBlock( chip, samples, noise );
 
-	//Init the operators with the the current vibrato and tremolo values
-	Operator_Prepare( &CH_OP(ch, 0), chip );
-	Operator_Prepare( &CH_OP(ch, 1), chip );
+	if ( !hhOn && !sdOn && !tcOn ) {
+		Operator_SkipBlock( hh, samples );
+		Operator_SkipBlock( tc, samples );
+		//The drums are mixed at twice the volume of the other channels
+		for ( i = 0; i < samples; i++ )
+			mix[ i ] <<= 1;
+	} else {
+		uint16_t noiseBits = 0;
+		for ( i = 0; i < samples; i++ ) {
+			//Precalculate stuff used by other outputs
+			uint16_t noiseBit;
+			uint16_t c2, c5, phaseBit;
+			int16_t sample = mix[ i ];
+
+			if ( !( i & 15 ) )
+				noiseBits = noise[ i >> 4 ];
+			noiseBit = noiseBits & 0x1;
+			noiseBits >>= 1;
+			c2 = (uint16_t)Operator_ForwardWave( hh );
+			c5 = (uint16_t)Operator_ForwardWave( tc );
+			phaseBit = (((c2 & 0x88) ^ ((c2<<5) & 0x80)) | ((c5 ^ (c5<<2)) & 0x20)) ? 0x02 : 0x00;
 
-	Operator_Prepare( &CH_OP(ch, 2), chip );
-	Operator_Prepare( &CH_OP(ch, 3), chip );
+			//Hi-Hat
+			if ( hhOn ) {
+				Bitu hhVol = Operator_ForwardVolume( hh );
+				if ( !ENV_SILENT( hhVol ) ) {
+					Bitu hhIndex = (phaseBit<<8) | (0x34 << ( phaseBit ^ (noiseBit << 1 )));
+					sample += (int16_t)Operator_GetWave( hh, hhIndex, hhVol );
+				}
+			}
 
-	Operator_Prepare( &CH_OP(ch, 4), chip );
-	Operator_Prepare( &CH_OP(ch, 5), chip );
+			//Snare Drum
+			if ( sdOn ) {
+				Bitu sdVol = Operator_ForwardVolume( sd );
+				if ( !ENV_SILENT( sdVol ) ) {
+					Bitu sdIndex = ( 0x100 + (c2 & 0x100) ) ^ ( noiseBit << 8 );
+					sample += (int16_t)Operator_GetWave( sd, sdIndex, sdVol );
+				}
+			}
 
-	for ( i = 0; i < samples; i++ ) {
-		Channel_GeneratePercussion( ch, chip, output );
-		output += 2;
+			//Top-Cymbal
+			if ( tcOn ) {
+				Bitu tcVol = Operator_ForwardVolume( tc );
+				if ( !ENV_SILENT( tcVol ) ) {
+					Bitu tcIndex = (1 + phaseBit) << 8;
+					sample += (int16_t)Operator_GetWave( tc, tcIndex, tcVol );
+				}
+			}
+
+			mix[ i ] = (int16_t)( sample << 1 );
+		}
 	}
+	Chip_MixChannel( chip, output, samples, -1, -1 );
 
 	return( ch + 3 );
 }
@@ -1085,9 +1478,15 @@ static void Channel_Reset(Channel *ch) {
 
 void Channel_SetChanData( Channel* ch, const Chip* chip, uint32_t data ) {
 	uint32_t change = ch->chanData ^ data;
+	//The channel may have the new block already, the operators still have the old one
+	bool blockChange = ( ( (&CH_OP(ch, 0))->chanData ^ data ) & ( 7UL << 10 ) ) != 0;
 	ch->chanData = data;
 	(&CH_OP(ch, 0))->chanData = data;
 	(&CH_OP(ch, 1))->chanData = data;
+	if ( blockChange ) {
+		Operator_UpdateBlockMul( &CH_OP(ch, 0) );
+		Operator_UpdateBlockMul( &CH_OP(ch, 1) );
+	}
 	//Since a frequency update triggered this, always update frequency
 	Operator_UpdateFrequency( &CH_OP(ch, 0) );
 	Operator_UpdateFrequency( &CH_OP(ch, 1) );
@@ -1102,16 +1501,22 @@ void Channel_SetChanData( Channel* ch, const Chip* chip, uint32_t data ) {
 	}
 }
 
-void Channel_UpdateFrequency( Channel* ch, const Chip* chip, uint8_t fourOp ) {
-	//Extrace the frequency bits
-	uint32_t data = ch->chanData & 0xffff;
-	uint32_t kslBase = KslTable[ data >> 6 ];
-	uint32_t keyCode = ( data & 0x1c00) >> 9;
+//Key code of the block/F-number in the lower bits of chanData
+static inline uint8_t Chip_KeyCode( const Chip* chip, uint16_t data ) {
+	uint8_t keyCode = (uint8_t)(( data & 0x1c00) >> 9);
 	if ( chip->reg08 & 0x40 ) {
 		keyCode |= ( data & 0x100)>>8;	/* notesel == 1 */
 	} else {
 		keyCode |= ( data & 0x200)>>9;	/* notesel == 0 */
 	}
+	return keyCode;
+}
+
+void Channel_UpdateFrequency( Channel* ch, const Chip* chip, uint8_t fourOp ) {
+	//Extrace the frequency bits
+	uint32_t data = ch->chanData & 0xffff;
+	uint32_t kslBase = KslTable[ data >> 6 ];
+	uint32_t keyCode = Chip_KeyCode( chip, (uint16_t)data );
 	//Add the keycode and ksl into the highest bits of chanData
 	data |= (keyCode << SHIFT_KEYCODE) | ( kslBase << SHIFT_KSLBASE );
 	Channel_SetChanData( ch + 0, chip, data );
@@ -1120,74 +1525,77 @@ void Channel_UpdateFrequency( Channel* ch, const Chip* chip, uint8_t fourOp ) {
 	}
 }
 
-void Channel_UpdateSynth( Channel *ch, const Chip* chip ) {
-	//Select the new synth mode
-	if ( chip->opl3Active ) {
-		//4-op mode enabled for this channel
-		if ( (chip->reg104 & ch->fourMask) & 0x3f ) {
-			Channel* chan0, *chan1;
-			uint8_t synth;
-			//Check if it's the 2nd channel in a 4-op
-			if ( !(ch->fourMask & 0x80 ) ) {
-				chan0 = ch;
-				chan1 = ch + 1;
-			} else {
-				chan0 = ch - 1;
-				chan1 = ch;
-			}
+//2-op synth handlers by OPL3 mode and connection (regC0 bit 0)
+static const Channel_SynthHandler TwoOpHandlers[ 2 ][ 2 ] = {
+	{ Channel_Block_sm2FM, Channel_Block_sm2AM },
+	{ Channel_Block_sm3FM, Channel_Block_sm3AM },
+};
 
-			synth = ( (chan0->regC0 & 1) << 0 )| (( chan1->regC0 & 1) << 1 );
-			
-			switch ( synth ) {
-			case 0:
-				chan0->synthHandler = Channel_Block_sm3FMFM;// &Channel::BlockTemplate< sm3FMFM >;
-				break;
-			case 1:
-				chan0->synthHandler = Channel_Block_sm3AMFM;// &Channel::BlockTemplate< sm3AMFM >;
-				break;
-			case 2:
-				chan0->synthHandler = Channel_Block_sm3FMAM;// &Channel::BlockTemplate< sm3FMAM >;
-				break;
-			case 3:
-				chan0->synthHandler = Channel_Block_sm3AMAM;// &Channel::BlockTemplate< sm3AMAM >;
-				break;
-			}
-		//Disable updating percussion channels
-		} else if ((ch->fourMask & 0x40) && ( chip->regBD & 0x20) ) {
+//4-op synth handlers by the connections of both channels
+static const Channel_SynthHandler FourOpHandlers[ 4 ] = {
+	Channel_Block_sm3FMFM, Channel_Block_sm3AMFM, Channel_Block_sm3FMAM, Channel_Block_sm3AMAM,
+};
 
-		//Regular dual op, am or fm
-		} else if (ch->regC0 & 1 ) {
-			ch->synthHandler = Channel_Block_sm3AM;//&Channel::BlockTemplate< sm3AM >;
+void Channel_UpdateSynth( Channel *ch, const Chip* chip ) {
+	uint8_t opl3 = chip->opl3Active & 1;
+	//Select the new synth mode
+	//4-op mode enabled for this channel
+	if ( opl3 && ( (chip->reg104 & ch->fourMask) & 0x3f ) ) {
+		Channel* chan0, *chan1;
+		//Check if it's the 2nd channel in a 4-op
+		if ( !(ch->fourMask & 0x80 ) ) {
+			chan0 = ch;
+			chan1 = ch + 1;
 		} else {
-			ch->synthHandler = Channel_Block_sm3FM;//&Channel::BlockTemplate< sm3FM >;
+			chan0 = ch - 1;
+			chan1 = ch;
 		}
+		chan0->synthHandler = FourOpHandlers[ ( (chan0->regC0 & 1) << 0 )| (( chan1->regC0 & 1) << 1 ) ];
+	//Disable updating percussion channels
+	} else if ( !( (ch->fourMask & 0x40) && ( chip->regBD & 0x20 ) ) ) {
+		//Regular dual op, am or fm
+		ch->synthHandler = TwoOpHandlers[ opl3 ][ ch->regC0 & 1 ];
+	}
+	if ( opl3 ) {
 		ch->maskLeft = (ch->regC0 & 0x10 ) ? -1 : 0;
 		ch->maskRight = (ch->regC0 & 0x20 ) ? -1 : 0;
-	//opl2 active
-	} else { 
-		//Disable updating percussion channels
-		if ( (ch->fourMask & 0x40) && ( chip->regBD & 0x20 ) ) {
-
-		//Regular dual op, am or fm
-		} else if (ch->regC0 & 1 ) {
-			ch->synthHandler = Channel_Block_sm2AM;//&Channel::BlockTemplate< sm2AM >;
-		} else {
-			ch->synthHandler = Channel_Block_sm2FM;//&Channel::BlockTemplate< sm2FM >;
-		}
 	}
 }
 
+//Low F-number bits changed with the KSL and key code staying the same (see Channel_WriteA0)
+static void Channel_SetFrequencyLow( Channel* ch, uint8_t val ) {
+	ch->chanData = ( ch->chanData & ~0xffUL ) | val;
+	(&CH_OP(ch, 0))->chanData = ch->chanData;
+	(&CH_OP(ch, 1))->chanData = ch->chanData;
+	Operator_UpdateFrequency( &CH_OP(ch, 0) );
+	Operator_UpdateFrequency( &CH_OP(ch, 1) );
+}
+
 void Channel_WriteA0( Channel* ch, const Chip* chip, uint8_t val ) {
 	uint8_t fourOp = chip->reg104 & chip->opl3Active & ch->fourMask;
-	uint32_t change;
+	uint8_t change;
 	//Don't handle writes to silent fourop channels
 	if ( fourOp > 0x80 )
 		return;
-	change = (ch->chanData ^ val ) & 0xff;
-	if ( change ) {
-		ch->chanData ^= change;
-		Channel_UpdateFrequency( ch, chip, fourOp );
+	change = (uint8_t)ch->chanData ^ val;
+	if ( !change )
+		return;
+	//Fine pitch changes (vibrato and pitch bends by drivers) only need the operator frequencies updated.
+	//The KSL follows F-number bits 6-9, the key code only has to be checked for a note select change.
+	//The second channel of a 4-op pair has to be in step, it isn't right after it got paired up.
+	if ( !( change & 0xc0 ) && (uint8_t)( ch->chanData >> SHIFT_KEYCODE ) == Chip_KeyCode( chip, (uint16_t)ch->chanData ) ) {
+		if ( !( fourOp & 0x3f ) ) {
+			Channel_SetFrequencyLow( ch, val );
+			return;
+		}
+		if ( !( ( ch[ 1 ].chanData ^ ch->chanData ) & ~0xffUL ) ) {
+			Channel_SetFrequencyLow( ch, val );
+			Channel_SetFrequencyLow( ch + 1, val );
+			return;
+		}
 	}
+	ch->chanData ^= change;
+	Channel_UpdateFrequency( ch, chip, fourOp );
 }
 
 void Channel_WriteB0( Channel* ch, const Chip* chip, uint8_t val ) {
@@ -1255,6 +1663,8 @@ static void DumpTables( Chip* chip );
 void Chip_Reset( Chip* chip, bool _opl3Mode, uint32_t rate ) {
 	uint16_t i;
 	memset(chip, 0, sizeof(Chip));
+	chip->mixHandler = Chip_MixChannelC;
+	chip->packHandler = Chip_PackC;
 
 	for (i = 0; i < 18; i++) {
 		Channel_Reset(&chip->chan[i]);
@@ -1286,6 +1696,20 @@ static inline uint16_t Chip_ForwardLFO( Chip* chip, uint16_t samples ) {
 	chip->vibratoShift = ( VibratoTable[ chip->vibratoIndex >> 2] & 7) + chip->vibratoStrength; 
 	chip->tremoloValue = TremoloTable[ chip->tremoloIndex ] >> chip->tremoloStrength;
 
+	//Block rate LFO: keep the values for the whole block, then do all the steps it covered
+	if ( chip->blockLfo ) {
+		chip->lfoCounter += samples * LfoAdd;
+		while ( chip->lfoCounter >= LFO_MAX ) {
+			chip->lfoCounter -= LFO_MAX;
+			chip->vibratoIndex = ( chip->vibratoIndex + 1 ) & 31;
+			if ( chip->tremoloIndex + 1 < TREMOLO_TABLE  )
+				++(chip->tremoloIndex);
+			else
+				chip->tremoloIndex = 0;
+		}
+		return samples;
+	}
+
 	if ( count > (uint32_t)samples ) {
 		count = samples;
 		chip->lfoCounter += count * LfoAdd;
@@ -1352,9 +1776,11 @@ static inline void Chip_WriteBD( Chip* chip, uint8_t val ) {
 		}
 	//Toggle keyoffs when we turn off the percussion
 	} else if ( change & 0x20 ) {
-		//Trigger a reset to setup the original synth handler
-		//This makes it call
+		//Trigger a reset to setup the original synth handlers, the connections
+		//of channels 7 and 8 may have been written while the drums were on
 		Channel_UpdateSynth( &chip->chan[6], chip );
+		Channel_UpdateSynth( &chip->chan[7], chip );
+		Channel_UpdateSynth( &chip->chan[8], chip );
 		Operator_KeyOff(&(chip->chan[6].op[0]), 0x2 );
 		Operator_KeyOff(&(chip->chan[6].op[1]), 0x2 );
 		Operator_KeyOff(&(chip->chan[7].op[0]), 0x2 );
@@ -1387,6 +1813,23 @@ static inline void Chip_UpdateSynths( Chip* chip ) {
 	}
 }
 
+//First channel of the pairs selected by the 4-op bits of reg104
+static const uint8_t FourOpChannel[ 6 ] = {
+	0, 2, 4, 9, 11, 13,
+};
+
+//Only the pairs whose 4-op bit changed get new synths, the other channels don't depend on reg104
+static void Chip_UpdateFourOp( Chip* chip, uint8_t change ) {
+	uint8_t i;
+	for ( i = 0; i < 6; i++ ) {
+		if ( change & ( 1 << i ) ) {
+			Channel* ch = &chip->chan[ FourOpChannel[ i ] ];
+			Channel_UpdateSynth( ch, chip );
+			Channel_UpdateSynth( ch + 1, chip );
+		}
+	}
+}
+
 void Chip_WriteReg( Chip* chip, uint16_t reg, uint8_t val ) {
 	Bitu index;
 //	printf("WriteReg %p %u %u\n", chip, reg, val);
@@ -1397,19 +1840,22 @@ void Chip_WriteReg( Chip* chip, uint16_t reg, uint8_t val ) {
 			chip->waveFormMask = ( (val & 0x20) || chip->opl3Mode ) ? 0x7 : 0x0; 
 		} else if ( reg == 0x104 ) {
 			//Only detect changes in lowest 6 bits
-			if ( !((chip->reg104 ^ val) & 0x3f) )
+			uint8_t change = (chip->reg104 ^ val) & 0x3f;
+			if ( !change )
 				return;
 			//Always keep the highest bit enabled, for checking > 0x80
 			chip->reg104 = 0x80 | ( val & 0x3f );
-			//Switch synths when changing the 4op combinations
-			Chip_UpdateSynths(chip);
+			//Switch synths when changing the 4op combinations, they only matter in opl3 mode
+			if ( chip->opl3Active )
+				Chip_UpdateFourOp( chip, change );
 		} else if ( reg == 0x105 ) {
 			//MAME says the real opl3 doesn't reset anything on opl3 disable/enable till the next write in another register
 			if ( !((chip->opl3Active ^ val) & 1 ) )
 				return;
 			chip->opl3Active = ( val & 1 ) ? 0xff : 0;
 			//Just update the synths now that opl3 must have been enabled
-			//This isn't how the real card handles it but need to switch to stereo generating handlers
+			//This isn't how the real card handles it but need to switch to stereo generating handlers.
+			//Every channel changes, Channel_UpdateSynth picks them from tables.
 			Chip_UpdateSynths(chip);
 		} else if ( reg == 0x08 ) {
 			chip->reg08 = val;
@@ -1471,15 +1917,36 @@ int Chip_Generate( Chip* chip, int16_t* output, uint16_t count) {
 	int16_t* base = output;
 	Channel *upperBound = chip->opl3Active ? chip->chan + 18 : chip->chan + 9;
 
-	memset(output, 0, count * 4);
-
 	while ( count > 0 ) {
-		uint16_t samples = Chip_ForwardLFO( chip, count );
+		//Channel blocks can't be larger than the mix buffer
+		uint16_t samples = Chip_ForwardLFO( chip, count > DBOPL_MIX_CHUNK ? DBOPL_MIX_CHUNK : count );
+		int32_t* mix = chip->mixAcc;
 		Channel* ch;
-		for( ch = chip->chan; ch < upperBound; ) {
-			ch = ch->synthHandler( ch, chip, samples, output );
+		chip->blockSamples = samples;
+		chip->mixChannels = 0;
+#ifdef DBOPL_SSCACHE
+		chip->steadyBlock++;
+#endif
+		if ( chip->voiceLimit ) {
+			Chip_DropVoices( chip, upperBound );
+			for( ch = chip->chan; ch < upperBound; ) {
+				if ( ch->dropped )
+					ch = Channel_Block_Dropped( ch, chip, samples );
+				else
+					ch = ch->synthHandler( ch, chip, samples, mix );
+			}
+		} else {
+			for( ch = chip->chan; ch < upperBound; ) {
+				ch = ch->synthHandler( ch, chip, samples, mix );
+			}
 		}
 
+		//Nothing was mixed when all channels are silent
+		if ( chip->mixChannels )
+			chip->packHandler( output, mix, samples << 1 );
+		else
+			memset( output, 0, samples * 4 );
+
 		count -= samples;
 		output += samples << 1;
 	}
@@ -1510,22 +1977,26 @@ void DumpTables( Chip* chip ) {
 	}
 	fprintf(f, "\n}; \n");
 
-#if ( DBOPL_WAVE == WAVE_HANDLER ) || ( DBOPL_WAVE == WAVE_TABLELOG )
+#if (( DBOPL_WAVE == WAVE_HANDLER ) && !defined( SHARED_TBL )) || ( DBOPL_WAVE == WAVE_TABLELOG )
+	fprintf(f, "#ifndef SHARED_TBL\n");
 	fprintf(f, "static uint16_t ExpTable[256] = { \n");
 	for (i = 0; i < 256; i++) {
 		fprintf(f, "%u, ", ExpTable[i]);
 		if (i % 16 == 15) fprintf(f, "\n");
 	}
 	fprintf(f, "\n}; \n");
+	fprintf(f, "#endif\n");
 #endif
 
-#if ( DBOPL_WAVE == WAVE_HANDLER )
+#if ( DBOPL_WAVE == WAVE_HANDLER ) && !defined( SHARED_TBL )
+	fprintf(f, "#ifndef SHARED_TBL\n");
 	fprintf(f, "static uint16_t SinTable[512] = { \n");
 	for (i = 0; i < 512; i++) {
 		fprintf(f, "%u, ", SinTable[i]);
 		if (i % 16 == 15) fprintf(f, "\n");
 	}
 	fprintf(f, "\n}; \n");
+	fprintf(f, "#endif\n");
 #endif
 
 #if (( DBOPL_WAVE == WAVE_TABLELOG ) || ( DBOPL_WAVE == WAVE_TABLEMUL ))
@@ -1557,6 +2028,64 @@ void DumpTables( Chip* chip ) {
 }
 #endif
 
+#ifdef PRECALC_TBL
+//Points the chip at the precalculated tables for <rate>
+static void Chip_SelectTables( Chip* chip, uint32_t rate ) {
+	if ( rate == PRECALC_RATE / 2 ) {
+		chip->freqMul = Precalc12FreqMul;
+		chip->linearRates = Precalc12LinearRates;
+		chip->attackRates = Precalc12AttackRates;
+		chip->lfoAdd = Precalc12LfoAdd;
+		chip->noiseAdd = Precalc12NoiseAdd;
+	} else {
+		//Other rates than the precalculated ones aren't supported, they play at the wrong pitch
+		chip->freqMul = PrecalcFreqMul;
+		chip->linearRates = PrecalcLinearRates;
+		chip->attackRates = PrecalcAttackRates;
+		chip->lfoAdd = PrecalcLfoAdd;
+		chip->noiseAdd = PrecalcNoiseAdd;
+	}
+}
+
+void Chip_SetRate( Chip* chip, uint32_t rate ) {
+	uint16_t i;
+	Chip_SelectTables( chip, rate );
+	//Phases and envelopes carry on, only their speeds change
+	for ( i = 0; i < 18; i++ ) {
+		uint8_t o;
+		for ( o = 0; o < 2; o++ ) {
+			Operator* op = &chip->chan[ i ].op[ o ];
+			op->freqMul = FreqMul[ op->reg20 & 0xf ];
+			Operator_UpdateBlockMul( op );
+			Operator_UpdateFrequency( op );
+			Operator_UpdateAttack( op, chip );
+			Operator_UpdateDecay( op, chip );
+			Operator_UpdateRelease( op, chip );
+		}
+	}
+}
+#endif
+
+void Chip_SetVoiceLimit( Chip* chip, uint8_t voices ) {
+	uint16_t i;
+	chip->voiceLimit = voices;
+	for ( i = 0; i < 18; i++ )
+		chip->chan[ i ].dropped = false;
+}
+
+void Chip_SetQuality( Chip* chip, bool blockLfo, bool blockEnvelope ) {
+	uint16_t i;
+	chip->blockLfo = blockLfo;
+	if ( chip->blockEnvelope && !blockEnvelope ) {
+		//Back to the envelope handlers of the states
+		for ( i = 0; i < 18; i++ ) {
+			chip->chan[ i ].op[ 0 ].volHandler = VolumeHandlerTable[ chip->chan[ i ].op[ 0 ].state ];
+			chip->chan[ i ].op[ 1 ].volHandler = VolumeHandlerTable[ chip->chan[ i ].op[ 1 ].state ];
+		}
+	}
+	chip->blockEnvelope = blockEnvelope;
+}
+
 void Chip_Setup( Chip* chip, uint32_t rate ) {
 #ifndef PRECALC_TBL
 	double scale = OPLRATE / (double)rate;
@@ -1573,7 +2102,9 @@ void Chip_Setup( Chip* chip, uint32_t rate ) {
 	chip->vibratoIndex = 0;
 	chip->tremoloIndex = 0;
 
-#ifndef PRECALC_TBL
+#ifdef PRECALC_TBL
+	Chip_SelectTables( chip, rate );
+#else
 	chip->noiseAdd = (uint32_t)( 0.5 + scale * ( 1UL << LFO_SH ) );
 	chip->lfoAdd = (uint32_t)( 0.5 + scale * ( 1UL << LFO_SH ) );
 
@@ -1718,7 +2249,7 @@ static void InitTables( void ) {
 
 #ifndef PRECALC_TBL
 
-#if ( DBOPL_WAVE == WAVE_HANDLER ) || ( DBOPL_WAVE == WAVE_TABLELOG )
+#if (( DBOPL_WAVE == WAVE_HANDLER ) && !defined( SHARED_TBL )) || ( DBOPL_WAVE == WAVE_TABLELOG )
 	//Exponential volume table, same as the real adlib
 	for ( i = 0; i < 256; i++ ) {
 		//Save them in reverse
@@ -1728,7 +2259,7 @@ static void InitTables( void ) {
 		ExpTable[i] *= 2;
 	}
 #endif
-#if ( DBOPL_WAVE == WAVE_HANDLER )
+#if ( DBOPL_WAVE == WAVE_HANDLER ) && !defined( SHARED_TBL )
 	//Add 0.5 for the trunc rounding of the integer cast
 	//Do a PI sinetable instead of the original 0.5 PI
 	for ( i = 0; i < 512; i++ ) {
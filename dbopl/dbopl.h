@@ -23,7 +23,11 @@
  Extra defines:
 	PRECALC_TBL			Does *not* generate table. Ideal for static environments with one chip and fixed sample rates.
 						If this is defined, you need a "PRECALC.INC" file for your sample rate.
+						"PRECALC12.INC" has the rate dependent tables for half of it (12000 Hz), used when
+						the chip is set up for that rate.
 	DUMP_TABLES			Creates a 'precalc.inc' file with table definitions when initializing the chip
+	DBOPL_SSCACHE=<n>	Replays the waveforms of up to <n> channels in a steady state (sustained, no tremolo) from
+						tables indexed by phase instead of generating every sample. Costs 4 KB per channel.
  */
 #ifndef DBOPL_H
 #define DBOPL_H
@@ -51,16 +55,57 @@
 typedef uintptr_t Bitu;
 typedef intptr_t Bits;
 
+//The wave generators get by with 16 bits: a 10 bit wave index, a 12 bit volume and results within +-4095.
+//On DOS16 that keeps them in 16-bit registers instead of long math through the runtime helpers,
+//define DBOPL_WAVE16 to try the same code elsewhere.
+#if defined( DOS16 ) && !defined( DBOPL_WAVE16 )
+#define DBOPL_WAVE16
+#endif
+
+#ifdef DBOPL_WAVE16
+typedef uint16_t WaveBitu;
+typedef int16_t WaveBits;
+#else
+typedef Bitu WaveBitu;
+typedef Bits WaveBits;
+#endif
+
 struct _Chip;
 struct _Operator;
 struct _Channel;
 
 #if (DBOPL_WAVE == WAVE_HANDLER)
-typedef Bits ( DB_FASTCALL *WaveHandler) ( Bitu i, Bitu volume );
+typedef WaveBits ( DB_FASTCALL *WaveHandler) ( WaveBitu i, WaveBitu volume );
 #endif
 
 typedef Bits ( *Operator_VolumeHandler) ( struct _Operator* op );
-typedef struct _Channel* ( *Channel_SynthHandler) ( struct _Channel* ch, struct _Chip* chip, uint16_t samples, int16_t* output );
+typedef struct _Channel* ( *Channel_SynthHandler) ( struct _Channel* ch, struct _Chip* chip, uint16_t samples, int32_t* output );
+//Adds a block of mono channel samples into the 32-bit stereo mix, masks are 0 or -1 per side
+typedef void ( *Chip_MixHandler) ( int32_t* output, const int16_t* input, uint16_t samples, int16_t maskLeft, int16_t maskRight );
+//Saturates <count> 32-bit mixed samples into the 16-bit output
+typedef void ( *Chip_PackHandler) ( int16_t* output, const int32_t* input, uint16_t count );
+
+//Largest block a channel renders at once, size of the chip's mix buffer
+#define DBOPL_MIX_CHUNK	128
+
+#ifdef DBOPL_SSCACHE
+//Steady state cache: DBOPL_SSCACHE channels at a time can replay their waveforms by phase
+//while both operators hold their volume (sustain or off, no tremolo)
+#if ( DBOPL_WAVE != WAVE_HANDLER )
+#error "The steady state cache needs the wave handlers"
+#endif
+#define DBOPL_SS_WAVE	1024
+//Marks a table entry that hasn't been generated yet, no waveform gets anywhere near it
+#define DBOPL_SS_EMPTY	((int16_t)0x8080)
+
+typedef struct {
+	const struct _Channel* owner;		//Channel using the tables, NULL if none
+	uint16_t used;				//Chip block counter when the owner last used it
+	uint32_t level[2];			//Volume of each operator the tables were generated with
+	WaveHandler handler[2];		//Waveform of each operator the tables were generated with
+	int16_t wave[2][ DBOPL_SS_WAVE ];
+} SteadyCache;
+#endif
 
 //Different synth modes that can generate blocks of data
 typedef enum {
@@ -99,45 +144,55 @@ typedef enum {
 	ATTACK,
 } Operator_State;
 
-#pragma pack(1)
+//Packed to DWORDs: the 32-bit fields are aligned as long as the chip is (16-bit compilers only align it to a WORD,
+//the owner has to take care of that), without the padding a DWORD alignment of 8-byte pointers would need on 64-bit hosts.
+//Fields used for every sample come first, setup and register shadows last.
+#pragma pack(4)
 
 typedef struct _Operator {
-	//Masks for operator 20 values
+	//Per sample
+	uint32_t waveIndex;			//WAVE_BITS shifted counter of the frequency index
+	uint32_t waveCurrent;			//waveAdd + vibratao
+	uint32_t currentLevel;		//totalLevel + tremolo
+	int32_t volume;				//The currently active volume
+	uint32_t rateIndex;			//Current position of the evenlope
 
-	Operator_VolumeHandler volHandler;
+	uint32_t attackAdd;			//Timers for the different states of the envelope
+	uint32_t decayAdd;
+	uint32_t releaseAdd;
+	int32_t sustainLevel;		//When stopping at sustain level stop here
 
+	Operator_VolumeHandler volHandler;
 #if (DBOPL_WAVE == WAVE_HANDLER)
 	WaveHandler waveHandler;	//Routine that generate a wave 
 #else
 	int16_t* waveBase;
 	uint32_t waveMask;
-	uint32_t waveStart;
 #endif
-	uint32_t waveIndex;			//WAVE_BITS shifted counter of the frequency index
-	uint32_t waveAdd;				//The base frequency without vibrato
-	uint32_t waveCurrent;			//waveAdd + vibratao
 
-	uint32_t chanData;			//Frequency/octave and derived data coming from whatever channel controls this
-	uint32_t freqMul;				//Scale channel frequency with this, TODO maybe remove?
+	//Active part of the envelope we're in
+	uint8_t state;
+	//Register 20, the volume handlers check the sustain bit
+	uint8_t reg20;
+	uint8_t rateZero;				//Bits for the different states of the envelope having no changes
+	//0xff when tremolo is enabled
+	uint8_t tremoloMask;
+
+	//Per block
+	uint32_t waveAdd;				//The base frequency without vibrato
 	uint32_t vibrato;				//Scaled up vibrato strength
-	int32_t sustainLevel;		//When stopping at sustain level stop here
 	int32_t totalLevel;			//totalLevel is added to every generated volume
-	uint32_t currentLevel;		//totalLevel + tremolo
-	int32_t volume;				//The currently active volume
-	
-	uint32_t attackAdd;			//Timers for the different states of the envelope
-	uint32_t decayAdd;
-	uint32_t releaseAdd;
-	uint32_t rateIndex;			//Current position of the evenlope
 
-	uint8_t rateZero;				//Bits for the different states of the envelope having no changes
+	//Setup
+	uint32_t chanData;			//Frequency/octave and derived data coming from whatever channel controls this
+	uint32_t freqMul;				//Scale channel frequency with this, TODO maybe remove?
+	uint32_t blockMul;			//freqMul shifted up by the block of chanData
+#if (DBOPL_WAVE != WAVE_HANDLER)
+	uint32_t waveStart;
+#endif
 	uint8_t keyOn;				//Bitmask of different values that can generate keyon
 	//Registers, also used to check for changes
-	uint8_t reg20, reg40, reg60, reg80, regE0;
-	//Active part of the envelope we're in
-	uint8_t state;
-	//0xff when tremolo is enabled
-	uint8_t tremoloMask;
+	uint8_t reg40, reg60, reg80, regE0;
 	//Strength of the vibrato
 	uint8_t vibStrength;
 	//Keep track of the calculated KSR so we can check for changes
@@ -147,17 +202,18 @@ typedef struct _Operator {
 typedef struct _Channel {
 	Operator op[2]; //Leave on top of struct for simpler pointer math.
 
-	Channel_SynthHandler synthHandler;
-	uint32_t chanData;		//Frequency/octave and derived values
 	int32_t old[2];			//Old data for feedback
-
+	Channel_SynthHandler synthHandler;
+	int16_t maskLeft;		//Sign extended values for both channel's panning
+	int16_t maskRight;
 	uint8_t feedback;			//Feedback shift
-	uint8_t regB0;			//Register values to check for changes
-	uint8_t regC0;
 	//This should correspond with reg104, bit 6 indicates a Percussion channel, bit 7 indicates a silent channel
 	uint8_t fourMask;
-	int16_t maskLeft;		//Sign extended values for both channel's panning
-	int16_t maskRight;
+	bool dropped;			//Voice starting at this channel isn't rendered this block (polyphony limit)
+
+	uint8_t regB0;			//Register values to check for changes
+	uint8_t regC0;
+	uint32_t chanData;		//Frequency/octave and derived values
 
 } Channel;
 
@@ -167,32 +223,64 @@ typedef struct _Chip {
 
 	//This is used as the base counter for vibrato and tremolo
 	uint32_t lfoCounter;
+	uint32_t lfoAdd;
 
 	uint32_t noiseCounter;
 	uint32_t noiseValue;
+	uint32_t noiseAdd;
+
+	//Mix and pack kernels, default to plain C. Can be replaced after Chip_Reset (e.g. MMX)
+	Chip_MixHandler mixHandler;
+	Chip_PackHandler packHandler;
+	//Samples in the block being rendered
+	uint16_t blockSamples;
+
+	uint8_t vibratoIndex;
+	uint8_t tremoloIndex;
+	int8_t vibratoSign;
+	uint8_t vibratoShift;
+	uint8_t tremoloValue;
+	uint8_t vibratoStrength;
+	uint8_t tremoloStrength;
+
+	//Quality reductions for slow machines, see Chip_SetQuality
+	bool blockLfo;
+	bool blockEnvelope;
+	//Most voices rendered at once, 0 = all of them (see Chip_SetVoiceLimit)
+	uint8_t voiceLimit;
+
+	//Channels mixed into mixAcc so far in the block being rendered
+	uint8_t mixChannels;
+
+	//Stereo mix of the block being rendered, saturated into the output once all channels are in
+	int32_t mixAcc[ DBOPL_MIX_CHUNK * 2 ];
+	//Mono output of the channel currently being rendered
+	int16_t mixBuf[ DBOPL_MIX_CHUNK ];
+
+#ifdef DBOPL_SSCACHE
+	//Counts the channel blocks rendered, to find cache slots that are no longer in use
+	uint16_t steadyBlock;
+	SteadyCache steady[ DBOPL_SSCACHE ];
+#endif
 
 #ifndef PRECALC_TBL
-	uint32_t lfoAdd;
-	uint32_t noiseAdd;
 	//Frequency scales for the different multiplications
     uint32_t freqMul[16];// = {};
 	//Rates for decay and release for rate of this chip
     uint32_t linearRates[76];// = {};
 	//Best match attack rates for the rate of this chip
     uint32_t attackRates[76];// = {};
+#else
+	//Precalculated tables for the rate of this chip
+	const uint32_t* freqMul;
+	const uint32_t* linearRates;
+	const uint32_t* attackRates;
 #endif
 
 	uint8_t reg104;
 	uint8_t reg08;
 	uint8_t reg04;
 	uint8_t regBD;
-	uint8_t vibratoIndex;
-	uint8_t tremoloIndex;
-	int8_t vibratoSign;
-	uint8_t vibratoShift;
-	uint8_t tremoloValue;
-	uint8_t vibratoStrength;
-	uint8_t tremoloStrength;
 	//Mask for allowed wave forms
 	uint8_t waveFormMask;
 	//0 or -1 when enabled
@@ -210,5 +298,14 @@ void Chip_WriteReg( Chip* chip, uint16_t reg, uint8_t val );
 int  Chip_Generate( Chip* chip, int16_t* output, uint16_t count );
 void Chip_Setup( Chip *chip, uint32_t rate );
 void Chip_Reset( Chip* chip, bool opl3Mode, uint32_t rate );
+//Trades accuracy for speed: vibrato/tremolo and/or envelopes only move once per block (up to DBOPL_MIX_CHUNK samples)
+void Chip_SetQuality( Chip* chip, bool blockLfo, bool blockEnvelope );
+#ifdef PRECALC_TBL
+//Renders at most <voices> voices (4-op and percussion count as one), the quietest ones are dropped,
+//released ones first. Dropped voices keep their envelopes going, 0 = no limit
+void Chip_SetVoiceLimit( Chip* chip, uint8_t voices );
+//Switches to another precalculated rate without resetting the chip
+void Chip_SetRate( Chip* chip, uint32_t rate );
+#endif
 
 #endif
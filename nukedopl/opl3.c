@@ -35,10 +35,13 @@
 #include <string.h>
 #include "opl3.h"
 
-//#include "vfm_tsr.h"
-
-// #define _DBG(x) vfm_tsrOutPortB(0x80, (unsigned char) x)
+/* Progress marks, recorded in the event trace of TRACE=2 builds (see vfm_trc.h) */
+#if defined(VFM_TRACE) && VFM_TRACE >= 2
+#include "vfm_trc.h"
+#define _DBG(x) vfm_traceEvent(VFM_TRC_MARK, x)
+#else
 #define _DBG(x)
+#endif
 
 #if OPL_ENABLE_STEREOEXT && !defined OPL_SIN
 #ifndef _USE_MATH_DEFINES
@@ -64,8 +67,10 @@
 #define inline __inline
 #endif
 
+/* The TSR has asm versions of these (vfm_opt.asm), host builds use the C ones */
 #ifdef DOS16
 #define DOS_CLIP_SAMPLE_FAST
+#define DOS_ENVELOPE_FAST
 #endif
 
 // #pragma data_seg("_TEXT", "CODE")
@@ -247,7 +252,7 @@ extern void __i64add32(_uint64 *_out, int32_t _a);
 typedef int16_t(*envelope_sinfunc)(uint16_t phase, uint16_t envelope);
 typedef void(*envelope_genfunc)(opl3_slot *slott);
 
-#if 0
+#ifndef DOS_ENVELOPE_FAST
 static inline int16_t OPL3_EnvelopeCalcExp(uint32_t level)
 {
     if (level > 0x1fff)
@@ -395,7 +400,7 @@ static int16_t OPL3_EnvelopeCalcSin7(uint16_t phase, uint16_t envelope)
 }
 #endif
 
-#if 1
+#ifdef DOS_ENVELOPE_FAST
 extern int16_t OPL3_EnvelopeCalcSin0Fast(uint16_t, uint16_t);
 extern int16_t OPL3_EnvelopeCalcSin1Fast(uint16_t, uint16_t);
 extern int16_t OPL3_EnvelopeCalcSin2Fast(uint16_t, uint16_t);
@@ -1222,7 +1227,8 @@ static INLINE_PROCESSSLOT void OPL3_ProcessSlot(opl3_slot *slot)
     OPL3_SlotGenerate(slot);
 }
 
-inline void OPL3_Generate4Ch(opl3_chip *chip, int16_t *buf4)
+/* Output is not clipped here, callers saturate it (one sample at a time or a whole block at once) */
+inline void OPL3_Generate4Ch(opl3_chip *chip, int32_t *mix2)
 {
     opl3_channel *channel;
 #ifdef ENABLE_WRITEBUF
@@ -1234,7 +1240,7 @@ inline void OPL3_Generate4Ch(opl3_chip *chip, int16_t *buf4)
     int16_t accm;
     uint8_t shift = 0;
 
-    buf4[1] = OPL3_ClipSample(chip->mixbuff[1]);
+    mix2[1] = chip->mixbuff[1];
 //    buf4[3] = OPL3_ClipSample(chip->mixbuff[3]);
 
 #if OPL_QUIRK_CHANNELSAMPLEDELAY
@@ -1275,7 +1281,7 @@ inline void OPL3_Generate4Ch(opl3_chip *chip, int16_t *buf4)
 
     _DBG(0x68);
 
-    buf4[0] = OPL3_ClipSample(chip->mixbuff[0]);
+    mix2[0] = chip->mixbuff[0];
   //  buf4[2] = OPL3_ClipSample(chip->mixbuff[2]);
 
     _DBG(0x69);
@@ -1495,14 +1501,32 @@ inline void OPL3_UpdateNoGenerate(opl3_chip *chip)
     chip->eg_state ^= 1;
 }
 
+#ifndef HQ_RESAMPLING
+void OPL3_Generate2ChResampled32(opl3_chip *chip, int32_t *buf2)
+{
+    while (chip->samplecnt >= (chip->rateratio*2)) {
+//        OPL3_Generate4Ch(chip, chip->samples);
+        OPL3_UpdateNoGenerate(chip);
+        chip->samplecnt -= chip->rateratio;
+    }
+
+    OPL3_Generate4Ch(chip, buf2);
+    chip->samplecnt -= chip->rateratio;
+    chip->samplecnt += 1 << RSM_FRAC;
+}
+#endif
+
 void OPL3_Generate2ChResampled(opl3_chip *chip, int16_t *buf2)
 {
+    int32_t mix2[2];
 #ifdef HQ_RESAMPLING
     while (chip->samplecnt >= chip->rateratio)
     {
         chip->oldsamples[0] = chip->samples[0];
         chip->oldsamples[1] = chip->samples[1];
-        OPL3_Generate4Ch(chip, chip->samples);
+        OPL3_Generate4Ch(chip, mix2);
+        chip->samples[0] = OPL3_ClipSample(mix2[0]);
+        chip->samples[1] = OPL3_ClipSample(mix2[1]);
         chip->samplecnt -= chip->rateratio;
     }
 
@@ -1528,20 +1552,13 @@ void OPL3_Generate2ChResampled(opl3_chip *chip, int16_t *buf2)
         buf2[1] = (int16_t) tmp1;
     }
 #endif 
-#else
-    while (chip->samplecnt >= (chip->rateratio*2)) {
-//        OPL3_Generate4Ch(chip, chip->samples);
-        OPL3_UpdateNoGenerate(chip);
-        chip->samplecnt -= chip->rateratio;
-    }
-
-    OPL3_Generate4Ch(chip, chip->samples);
-    chip->samplecnt -= chip->rateratio;
-    buf2[0] = chip->samples[0];
-    buf2[1] = chip->samples[1];
-#endif
 
     chip->samplecnt += 1 << RSM_FRAC;
+#else
+    OPL3_Generate2ChResampled32(chip, mix2);
+    buf2[0] = OPL3_ClipSample(mix2[0]);
+    buf2[1] = OPL3_ClipSample(mix2[1]);
+#endif
 }
 
 void OPL3_GenerateResampled(opl3_chip *chip, int16_t *buf)
@@ -1636,6 +1653,12 @@ void OPL3_Reset(opl3_chip *chip, uint32_t samplerate)
 #endif
 }
 
+/* Changes the output sample rate without resetting the chip */
+void OPL3_SetRate(opl3_chip *chip, uint32_t samplerate)
+{
+    chip->rateratio = (samplerate << RSM_FRAC) / 49716;
+}
+
 void OPL3_WriteReg(opl3_chip *chip, uint16_t reg, uint8_t v)
 {
     uint8_t high = (reg >> 8) & 0x01;
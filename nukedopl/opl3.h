@@ -180,10 +180,13 @@ struct _opl3_chip {
 void OPL3_Generate(opl3_chip *chip, int16_t *buf);
 void OPL3_GenerateResampled(opl3_chip *chip, int16_t *buf);
 void OPL3_Reset(opl3_chip *chip, uint32_t samplerate);
+void OPL3_SetRate(opl3_chip *chip, uint32_t samplerate);
 void OPL3_WriteReg(opl3_chip *chip, uint16_t reg, uint8_t v);
 void OPL3_WriteRegBuffered(opl3_chip *chip, uint16_t reg, uint8_t v);
 void OPL3_GenerateStream(opl3_chip *chip, int16_t *sndptr, uint32_t numsamples);
 void OPL3_Generate2ChResampled(opl3_chip *chip, int16_t *buf2);
+/* Same as above but without clipping, output is 2 x int32_t */
+void OPL3_Generate2ChResampled32(opl3_chip *chip, int32_t *buf2);
 
 #if 0
 void OPL3_Generate4Ch(opl3_chip *chip, int16_t *buf4);
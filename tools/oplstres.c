@@ -0,0 +1,485 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * OPLSTRES - Worst case register streams for the OPL render path
+ *
+ * Generates register streams that make both cores do as much work as they ever have to,
+ * renders them on the host the same way vfm_renderBlock does (queued writes applied one
+ * sample apart, the rest of the block generated in one go) and reports the worst block.
+ *
+ * Scenarios:
+ *   opl3    All 18 channels keyed on in OPL3 mode, feedback, vibrato and tremolo on every operator, waveforms 4-7
+ *   4op     All six 4-op pairs (FM-FM, AM-FM, FM-AM, AM-AM) plus the other six channels
+ *   rhythm  Rhythm mode with all five drums keyed every tick (noise, waveforms 4-7) plus the other 15 channels
+ *   writes  Like opl3, plus a burst of frequency/level/rate/waveform writes at the start of every tick
+ *   all     4-op pairs, rhythm mode, all of the above and the write bursts
+ *
+ * The host time per block is no measure of a DOS machine, but the worst block compared to the
+ * average one is: the load calibration of the TSR measures the average, so this is the headroom
+ * a CPU needs on top of it. The streams can be saved as DBGREG files (-o) and rendered on the
+ * target with the 'o' benchmark of a DBG_BENCH build (as teraterm.log), or fed to sgdsim -f.
+ *
+ * Build on the host, from the repository folder:
+ *   cc -O2 -fgnu89-inline -DPRECALC_TBL -DSHARED_TBL -Idbopl -I. -o oplstres tools/oplstres.c dbopl/dbopl.c nukedopl/opl3.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dbopl/dbopl.h"
+#include "nukedopl/opl3.h"
+
+typedef unsigned char       u8;
+typedef unsigned short      u16;
+typedef unsigned int        u32;
+
+/* Same as the TSR */
+#define FM_PCM_SAMPLE_RATE          24000
+#define STEREO                      2
+#define MAX_SAMPS_PER_BUF           1024
+
+#define STRES_TICK                  512         /* Samples per tick, same as a DBGREG block */
+#define STRES_MAX_WRITES            STRES_TICK  /* Writes per tick, more don't fit into a DBGREG block */
+#define STRES_BURST                 256         /* Writes per tick of the write bursts */
+
+typedef enum {
+    STRES_CORE_DBOPL = 0,
+    STRES_CORE_NUKED,
+    STRES_CORE_COUNT
+} stres_Core;
+
+typedef struct {
+    u16 reg;                                    /* Bit 8 set = bank B */
+    u8  val;
+} stres_Write;
+
+typedef struct {
+    const char *name;
+    int         fourOp;                         /* All six 4-op pairs */
+    int         rhythm;                         /* Rhythm mode, channels 6-8 of bank A */
+    u16         burst;                          /* Extra writes at the start of every tick */
+} stres_Scenario;
+
+typedef struct {
+    double      worst;                          /* Slowest block, ns */
+    double      total;
+    u32         worstBlock;
+    u32         blocks;
+} stres_Result;
+
+#define STRES_MAX_BLOCKS            65536
+
+static const stres_Scenario s_scenarios[] = {
+    { "opl3",   0, 0, 0             },
+    { "4op",    1, 0, 0             },
+    { "rhythm", 0, 1, 0             },
+    { "writes", 0, 0, STRES_BURST   },
+    { "all",    1, 1, STRES_BURST   },
+};
+
+#define STRES_SCENARIOS             (sizeof(s_scenarios) / sizeof(s_scenarios[0]))
+
+/* Operator register offsets of the channels in a bank, the second operator is +3 */
+static const u8 s_opOffset[9] = { 0, 1, 2, 8, 9, 10, 16, 17, 18 };
+
+static stres_Write  s_writes[STRES_MAX_WRITES];
+static u16          s_writeCount;
+static u32          s_rand;
+
+static Chip         s_dbopl;
+static opl3_chip    s_nuked;
+
+static u32 stres_random(void) {
+    s_rand ^= s_rand << 13;
+    s_rand ^= s_rand >> 17;
+    s_rand ^= s_rand << 5;
+    return s_rand;
+}
+
+static void stres_write(u16 reg, u8 val) {
+    if (s_writeCount == STRES_MAX_WRITES) return;
+
+    s_writes[s_writeCount].reg = reg;
+    s_writes[s_writeCount].val = val;
+    s_writeCount++;
+}
+
+/* Is channel <ch> (0-17) one of the rhythm channels of a scenario */
+static int stres_isRhythmChannel(const stres_Scenario *sc, u16 ch) {
+    return sc->rhythm && ch >= 6 && ch <= 8;
+}
+
+/* Connection bit of channel <ch>: the 4-op pairs cycle through FM-FM, AM-FM, FM-AM, AM-AM */
+static u8 stres_connection(const stres_Scenario *sc, u16 ch) {
+    u16 inBank = ch % 9;
+    u16 pair = (ch / 9) * 3 + (inBank % 3);
+
+    if (!sc->fourOp || inBank >= 6) return 1;   /* 2-op: additive, both operators are heard */
+
+    return (inBank < 3) ? (u8) (pair & 1) : (u8) ((pair >> 1) & 1);
+}
+
+/* Operator settings: tremolo, vibrato, sustain, full volume, fast attack, waveforms 4-7 */
+static void stres_setupOperator(u16 bank, u16 op, u16 index) {
+    stres_write(bank | (0x20 + op), (u8) (0xE0 | (1 + index % 15)));
+    stres_write(bank | (0x40 + op), 0x00);
+    stres_write(bank | (0x60 + op), 0xF2);
+    stres_write(bank | (0x80 + op), 0x03);
+    stres_write(bank | (0xE0 + op), (u8) (4 + index % 4));
+}
+
+/* Channel frequency with key on, spread over the octaves */
+static void stres_keyOn(u16 ch, u16 fnum) {
+    u16 bank = (ch >= 9) ? 0x100 : 0;
+    u16 inBank = ch % 9;
+
+    stres_write(bank | (0xA0 + inBank), (u8) fnum);
+    stres_write(bank | (0xB0 + inBank), (u8) (0x20 | ((1 + ch % 7) << 2) | ((fnum >> 8) & 3)));
+}
+
+static void stres_setup(const stres_Scenario *sc) {
+    u16 ch;
+
+    stres_write(0x105, 0x01);                                   /* OPL3 mode */
+    stres_write(0x104, sc->fourOp ? 0x3F : 0x00);
+    stres_write(0x001, 0x20);                                   /* Waveform select */
+    stres_write(0x008, 0x00);
+
+    for (ch = 0; ch < 18; ch++) {
+        u16 bank = (ch >= 9) ? 0x100 : 0;
+        u16 op = s_opOffset[ch % 9];
+
+        stres_setupOperator(bank, op, ch * 2);
+        stres_setupOperator(bank, (u16) (op + 3), ch * 2 + 1);
+
+        /* All four outputs, feedback 7 */
+        stres_write(bank | (0xC0 + ch % 9), (u8) (0xF0 | (7 << 1) | stres_connection(sc, ch)));
+    }
+
+    for (ch = 0; ch < 18; ch++) {
+        if (stres_isRhythmChannel(sc, ch)) continue;
+
+        /* The second channel of a 4-op pair is ignored in 4-op mode, keying it doesn't hurt */
+        stres_keyOn(ch, (u16) (0x157 + ch * 23));
+    }
+
+    if (sc->rhythm) {
+        stres_write(0x0A6, 0x57);
+        stres_write(0x0B6, 0x09);
+        stres_write(0x0A7, 0x20);
+        stres_write(0x0B7, 0x0A);
+        stres_write(0x0A8, 0x81);
+        stres_write(0x0B8, 0x0D);
+    }
+
+    /* Full tremolo and vibrato depth, rhythm mode with all drums keyed */
+    stres_write(0x0BD, (u8) (0xC0 | (sc->rhythm ? 0x3F : 0x00)));
+}
+
+/* A write that makes the core recalculate something, without keying anything off */
+static void stres_burstWrite(const stres_Scenario *sc) {
+    u32 r = stres_random();
+    u16 ch = (u16) ((r >> 8) % 18);
+    u16 bank = (ch >= 9) ? 0x100 : 0;
+    u16 inBank = ch % 9;
+    u16 op = (u16) (s_opOffset[inBank] + ((r >> 16) & 1) * 3);
+    u8 val = (u8) (r >> 24);
+
+    switch (r % 8) {
+        case 0:
+        case 1:
+            if (stres_isRhythmChannel(sc, ch)) {
+                stres_write(bank | (0xA0 + inBank), val);
+            } else {
+                stres_keyOn(ch, (u16) (((r >> 4) & 0x3FF) | 0x100));
+            }
+            break;
+        case 2:  stres_write(bank | (0x40 + op), (u8) (val & 0xCF));                     break;
+        case 3:  stres_write(bank | (0x20 + op), (u8) (0xE0 | (val & 0x0F)));            break;
+        case 4:  stres_write(bank | (0x60 + op), (u8) (0xF0 | (val & 0x0F)));            break;
+        case 5:  stres_write(bank | (0x80 + op), (u8) (val & 0x0F));                     break;
+        case 6:  stres_write(bank | (0xE0 + op), (u8) (4 + (val & 3)));                  break;
+        default: stres_write(bank | (0xC0 + inBank), (u8) (0xF0 | (val & 0x0E) | stres_connection(sc, ch))); break;
+    }
+}
+
+/* Gets the writes of tick <tick> */
+static void stres_tick(const stres_Scenario *sc, u32 tick) {
+    u16 i;
+
+    s_writeCount = 0;
+
+    if (tick == 0) {
+        stres_setup(sc);
+        return;
+    }
+
+    /* Drums are keyed again every tick */
+    if (sc->rhythm) {
+        stres_write(0x0BD, 0xE0);
+        stres_write(0x0BD, 0xFF);
+    }
+
+    for (i = 0; i < sc->burst; i++) {
+        stres_burstWrite(sc);
+    }
+}
+
+/* Core interface, same settings as the TSR (vfm_core.c) */
+
+static void stres_coreInit(stres_Core core) {
+    if (core == STRES_CORE_DBOPL) {
+        Chip_Reset(&s_dbopl, true, FM_PCM_SAMPLE_RATE);
+    } else {
+        OPL3_Reset(&s_nuked, FM_PCM_SAMPLE_RATE);
+    }
+}
+
+static void stres_coreWriteReg(stres_Core core, u16 reg, u8 val) {
+    if (core == STRES_CORE_DBOPL) {
+        Chip_WriteReg(&s_dbopl, reg, val);
+    } else {
+        OPL3_WriteReg(&s_nuked, reg, val);
+    }
+}
+
+static void stres_coreGenerate(stres_Core core, int16_t *out, u16 samples) {
+    if (core == STRES_CORE_DBOPL) {
+        Chip_Generate(&s_dbopl, out, samples);
+        return;
+    }
+
+    while (samples--) {
+        OPL3_Generate2ChResampled(&s_nuked, out);
+        out += STEREO;
+    }
+}
+
+static double stres_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*  Renders <ticks> ticks of a scenario in blocks of <sampsPerBuf>, like vfm_renderBlock.
+    Stores the time of every block in <times>, or keeps the one in there if it is faster (<again>) */
+static u32 stres_render(const stres_Scenario *sc, stres_Core core, u32 ticks, u16 sampsPerBuf, u32 seed,
+                        double *times, int again) {
+    static int16_t out[MAX_SAMPS_PER_BUF * STEREO];
+    static stres_Write queue[STRES_MAX_WRITES * 2];
+    u32 queued = 0;
+    u32 tickSample = 0;
+    u32 tick = 0;
+    u32 blocks = 0;
+
+    s_rand = seed;
+    stres_coreInit(core);
+
+    while (tick < ticks && blocks < STRES_MAX_BLOCKS) {
+        u16 samples = sampsPerBuf;
+        int16_t *dst = out;
+        u32 entry = 0;
+        double start;
+        double time;
+
+        /* Writes of the ticks that started before this block are queued */
+        while (tickSample < sampsPerBuf && tick < ticks) {
+            u16 i;
+
+            stres_tick(sc, tick++);
+
+            for (i = 0; i < s_writeCount && queued < sizeof(queue) / sizeof(queue[0]); i++) {
+                queue[queued++] = s_writes[i];
+            }
+
+            tickSample += STRES_TICK;
+        }
+
+        tickSample -= sampsPerBuf;
+
+        start = stres_now();
+
+        while (entry < queued && samples) {
+            stres_coreWriteReg(core, queue[entry].reg, queue[entry].val);
+            stres_coreGenerate(core, dst, 1);
+            dst += STEREO;
+            entry++;
+            samples--;
+        }
+
+        if (samples) {
+            stres_coreGenerate(core, dst, samples);
+        }
+
+        time = stres_now() - start;
+
+        memmove(queue, queue + entry, (queued - entry) * sizeof(queue[0]));
+        queued -= entry;
+
+        if (!again || time < times[blocks]) times[blocks] = time;
+        blocks++;
+    }
+
+    return blocks;
+}
+
+/*  Renders a scenario <passes> times. The stream is the same every time, so the fastest time of each
+    block is kept, which filters out the host's interrupts and task switches */
+static void stres_run(const stres_Scenario *sc, stres_Core core, u32 ticks, u16 sampsPerBuf, u32 seed,
+                      u16 passes, stres_Result *res) {
+    static double times[STRES_MAX_BLOCKS];
+    u32 blocks = 0;
+    u16 pass;
+    u32 i;
+
+    for (pass = 0; pass < passes; pass++) {
+        blocks = stres_render(sc, core, ticks, sampsPerBuf, seed, times, pass > 0);
+    }
+
+    memset(res, 0, sizeof(*res));
+    res->blocks = blocks;
+
+    /* The first block after the reset is mostly cache misses */
+    for (i = 1; i < blocks; i++) {
+        if (times[i] > res->worst) {
+            res->worst      = times[i];
+            res->worstBlock = i;
+        }
+
+        res->total += times[i];
+    }
+}
+
+/* Saves the stream of a scenario as DBGREG: 3-byte records, 0xFFFF/0xFF after every tick */
+static int stres_saveDbgReg(const stres_Scenario *sc, const char *dir, u32 ticks, u32 seed) {
+    static const u8 tickEnd[3] = { 0xFF, 0xFF, 0xFF };
+    char path[1024];
+    FILE *f;
+    u32 tick;
+
+    snprintf(path, sizeof(path), "%s/%s.dbg", dir, sc->name);
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        printf("ERROR: Can't create %s\n", path);
+        return 0;
+    }
+
+    s_rand = seed;
+
+    for (tick = 0; tick < ticks; tick++) {
+        u16 i;
+
+        stres_tick(sc, tick);
+
+        for (i = 0; i < s_writeCount; i++) {
+            u8 rec[3];
+
+            rec[0] = (u8) s_writes[i].reg;
+            rec[1] = (u8) (s_writes[i].reg >> 8);
+            rec[2] = s_writes[i].val;
+            fwrite(rec, sizeof(rec), 1, f);
+        }
+
+        fwrite(tickEnd, sizeof(tickEnd), 1, f);
+    }
+
+    if (fclose(f) != 0) {
+        printf("ERROR: Can't write %s\n", path);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void stres_printUsage(void) {
+    printf("Usage: oplstres [options]\n");
+    printf("  -s NAME  Scenario: opl3, 4op, rhythm, writes, all (default: every one of them)\n");
+    printf("  -c CORE  Core: dbopl, nuked (default: both)\n");
+    printf("  -b S     Samples per DMA block (default 128)\n");
+    printf("  -t N     Ticks of %u samples to render (default 500)\n", STRES_TICK);
+    printf("  -p N     Passes, the fastest time of each block is used (default 5)\n");
+    printf("  -r SEED  Random seed of the write bursts (default 1)\n");
+    printf("  -o DIR   Also save the streams as DBGREG files <DIR>/<scenario>.dbg\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const char *coreNames[STRES_CORE_COUNT] = { "DBOPL", "Nuked-OPL3" };
+    const char *scenario = NULL;
+    const char *dir = NULL;
+    int coreMask = 3;
+    u16 sampsPerBuf = 128;
+    u32 ticks = 500;
+    u32 seed = 1;
+    u16 passes = 5;
+    double worstLoad = 0.0;
+    u32 i;
+    int c;
+
+    for (c = 1; c < argc; c++) {
+        const char *arg = argv[c];
+        const char *value = (c + 1 < argc) ? argv[c + 1] : NULL;
+        int ok = value != NULL && arg[0] == '-' && arg[1] != 0 && arg[2] == 0;
+
+        if (ok) {
+            switch (arg[1]) {
+                case 's': scenario = value; break;
+                case 'o': dir = value; break;
+                case 'b': sampsPerBuf = (u16) atoi(value); ok = sampsPerBuf >= 1 && sampsPerBuf <= MAX_SAMPS_PER_BUF; break;
+                case 't': ticks = (u32) atoi(value); ok = ticks >= 2; break;
+                case 'p': passes = (u16) atoi(value); ok = passes >= 1; break;
+                case 'r': seed = (u32) strtoul(value, NULL, 0); ok = seed != 0; break;
+                case 'c':
+                    if (strcmp(value, "dbopl") == 0)        coreMask = 1 << STRES_CORE_DBOPL;
+                    else if (strcmp(value, "nuked") == 0)   coreMask = 1 << STRES_CORE_NUKED;
+                    else ok = 0;
+                    break;
+                default: ok = 0; break;
+            }
+            c++;
+        }
+
+        if (!ok) {
+            stres_printUsage();
+            return 1;
+        }
+    }
+
+    printf("%u ticks, %u samples per block (%.2f ms)\n\n", ticks, sampsPerBuf, sampsPerBuf * 1000.0 / FM_PCM_SAMPLE_RATE);
+    printf("%-8s %-11s %10s %10s %9s %10s\n", "Scenario", "Core", "avg. us", "worst us", "worst/avg", "worst load");
+
+    for (i = 0; i < STRES_SCENARIOS; i++) {
+        const stres_Scenario *sc = &s_scenarios[i];
+        stres_Core core;
+
+        if (scenario != NULL && strcmp(scenario, sc->name) != 0) continue;
+
+        if (dir != NULL && !stres_saveDbgReg(sc, dir, ticks, seed)) return 1;
+
+        for (core = 0; core < STRES_CORE_COUNT; core++) {
+            stres_Result res;
+            double avg;
+            double load;
+
+            if (!(coreMask & (1 << core))) continue;
+
+            stres_run(sc, core, ticks, sampsPerBuf, seed, passes, &res);
+
+            avg  = res.total / (res.blocks - 1);
+            load = res.worst / (sampsPerBuf * 1e9 / FM_PCM_SAMPLE_RATE) * 100.0;
+            if (load > worstLoad) worstLoad = load;
+
+            printf("%-8s %-11s %10.1f %10.1f %9.2f %9.2f%%  (block %u)\n",
+                sc->name, coreNames[core], avg / 1000.0, res.worst / 1000.0, res.worst / avg, load, res.worstBlock);
+        }
+    }
+
+    printf("\nWorst block: %.2f%% of real time on this machine\n", worstLoad);
+    return 0;
+}
@@ -0,0 +1,518 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * SGDSIM - Host side simulation of the FM SGD DMA engine and the FM NMI trap
+ *
+ * Models what the TSR does on a VIA 686 board, so block/buffer settings and
+ * the cost of the interrupt handlers can be tried out before touching hardware:
+ *
+ * - The FM SGD engine walks a table of <bufs> entries of <samples> stereo samples
+ *   at 24 kHz, sets FLAG (EOL for the last entry) in its status register at the
+ *   end of every entry and restarts at the first one after EOL.
+ *   It never waits for the CPU, a buffer that wasn't rendered in time is played again.
+ * - The game writes to 0x388/0x389, every data write is trapped and costs an NMI.
+ *   Game code, the NMI handler and the DMA ISR share one CPU, so writes can't
+ *   happen while the ISR runs and the ISR can't run while the NMI handler does.
+ * - sim_dmaInterruptHandler and sim_nmiHandler do the same as vfm_dmaInterruptHandler,
+ *   vfm_renderBlock and vfm_nmiHandler, with the time they take given by a cost model.
+ *
+ * Reported: underruns (stale or half rendered buffers played), interrupts that were
+ * acknowledged without a block being rendered, register writes lost to a full queue,
+ * the queue depth and the time from each write to the sample it is heard in.
+ *
+ * Build on the host: cc -O2 -o sgdsim tools/sgdsim.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef unsigned char       u8;
+typedef unsigned short      u16;
+typedef unsigned int        u32;
+typedef int                 bool;
+#define true                1
+#define false               0
+
+/* Same as the TSR (vfm_tsr.c, vfm_icmn.asm, v97_reg.h) */
+#define FM_PCM_SAMPLE_RATE          24000
+#define OPL_REG_QUEUE_SIZE          512
+#define STEREO                      2
+
+#define V97_FM_SGD_STATUS           (0x20)
+#define V97_FM_SGD_TABLE_PTR        (0x24)
+#define V97_FM_SGD_CURRENT_POS      (0x2C)
+
+#define SGD_CHANNEL_STATUS_EOL      0x02
+#define SGD_CHANNEL_STATUS_FLAG     0x01
+
+#define SIM_TABLE_PHYS_ADDR         0x00100000UL    /* Physical address of the simulated SGD table */
+#define SIM_MAX_BUFS                32
+#define SIM_DBGREG_BLOCK            512             /* Samples per block in the DBGREG format */
+#define SIM_HIST_BINS               50              /* Latency histogram, bins of 1 ms, the last one takes the rest */
+
+/* Cost model and write stream, all times in microseconds */
+typedef struct {
+    u16         sampsPerBuf;
+    u16         numBufs;
+    double      seconds;                    /* Simulated time */
+    double      load;                       /* Time to render a sample, percent of the sample period */
+    double      writeCost;                  /* Time to apply a queued write to the core (without its sample) */
+    double      isrCost;                    /* Fixed time of the DMA ISR (stack swap, FPU save/restore, ack, EOI) */
+    double      irqLatency;                 /* Time from the status bits being set to the ISR running */
+    double      irqJitter;                  /* Random extra IRQ latency, up to this (e.g. game code with IF=0) */
+    double      nmiCost;                    /* Time of one trapped data write, NMI handler included */
+    double      tickHz;                     /* Music driver tick rate of the synthetic write stream */
+    u16         tickWrites;                 /* Register writes per tick */
+    double      writeGap;                   /* Time between the writes of a tick */
+    const char *replay;                     /* DBGREG file to replay instead of the synthetic stream */
+    u32         seed;
+    bool        verbose;
+} sim_Config;
+
+/* Register write as queued by the NMI handler, plus the time the game wanted to write it */
+typedef struct {
+    u16         bankedIndex;
+    u8          data;
+    double      wanted;
+} sim_QueueEntry;
+
+/* One register write of the game */
+typedef struct {
+    u16         bankedIndex;
+    u8          data;
+    double      time;
+} sim_Write;
+
+/* What happens to a DMA buffer */
+typedef struct {
+    double      renderStart;                /* Last time the ISR started to render into it */
+    double      renderEnd;                  /* ... and finished */
+    double      prevRenderEnd;              /* Render before that */
+    double      playStart;                  /* Last time the engine started to play it */
+} sim_Buffer;
+
+/* Results */
+typedef struct {
+    u32         blocks;                     /* Blocks played by the engine */
+    u32         interrupts;                 /* DMA interrupts handled */
+    u32         missedBlocks;               /* Block ends acknowledged without a block being rendered */
+    u32         staleBlocks;                /* Buffers played again without being rendered */
+    u32         tornBlocks;                 /* Buffers played while being rendered */
+    u32         writes;                     /* Trapped register writes */
+    u32         dropped;                    /* Writes lost to a full queue */
+    u32         applied;                    /* Writes applied to the core */
+    u16         maxQueue;                   /* Deepest the queue has been */
+    u32         spilled;                    /* Blocks that couldn't take all queued writes */
+    double      latMin, latMax, latSum;     /* Time from the wanted write time to the sample being played */
+    u32         latHist[SIM_HIST_BINS];
+    double      isrTime, isrMax;            /* CPU time taken by the DMA ISR */
+    double      nmiTime;                    /* CPU time taken by the NMI handler */
+} sim_Stats;
+
+static sim_Config           s_cfg;
+static sim_Stats            s_stats;
+static sim_Buffer           s_bufs[SIM_MAX_BUFS];
+static sim_QueueEntry       s_queue[OPL_REG_QUEUE_SIZE];
+static u16                  s_queueCount;
+static double               s_period;       /* Sample period */
+static double               s_blockTime;    /* Time to play one buffer */
+static u32                  s_pendingEnds;  /* Block ends since the last interrupt acknowledge */
+static double               s_ackTime;      /* Time of the last interrupt acknowledge */
+static double               s_now;          /* Time the CPU is at */
+static u32                  s_rand;
+
+static double sim_random(void) {
+    s_rand ^= s_rand << 13;
+    s_rand ^= s_rand >> 17;
+    s_rand ^= s_rand << 5;
+    return (double) s_rand / 4294967296.0;
+}
+
+/* Emulates an I/O read of the FM SGD registers at <time> */
+static u32 sim_sgdRead(u16 reg, double time) {
+    double played = time / s_blockTime + 1e-9;    /* Not a block early at a block end */
+    u32 entry = (u32) played % s_cfg.numBufs;
+
+    switch (reg) {
+        case V97_FM_SGD_STATUS:
+            /* FLAG/EOL of the entry that ended last, they stay set until acknowledged */
+            if (s_pendingEnds == 0) return 0;
+            return (entry == 0) ? SGD_CHANNEL_STATUS_EOL : SGD_CHANNEL_STATUS_FLAG;
+        case V97_FM_SGD_TABLE_PTR:
+            /* Points to the entry *after* the one being played */
+            return SIM_TABLE_PHYS_ADDR + (entry + 1) * 8;
+        case V97_FM_SGD_CURRENT_POS:
+            /* Bytes left in the entry being played */
+            return (u32) ((1.0 - (played - (u32) played)) * s_cfg.sampsPerBuf) * STEREO * 2;
+    }
+
+    return 0xFFFFFFFFUL;
+}
+
+/* Finds out when sample <sample> of buffer <buf>, rendered at <time>, is played */
+static double sim_playTime(u16 buf, u16 sample, double time) {
+    double cycle = s_blockTime * s_cfg.numBufs;
+    double first = buf * s_blockTime + sample * s_period;
+    double k = (time - first) / cycle;
+    double t;
+
+    if (k < 0) return first;
+
+    t = first + (double) ((u32) k) * cycle;
+    while (t < time) t += cycle;
+
+    return t;
+}
+
+static void sim_recordLatency(double latency) {
+    u16 bin = (u16) (latency / 1000.0);
+
+    if (bin >= SIM_HIST_BINS) bin = SIM_HIST_BINS - 1;
+    s_stats.latHist[bin]++;
+
+    if (latency < s_stats.latMin) s_stats.latMin = latency;
+    if (latency > s_stats.latMax) s_stats.latMax = latency;
+    s_stats.latSum += latency;
+}
+
+/* Same as vfm_nmiHandler: one trapped data write */
+static void sim_nmiHandler(const sim_Write *write) {
+    s_now += s_cfg.nmiCost;
+    s_stats.nmiTime += s_cfg.nmiCost;
+    s_stats.writes++;
+
+    if (s_queueCount >= OPL_REG_QUEUE_SIZE) {
+        s_stats.dropped++;
+        return;
+    }
+
+    s_queue[s_queueCount].bankedIndex   = write->bankedIndex;
+    s_queue[s_queueCount].data          = write->data;
+    s_queue[s_queueCount].wanted        = write->time;
+    s_queueCount++;
+
+    if (s_queueCount > s_stats.maxQueue) s_stats.maxQueue = s_queueCount;
+}
+
+/* Same as vfm_renderBlock: applies the queued writes one sample apart and renders the rest of the block */
+static void sim_renderBlock(u16 buf) {
+    double sampleCost = s_period * s_cfg.load / 100.0;
+    u16 samples = s_cfg.sampsPerBuf;
+    u16 count = s_queueCount;
+    u16 entry = 0;
+    u16 i;
+
+    while (count && samples) {
+        s_now += s_cfg.writeCost + sampleCost;
+        sim_recordLatency(sim_playTime(buf, entry, s_now) - s_queue[entry].wanted);
+
+        entry++;
+        count--;
+        samples--;
+    }
+
+    s_stats.applied += entry;
+    if (count) s_stats.spilled++;
+
+    for (i = 0; i < count; i++) {
+        s_queue[i] = s_queue[entry + i];
+    }
+
+    s_queueCount = count;
+
+    s_now += samples * sampleCost;
+}
+
+/* Same as vfm_dmaInterruptHandler: renders into the buffer that was played last */
+static void sim_dmaInterruptHandler(void) {
+    double start = s_now;
+    u32 index;
+    u16 buf;
+
+    /* Stack swap, status read */
+    s_now += s_cfg.isrCost / 2.0;
+
+    if ((sim_sgdRead(V97_FM_SGD_STATUS, s_now) & (SGD_CHANNEL_STATUS_FLAG | SGD_CHANNEL_STATUS_EOL)) == 0) return;
+
+    s_stats.interrupts++;
+
+    /* Same calculation as the ISR, the table pointer points to the entry after the one being played */
+    index = ((sim_sgdRead(V97_FM_SGD_TABLE_PTR, s_now) - SIM_TABLE_PHYS_ADDR) >> 3) - 1;
+    buf = (index == 0) ? (u16) (s_cfg.numBufs - 1) : (u16) (index - 1);
+
+    s_bufs[buf].prevRenderEnd   = s_bufs[buf].renderEnd;
+    s_bufs[buf].renderStart     = s_now;
+
+    sim_renderBlock(buf);
+
+    s_bufs[buf].renderEnd       = s_now;
+
+    /* FPU restore, acknowledge, EOI. Every block end up to here is cleared by the acknowledge */
+    s_now += s_cfg.isrCost / 2.0;
+
+    if (s_pendingEnds > 1) s_stats.missedBlocks += s_pendingEnds - 1;
+    s_pendingEnds   = 0;
+    s_ackTime       = s_now;
+
+    s_stats.isrTime += s_now - start;
+    if (s_now - start > s_stats.isrMax) s_stats.isrMax = s_now - start;
+
+    if (s_cfg.verbose) {
+        printf("%10.1f us: ISR rendered buffer %u in %.1f us, %u writes left in the queue\n",
+            start, buf, s_now - start, s_queueCount);
+    }
+}
+
+/* The engine starts to play entry <buf> at <time> */
+static void sim_sgdStartEntry(u16 buf, double time) {
+    sim_Buffer *b = &s_bufs[buf];
+    double done = (b->renderEnd <= time) ? b->renderEnd : b->prevRenderEnd;
+
+    if (b->renderStart < time && time < b->renderEnd) {
+        s_stats.tornBlocks++;
+        if (s_cfg.verbose) printf("%10.1f us: buffer %u played while being rendered\n", time, buf);
+    } else if (b->playStart >= 0.0 && done <= b->playStart) {
+        s_stats.staleBlocks++;
+        if (s_cfg.verbose) printf("%10.1f us: buffer %u played again without being rendered\n", time, buf);
+    }
+
+    b->playStart = time;
+}
+
+/* Gets the next write of the synthetic stream: <tickWrites> writes every tick, <writeGap> apart */
+static bool sim_nextSyntheticWrite(sim_Write *write) {
+    static u32 n = 0;
+    u32 tick = n / s_cfg.tickWrites;
+    u16 i = (u16) (n % s_cfg.tickWrites);
+
+    write->time         = tick * (1000000.0 / s_cfg.tickHz) + i * s_cfg.writeGap;
+    write->bankedIndex  = (u16) (0xA0 + (i % 9));
+    write->data         = (u8) n;
+    n++;
+
+    return write->time < s_cfg.seconds * 1000000.0;
+}
+
+/* Gets the next write of a DBGREG file, spread over its block like the TSR applies them */
+static bool sim_nextReplayWrite(FILE *f, sim_Write *write) {
+    static u32 block = 0;
+    static u16 inBlock = 0;
+    u8 rec[3];
+
+    for (;;) {
+        if (fread(rec, 3, 1, f) != 1) return false;
+
+        if (rec[0] == 0xFF && rec[1] == 0xFF && rec[2] == 0xFF) {
+            block++;
+            inBlock = 0;
+            continue;
+        }
+
+        write->bankedIndex  = (u16) (rec[0] | (rec[1] << 8));
+        write->data         = rec[2];
+        write->time         = ((double) block * SIM_DBGREG_BLOCK + inBlock) * s_period;
+        inBlock++;
+
+        return write->time < s_cfg.seconds * 1000000.0;
+    }
+}
+
+/* Runs the simulation: block ends, interrupts and game writes in the order they happen on the CPU */
+static void sim_run(FILE *replay) {
+    double end = s_cfg.seconds * 1000000.0;
+    u32 block = 1;
+    double nextBlockEnd = s_blockTime;
+    double irqTime = -1.0;
+    sim_Write write;
+    bool haveWrite;
+    u16 i;
+
+    for (i = 0; i < s_cfg.numBufs; i++) {
+        s_bufs[i].renderStart   = -1.0;
+        s_bufs[i].renderEnd     = 0.0;
+        s_bufs[i].prevRenderEnd = 0.0;
+        s_bufs[i].playStart     = -1.0;
+    }
+
+    sim_sgdStartEntry(0, 0.0);
+
+    haveWrite = replay ? sim_nextReplayWrite(replay, &write) : sim_nextSyntheticWrite(&write);
+
+    while (nextBlockEnd < end) {
+        double writeAt = haveWrite ? (write.time > s_now ? write.time : s_now) : end;
+        double isrAt = (irqTime >= 0.0) ? (irqTime > s_now ? irqTime : s_now) : end;
+
+        /* The engine runs on its own, block ends come first */
+        if (nextBlockEnd <= writeAt && nextBlockEnd <= isrAt) {
+            s_stats.blocks++;
+
+            if (nextBlockEnd <= s_ackTime) {
+                /* Ended while the ISR was running, its acknowledge cleared the status bits */
+                s_stats.missedBlocks++;
+            } else {
+                s_pendingEnds++;
+
+                if (irqTime < 0.0) {
+                    irqTime = nextBlockEnd + s_cfg.irqLatency + sim_random() * s_cfg.irqJitter;
+                }
+            }
+
+            sim_sgdStartEntry((u16) (block % s_cfg.numBufs), nextBlockEnd);
+            block++;
+            nextBlockEnd = block * s_blockTime;
+            continue;
+        }
+
+        /* The NMI has priority, after that the pending interrupt is taken before the game goes on */
+        if (writeAt < isrAt) {
+            s_now = writeAt;
+            sim_nmiHandler(&write);
+            haveWrite = replay ? sim_nextReplayWrite(replay, &write) : sim_nextSyntheticWrite(&write);
+        } else {
+            s_now = isrAt;
+            irqTime = -1.0;
+            sim_dmaInterruptHandler();
+        }
+    }
+}
+
+static void sim_printStats(void) {
+    u32 writes = s_stats.applied;
+    u16 i;
+
+    printf("Blocks:     %u x %u samples, %u buffers (%.1f ms buffered)\n",
+        s_stats.blocks, s_cfg.sampsPerBuf, s_cfg.numBufs, s_blockTime * s_cfg.numBufs / 1000.0);
+    printf("Interrupts: %u, block ends acknowledged without rendering: %u\n", s_stats.interrupts, s_stats.missedBlocks);
+    printf("Underruns:  %u buffers played again, %u played while being rendered\n", s_stats.staleBlocks, s_stats.tornBlocks);
+    printf("Writes:     %u trapped, %u lost to a full queue, %u applied, max. queue depth %u\n",
+        s_stats.writes, s_stats.dropped, s_stats.applied, s_stats.maxQueue);
+    printf("            %u blocks couldn't take all queued writes\n", s_stats.spilled);
+    printf("CPU:        ISR %.1f%% (max. %.1f us), NMI %.1f%%\n",
+        s_stats.isrTime * 100.0 / (s_cfg.seconds * 1000000.0), s_stats.isrMax,
+        s_stats.nmiTime * 100.0 / (s_cfg.seconds * 1000000.0));
+
+    if (writes == 0) return;
+
+    printf("Latency:    min. %.2f ms, avg. %.2f ms, max. %.2f ms (jitter %.2f ms)\n",
+        s_stats.latMin / 1000.0, s_stats.latSum / writes / 1000.0, s_stats.latMax / 1000.0,
+        (s_stats.latMax - s_stats.latMin) / 1000.0);
+
+    for (i = 0; i < SIM_HIST_BINS; i++) {
+        if (s_stats.latHist[i] == 0) continue;
+        printf("            %s%2u ms: %6.2f%%\n", (i == SIM_HIST_BINS - 1) ? ">=" : "  ", i,
+            s_stats.latHist[i] * 100.0 / writes);
+    }
+}
+
+static void sim_printUsage(void) {
+    printf("Usage: sgdsim [options]\n");
+    printf("  -b S,N   DMA buffers: S samples, N buffers (default 128,3)\n");
+    printf("  -t SEC   Simulated time (default 10)\n");
+    printf("  -l PCT   Render load, percent of real time (default 30)\n");
+    printf("  -c US    Cost of applying a queued write, besides its sample (default 2)\n");
+    printf("  -i US    Fixed cost of the DMA ISR (default 20)\n");
+    printf("  -q US    IRQ latency (default 5)\n");
+    printf("  -j US    Random extra IRQ latency, up to this (default 0)\n");
+    printf("  -n US    Cost of a trapped write (default 5)\n");
+    printf("  -r HZ    Music driver tick rate (default 70)\n");
+    printf("  -w N     Register writes per tick (default 20)\n");
+    printf("  -g US    Time between the writes of a tick (default 30)\n");
+    printf("  -f FILE  Replay a DBGREG capture (\"V97TSR d\") instead\n");
+    printf("  -s SEED  Random seed (default 1)\n");
+    printf("  -v       Log every interrupt and underrun\n");
+}
+
+/* Parses "S,N" */
+static bool sim_parseBuffers(const char *arg) {
+    unsigned int samples, bufs;
+
+    if (sscanf(arg, "%u,%u", &samples, &bufs) != 2) return false;
+    if (samples < 1 || samples > 0xFFFF / (STEREO * 2) || bufs < 2 || bufs > SIM_MAX_BUFS) return false;
+
+    s_cfg.sampsPerBuf   = (u16) samples;
+    s_cfg.numBufs       = (u16) bufs;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *replay = NULL;
+    int i;
+
+    s_cfg.sampsPerBuf   = 128;
+    s_cfg.numBufs       = 3;
+    s_cfg.seconds       = 10.0;
+    s_cfg.load          = 30.0;
+    s_cfg.writeCost     = 2.0;
+    s_cfg.isrCost       = 20.0;
+    s_cfg.irqLatency    = 5.0;
+    s_cfg.irqJitter     = 0.0;
+    s_cfg.nmiCost       = 5.0;
+    s_cfg.tickHz        = 70.0;
+    s_cfg.tickWrites    = 20;
+    s_cfg.writeGap      = 30.0;
+    s_cfg.replay        = NULL;
+    s_cfg.seed          = 1;
+    s_cfg.verbose       = false;
+
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        bool ok = true;
+
+        if (arg[0] != '-' || arg[1] == 0 || arg[2] != 0) {
+            ok = false;
+        } else if (arg[1] == 'v') {
+            s_cfg.verbose = true;
+            continue;
+        } else if (value == NULL) {
+            ok = false;
+        } else {
+            switch (arg[1]) {
+                case 'b': ok = sim_parseBuffers(value); break;
+                case 't': s_cfg.seconds     = atof(value); ok = s_cfg.seconds > 0.0; break;
+                case 'l': s_cfg.load        = atof(value); break;
+                case 'c': s_cfg.writeCost   = atof(value); break;
+                case 'i': s_cfg.isrCost     = atof(value); break;
+                case 'q': s_cfg.irqLatency  = atof(value); break;
+                case 'j': s_cfg.irqJitter   = atof(value); break;
+                case 'n': s_cfg.nmiCost     = atof(value); break;
+                case 'r': s_cfg.tickHz      = atof(value); ok = s_cfg.tickHz > 0.0; break;
+                case 'w': s_cfg.tickWrites  = (u16) atoi(value); ok = s_cfg.tickWrites > 0; break;
+                case 'g': s_cfg.writeGap    = atof(value); break;
+                case 'f': s_cfg.replay      = value; break;
+                case 's': s_cfg.seed        = (u32) strtoul(value, NULL, 0); break;
+                default:  ok = false; break;
+            }
+            i++;
+        }
+
+        if (!ok) {
+            sim_printUsage();
+            return 1;
+        }
+    }
+
+    if (s_cfg.replay) {
+        replay = fopen(s_cfg.replay, "rb");
+        if (replay == NULL) {
+            printf("ERROR: Can't open %s\n", s_cfg.replay);
+            return 1;
+        }
+    }
+
+    s_rand          = s_cfg.seed ? s_cfg.seed : 1;
+    s_period        = 1000000.0 / FM_PCM_SAMPLE_RATE;
+    s_blockTime     = s_period * s_cfg.sampsPerBuf;
+    s_stats.latMin  = 1e30;
+    s_ackTime       = -1.0;
+
+    sim_run(replay);
+    sim_printStats();
+
+    if (replay) fclose(replay);
+
+    return (s_stats.staleBlocks || s_stats.tornBlocks || s_stats.dropped) ? 2 : 0;
+}
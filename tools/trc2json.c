@@ -0,0 +1,182 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * TRC2JSON - Converts an event trace ("V97TSR t <file>", TRACE=1 builds) to Chrome trace JSON
+ *
+ * The result can be opened with chrome://tracing or https://ui.perfetto.dev and shows the
+ * DMA interrupt (with the time spent generating the block nested in it) and the trapped
+ * OPL writes on a timeline, plus the register queue depth as a counter.
+ *
+ * Build on the host: cc -O2 -o trc2json tools/trc2json.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+typedef unsigned char       u8;
+typedef unsigned short      u16;
+typedef unsigned int        u32;
+
+/* Same as vfm_trc.h */
+#define VFM_TRACE_MAGIC         "VFMTRACE"
+#define VFM_TRC_ISR_START       1
+#define VFM_TRC_ISR_END         2
+#define VFM_TRC_NMI_ENTER       3
+#define VFM_TRC_NMI_EXIT        4
+#define VFM_TRC_QUEUE_FULL      5
+#define VFM_TRC_WRITES          6
+#define VFM_TRC_GEN_START       7
+#define VFM_TRC_GEN_END         8
+#define VFM_TRC_MARK            9
+
+#define TRC_TID_ISR             1
+#define TRC_TID_NMI             2
+
+static FILE *s_out;
+static int s_first = 1;
+
+static u32 trc_getU32(const u8 *p) {
+    return (u32) p[0] | ((u32) p[1] << 8) | ((u32) p[2] << 16) | ((u32) p[3] << 24);
+}
+
+static u16 trc_getU16(const u8 *p) {
+    return (u16) (p[0] | (p[1] << 8));
+}
+
+/* Starts a JSON event, the caller adds its own fields and the closing brace */
+static void trc_event(const char *name, char phase, int tid, double ts) {
+    fprintf(s_out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+        s_first ? "" : ",", name, phase, tid, ts);
+    s_first = 0;
+}
+
+static void trc_threadName(int tid, const char *name) {
+    fprintf(s_out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+        s_first ? "" : ",", tid, name);
+    s_first = 0;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *in;
+    u8 header[16];
+    u8 ev[8];
+    u32 timeHz;
+    u32 count;
+    u32 i;
+    u32 last = 0;
+    double ticks = 0.0;                     /* Timestamp with the 32-bit wrap arounds added back in */
+
+    if (argc < 2 || argc > 3) {
+        printf("Usage: trc2json <trace file> [<json file>]\n");
+        return 1;
+    }
+
+    in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        printf("ERROR: Can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    if (fread(header, sizeof(header), 1, in) != 1 || memcmp(header, VFM_TRACE_MAGIC, 8) != 0) {
+        printf("ERROR: %s is not an event trace\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+
+    timeHz  = trc_getU32(header + 8);
+    count   = trc_getU16(header + 12);
+
+    if (timeHz == 0) {
+        printf("ERROR: Trace has no timestamp frequency\n");
+        fclose(in);
+        return 1;
+    }
+
+    s_out = (argc == 3) ? fopen(argv[2], "w") : stdout;
+    if (s_out == NULL) {
+        printf("ERROR: Can't create %s\n", argv[2]);
+        fclose(in);
+        return 1;
+    }
+
+    fprintf(s_out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"time_hz\":%u,\"time_source\":\"%s\"},\"traceEvents\":[",
+        timeHz, header[14] ? "PIT" : "TSC");
+
+    trc_threadName(TRC_TID_ISR, "DMA interrupt");
+    trc_threadName(TRC_TID_NMI, "NMI (trapped OPL writes)");
+
+    for (i = 0; i < count; i++) {
+        u32 time;
+        u16 arg;
+        double ts;
+        char name[16];
+
+        if (fread(ev, sizeof(ev), 1, in) != 1) {
+            fprintf(stderr, "WARNING: Trace ends after %u of %u events\n", i, count);
+            break;
+        }
+
+        time    = trc_getU32(ev);
+        arg     = trc_getU16(ev + 6);
+
+        /* Events are in order, so a smaller timestamp means it wrapped around */
+        if (i > 0) ticks += (double) (u32) (time - last);
+        last    = time;
+        ts      = ticks * 1000000.0 / timeHz;
+
+        switch (ev[4]) {
+            case VFM_TRC_ISR_START:
+                trc_event("ISR", 'B', TRC_TID_ISR, ts);
+                fprintf(s_out, ",\"args\":{\"buffer\":%u}}", arg);
+                break;
+            case VFM_TRC_ISR_END:
+                trc_event("ISR", 'E', TRC_TID_ISR, ts);
+                fprintf(s_out, "}");
+                break;
+            case VFM_TRC_GEN_START:
+                trc_event("generate", 'B', TRC_TID_ISR, ts);
+                fprintf(s_out, ",\"args\":{\"samples\":%u}}", arg);
+                break;
+            case VFM_TRC_GEN_END:
+                trc_event("generate", 'E', TRC_TID_ISR, ts);
+                fprintf(s_out, "}");
+                break;
+            case VFM_TRC_WRITES:
+                trc_event("writes applied", 'i', TRC_TID_ISR, ts);
+                fprintf(s_out, ",\"s\":\"t\",\"args\":{\"count\":%u}}", arg);
+                break;
+            case VFM_TRC_MARK:
+                sprintf(name, "mark %02X", arg);
+                trc_event(name, 'i', TRC_TID_ISR, ts);
+                fprintf(s_out, ",\"s\":\"t\"}");
+                break;
+            case VFM_TRC_NMI_ENTER:
+                trc_event("NMI", 'B', TRC_TID_NMI, ts);
+                fprintf(s_out, "}");
+                break;
+            case VFM_TRC_NMI_EXIT:
+                trc_event("NMI", 'E', TRC_TID_NMI, ts);
+                fprintf(s_out, "}");
+                trc_event("queue depth", 'C', TRC_TID_NMI, ts);
+                fprintf(s_out, ",\"args\":{\"writes\":%u}}", arg);
+                break;
+            case VFM_TRC_QUEUE_FULL:
+                trc_event("queue full", 'i', TRC_TID_NMI, ts);
+                fprintf(s_out, ",\"s\":\"g\",\"args\":{\"size\":%u}}", arg);
+                break;
+            default:
+                fprintf(stderr, "WARNING: Unknown event type %u\n", ev[4]);
+                break;
+        }
+    }
+
+    fprintf(s_out, "\n]}\n");
+
+    fclose(in);
+    if (s_out != stdout) fclose(s_out);
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef _VFM_ADP_H_
+#define _VFM_ADP_H_
+
+#include "types.h"
+
+/*  Adaptive quality (/adapt)
+    The DMA ISR times every block it renders. When a block takes longer than the budget (a share of the
+    block's playback time), the core steps down one tier, trading accuracy for speed before the DMA
+    engine runs dry. After a second of blocks well within the budget it steps back up again.
+    "V97TSR q" shows the state of the resident TSR, it gets to it through VFM_API_GET_ADAPT.
+    "V97TSR set /adapt..." turns it on or off or changes the budget of the resident TSR (see vfm_cfg.h).
+    Timestamps are the same as the event trace's (see vfm_trc.h). */
+
+/* Quality tiers, each one includes the reductions of the ones before it */
+typedef enum {
+    VFM_TIER_FULL = 0,                      /* Everything sample accurate */
+    VFM_TIER_BLOCK_LFO,                     /* Vibrato and tremolo move once per block (DBOPL) */
+    VFM_TIER_BLOCK_ENV,                     /* Envelopes move once per block, except for attacks (DBOPL) */
+    VFM_TIER_HALF_RATE,                     /* Core renders at 12 kHz, upsampled (/half alone keeps the rest sample accurate) */
+    VFM_TIER_COUNT
+} vfm_AdaptTier;
+
+/* Default and limits of the budget in percent of the block period (/adapt:<percent>) */
+#define VFM_ADAPT_DEFAULT_PCT   70
+#define VFM_ADAPT_MIN_PCT       10
+#define VFM_ADAPT_MAX_PCT       100
+
+/* Adaptive quality state, kept resident */
+#pragma pack(1)
+typedef struct {
+    u8          enabled;                    /* Tiers are switched by the DMA ISR */
+    u8          tier;                       /* Tier in use (vfm_AdaptTier) */
+    u8          baseTier;                   /* Best tier it steps back up to (/half starts at VFM_TIER_HALF_RATE) */
+    u8          tiers;                      /* Tiers the core supports, bit per vfm_AdaptTier */
+    u32         timeHz;                     /* Timestamp frequency */
+    u32         period;                     /* Playback time of a DMA block in timestamp units */
+    u32         budget;                     /* Render time above which it steps down */
+    u32         last;                       /* Render time of the last block */
+    u32         worst;                      /* Longest render time since the TSR was loaded */
+    u16         calm;                       /* Blocks in a row within half of the budget */
+    u16         calmBlocks;                 /* Calm blocks needed to step up */
+    u16         stepsDown;                  /* Times it stepped down */
+    u16         stepsUp;                    /* Times it stepped up */
+    u16         percent;                    /* Budget in percent of the block period */
+} vfm_AdaptState;
+#pragma pack()
+
+extern vfm_AdaptState               g_vfm_adapt;
+
+/* Measures the timestamp frequency and sets up the budget for <percent> of the playback time of a block */
+void vfm_adaptSetup(u16 percent, u16 sampsPerBuf, u16 rate);
+/* Measures the timestamp frequency (timeHz) */
+u32 vfm_adaptMeasureHz(void);
+/* Sets up the budget for <percent> of the playback time of a block from timeHz (resident, vfm_core.c) */
+void vfm_adaptSetBudget(u16 percent, u16 sampsPerBuf, u16 rate);
+/* Prints the adaptive quality state of the resident TSR */
+bool vfm_adaptPrint(void);
+
+#endif
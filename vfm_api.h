@@ -0,0 +1,108 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * Direct OPL register write API of the resident TSR (INT 2Fh multiplex)
+ *
+ * Programs that know about the TSR can hand it batches of register writes
+ * instead of writing to 0x388/0x389, which costs a trapped I/O cycle and an
+ * NMI per write.
+ *
+ * INT 2Fh, AH = VFM_API_MPX_ID:
+ *
+ *   AL = VFM_API_INSTALL_CHECK
+ *        Returns AL = 0xFF and BX = VFM_API_SIGNATURE if the TSR is loaded
+ *
+ *   AL = VFM_API_WRITE_REGS
+ *        ES:SI = vfm_ApiRegWrite array, CX = count
+ *        Returns CX = writes queued, CF set if the queue couldn't take all of them
+ *        (the rest has to be sent again after the next DMA block was rendered)
+ *
+ *   AL = VFM_API_GET_ENTRY
+ *        Returns ES:BX = far entry point taking the same registers as
+ *        VFM_API_WRITE_REGS (without going through the INT 2Fh chain),
+ *        CX = register queue size
+ *
+ *   AL = VFM_API_GET_CAPTURE
+ *        Returns ES:BX = capture states of the TSR (vfm_CaptureState[VFM_CAP_COUNT], see vfm_cap.h),
+ *        used by the dump command. Unchanged if the TSR is older than this function.
+ *
+ *   AL = VFM_API_GET_TRACE
+ *        Returns ES:BX = event trace of the TSR (vfm_TraceState, see vfm_trc.h),
+ *        used by the trace dump command. Unchanged if the TSR wasn't built with TRACE=1.
+ *
+ *   AL = VFM_API_GET_ADAPT
+ *        Returns ES:BX = adaptive quality state of the TSR (vfm_AdaptState, see vfm_adp.h),
+ *        used by the query command. Unchanged if the TSR is older than this function.
+ *
+ *   AL = VFM_API_GET_CONFIG
+ *        ES:BX = vfm_ApiConfig, filled in with the settings of the TSR
+ *        Returns AX = VFM_API_CFG_OK, or VFM_API_CFG_ERR_BUSY with CF set while a VFM_API_SET_CONFIG
+ *        call is running. The buffer is unchanged if the TSR is older than this function.
+ *
+ *   AL = VFM_API_SET_CONFIG
+ *        ES:BX = vfm_ApiConfig, fields set to VFM_API_KEEP stay as they are
+ *        Switches the loaded TSR to these settings without unloading it. Changing the buffers
+ *        restarts the DMA engine, switching the core resets it (the OPL registers have to be
+ *        written again). Nuked-OPL3 is only resident if the TSR was loaded with it. Returns AX = VFM_API_CFG_OK, or the VFM_API_CFG_ERR_... code with CF
+ *        set, in which case nothing was changed. Interrupts are on while the buffers are laid out
+ *        and the core is reset, the FM output is silent until the switch is done. Calls from
+ *        interrupt handlers in the meantime fail with VFM_API_CFG_ERR_BUSY.
+ *
+ * All other registers are preserved. Don't mix this with port writes from
+ * the same program, the writes are applied in the order they are queued.
+ */
+
+#ifndef _VFM_API_H_
+#define _VFM_API_H_
+
+#include "types.h"
+
+#define VFM_API_MPX_ID          0xC9
+#define VFM_API_INSTALL_CHECK   0x00
+#define VFM_API_WRITE_REGS      0x01
+#define VFM_API_GET_ENTRY       0x02
+#define VFM_API_GET_CAPTURE     0x03
+#define VFM_API_GET_TRACE       0x04
+#define VFM_API_GET_ADAPT       0x05
+#define VFM_API_GET_CONFIG      0x06
+#define VFM_API_SET_CONFIG      0x07
+#define VFM_API_SIGNATURE       0xAC97
+
+/* Results of VFM_API_SET_CONFIG */
+#define VFM_API_CFG_OK          0
+#define VFM_API_CFG_ERR_RANGE   1           /* A setting is outside the limits of the build */
+#define VFM_API_CFG_ERR_HALF    2           /* Half rate synthesis needs an even number of samples per buffer */
+#define VFM_API_CFG_ERR_CAPTURE 3           /* The samples per buffer can't change while a capture is set up */
+#define VFM_API_CFG_ERR_TIMEHZ  4           /* Adaptive quality needs the timestamp frequency (timeHz) */
+#define VFM_API_CFG_ERR_CORE    5           /* The core wasn't kept when the TSR went resident */
+#define VFM_API_CFG_ERR_BUSY    6           /* Another VFM_API_SET_CONFIG call is running */
+
+/* vfm_ApiConfig field value that VFM_API_SET_CONFIG leaves as it is */
+#define VFM_API_KEEP            0xFFFF
+
+/* One register write, same layout as the TSR's register queue */
+#pragma pack(1)
+typedef struct {
+    u16 reg;                                /* Register index, bit 8 set = bank B (0x100-0x1FF) */
+    u8  reserved;
+    u8  val;
+} vfm_ApiRegWrite;
+
+/* Settings of the loaded TSR, same meaning as the load time options */
+typedef struct {
+    u16 sampsPerBuf;                        /* Samples per DMA buffer (/buf) */
+    u16 numBufs;                            /* DMA buffer count (/buf) */
+    u16 core;                               /* OPL emulation core, vfm_CoreType (/core) */
+    u16 halfRate;                           /* 1 = core renders at half the DMA rate, upsampled (/half) */
+    u16 voiceLimit;                         /* Most voices rendered at once (DBOPL), 0 = no limit (/poly) */
+    u16 adaptPct;                           /* Adaptive quality budget in percent of a block, 0 = off (/adapt) */
+    u32 timeHz;                             /* Timestamp frequency, 0 = keep. Needed to turn on the adaptive quality */
+    u16 maxSampsPerBuf;                     /* Limits of the build, only filled in by VFM_API_GET_CONFIG */
+    u16 maxBufs;
+} vfm_ApiConfig;
+#pragma pack()
+
+#endif
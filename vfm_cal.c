@@ -0,0 +1,139 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * Load time calibration - Times the OPL core on a worst case register stream
+ * and picks the DMA block size and buffer count from it
+ *
+ * Timing is done against the BIOS tick counter (PIT channel 0, ~18.2 Hz),
+ * so it works the same on every CPU, with or without RDTSC.
+ */
+
+#include "vfm_cal.h"
+#include "vfm_core.h"
+#include "vfm_tsr.h"
+
+#define STEREO 2
+
+#define VFM_CAL_TICKS           4           /* BIOS ticks to render for (~220 ms) */
+#define VFM_CAL_BLOCK           32          /* Block size rendered during calibration, smallest one = most overhead */
+#define VFM_CAL_WRITES          4           /* Register writes queued per block */
+#define VFM_CAL_IRQ_SLACK       24          /* Interrupt latency allowed for, in samples (1 ms) */
+#define VFM_CAL_BUDGET          80          /* Part of the buffered time a block may take to render, in percent */
+
+/* Definitions from vfm_icmn.asm */
+extern vfm_OplQueueEntry            g_OPL_RegQueue[];                       /* Register writes queued by the NMI handler */
+extern u16                          g_OPL_RegCount;                         /* Amount of queued register writes */
+
+/* Definitions from vfm_tsr.c */
+extern u16                          g_vfm_sampsPerBuf;                      /* Samples per DMA buffer in use */
+
+static volatile u32 _far           *s_biosTicks = (volatile u32 _far *) 0x0040006CUL;
+
+/* Operator offsets of the two operators of channels 0-8 in a register bank */
+static const u8 VFM_TEXT s_opOffsets[9] = { 0x00, 0x01, 0x02, 0x08, 0x09, 0x0A, 0x10, 0x11, 0x12 };
+
+/* Sets up all 18 channels in OPL3 mode with everything that makes the cores slow */
+static void vfm_calSetupChip() {
+    u16 bank;
+    u16 ch;
+
+    vfm_coreWriteReg(0x105, 0x01);              /* OPL3 mode */
+    vfm_coreWriteReg(0x104, 0x00);              /* No 4-op channels */
+    vfm_coreWriteReg(0x0BD, 0xC0);              /* Deep tremolo & vibrato */
+
+    for (bank = 0; bank < 0x200; bank += 0x100) {
+        for (ch = 0; ch < 9; ch++) {
+            u16 mod = bank + s_opOffsets[ch];
+            u16 car = mod + 3;
+
+            vfm_coreWriteReg(0x20 + mod, 0xE1); /* AM, VIB, sustain, MULT 1 */
+            vfm_coreWriteReg(0x20 + car, 0xE2);
+            vfm_coreWriteReg(0x40 + mod, 0x00); /* Full volume */
+            vfm_coreWriteReg(0x40 + car, 0x00);
+            vfm_coreWriteReg(0x60 + mod, 0xF0); /* Fastest attack, no decay */
+            vfm_coreWriteReg(0x60 + car, 0xF0);
+            vfm_coreWriteReg(0x80 + mod, 0x0F);
+            vfm_coreWriteReg(0x80 + car, 0x0F);
+            vfm_coreWriteReg(0xE0 + mod, (u8) ((ch + (bank >> 8)) & 7));
+            vfm_coreWriteReg(0xE0 + car, (u8) ((ch + 3) & 7));
+
+            vfm_coreWriteReg(bank + 0xC0 + ch, 0x3E);           /* Left + right, feedback 7, FM */
+            vfm_coreWriteReg(bank + 0xA0 + ch, (u8) (0x40 + ch * 16));
+            vfm_coreWriteReg(bank + 0xB0 + ch, 0x31);           /* Key on, block 4 */
+        }
+    }
+}
+
+/* Queues frequency changes like the NMI handler would during a busy song */
+static void vfm_calQueueWrites(u16 block) {
+    u16 i;
+
+    for (i = 0; i < VFM_CAL_WRITES; i++) {
+        u16 ch = (block + i) % 9;
+
+        g_OPL_RegQueue[i].bankedIndex   = ((i & 1) ? 0x100 : 0) + 0xA0 + ch;
+        g_OPL_RegQueue[i].data          = (u8) (block + i * 16);
+    }
+
+    g_OPL_RegCount = VFM_CAL_WRITES;
+}
+
+u16 vfm_calMeasureLoad(i16 *scratch, u32 rate) {
+    u32 expected = rate * VFM_CAL_TICKS * 2048UL / 37287UL;  /* Samples in VFM_CAL_TICKS at 1193182 / 65536 Hz */
+    u32 rendered = 0;
+    u32 start;
+    u16 block = 0;
+    u16 sampsPerBuf = g_vfm_sampsPerBuf;
+
+    vfm_calSetupChip();
+    g_vfm_sampsPerBuf = VFM_CAL_BLOCK;
+
+    /* Start on a tick boundary */
+    start = *s_biosTicks;
+    while (*s_biosTicks == start) {}
+    start = *s_biosTicks;
+
+    while (*s_biosTicks - start < VFM_CAL_TICKS) {
+        vfm_calQueueWrites(block++);
+        vfm_renderBlock(scratch);
+        rendered += VFM_CAL_BLOCK;
+    }
+
+#if CPU_LEVEL >= 6
+    vfm_mmxEmms();
+#endif
+
+    g_OPL_RegCount      = 0;
+    g_vfm_sampsPerBuf   = sampsPerBuf;
+
+    if (rendered == 0) return 0xFFFF;
+    return (u16) (expected * 100UL / rendered);
+}
+
+bool vfm_calPickBuffers(u16 load, u16 *sampsPerBuf, u16 *numBufs) {
+    u32 best = 0xFFFFFFFFUL;
+    u16 size;
+    u16 count;
+
+    if (load > VFM_CAL_MAX_LOAD) return false;
+
+    /*  A block has to be rendered before the buffers in front of it have been played,
+        including the time it takes for our interrupt to be serviced */
+    for (size = VFM_CAL_BLOCK; size <= SAMPS_PER_BUF; size *= 2) {
+        for (count = 2; count <= NUM_BUFS; count++) {
+            u32 renderTime = (u32) load * size / 100UL + VFM_CAL_IRQ_SLACK;
+            u32 budget = (u32) (count - 1) * size * VFM_CAL_BUDGET / 100UL;
+
+            if (renderTime <= budget && (u32) size * count < best) {
+                best            = (u32) size * count;
+                *sampsPerBuf    = size;
+                *numBufs        = count;
+            }
+        }
+    }
+
+    return best != 0xFFFFFFFFUL;
+}
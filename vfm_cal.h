@@ -0,0 +1,14 @@
+#ifndef _VFM_CAL_H_
+#define _VFM_CAL_H_
+
+#include "types.h"
+
+/* Load above which a core can't be run safely, in percent of real time (leaves room for the game) */
+#define VFM_CAL_MAX_LOAD        90
+
+/* Measures the rendering load of the selected core in percent of real time, using <scratch> as output buffer */
+u16 vfm_calMeasureLoad(i16 *scratch, u32 rate);
+/* Picks the lowest latency block size and buffer count that is safe for <load>, false if there is none */
+bool vfm_calPickBuffers(u16 load, u16 *sampsPerBuf, u16 *numBufs);
+
+#endif
@@ -0,0 +1,180 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * OPL register and output capture - Resident part, records to XMS from the DMA ISR
+ */
+
+#include "vfm_cap.h"
+
+#define STEREO 2
+
+vfm_CaptureState                    g_vfm_capture[VFM_CAP_COUNT] = { 0 };
+
+static vfm_XmsMove                  s_move;
+static const vfm_OplQueueEntry      s_blockEnd = { VFM_CAP_BLOCK_END, 0, 0xFF };
+
+/* Stages in conventional memory, the records wait there until the XMS driver can be called */
+static u8                           s_regStage[VFM_CAP_REG_STAGE];
+static u8                           s_outStage[VFM_CAP_OUT_STAGE];
+static u8 * const                   s_stage[VFM_CAP_COUNT]      = { s_regStage, s_outStage };
+static const u16                    s_stageSize[VFM_CAP_COUNT]  = { sizeof(s_regStage), sizeof(s_outStage) };
+
+/*  Copies <bytes> (even) to the write position of the ring buffer, wrapping around at its end.
+    The XMS driver must not be busy. Stops the capture and returns false if the driver fails */
+static bool vfm_capWrite(vfm_CaptureState *cap, const void *src, u16 bytes) {
+    void _far *xms = cap->xmsEntry;
+    const u8 _far *data = (const u8 _far *) src;
+    u16 ok;
+
+    while (bytes) {
+        u32 room = cap->size - cap->pos;
+        u16 chunk = (u32) bytes > room ? (u16) room : bytes;
+
+        s_move.length       = chunk;
+        s_move.srcHandle    = 0;
+        s_move.srcOffset    = (u32) data;
+        s_move.dstHandle    = cap->handle;
+        s_move.dstOffset    = cap->pos;
+
+        _asm {
+            push si
+            mov si, offset s_move
+            mov ah, 0x0B
+            call dword ptr [xms]
+            mov ok, ax
+            pop si
+        }
+
+        /* Don't keep calling a driver that fails */
+        if (ok != 1) {
+            cap->active = 0;
+            return false;
+        }
+
+        cap->pos += chunk;
+        if (cap->pos >= cap->size) {
+            cap->pos        = 0;
+            cap->wrapped    = 1;
+        }
+
+        data    += chunk;
+        bytes   -= chunk;
+    }
+
+    return true;
+}
+
+/* Copies <bytes> (even) from <src> to <dst> */
+static void vfm_capCopy(void *dst, const void *src, u16 bytes) {
+    _asm {
+        push si
+        push di
+        push es
+        push ds
+        pop es
+        mov si, src
+        mov di, dst
+        mov cx, bytes
+        shr cx, 1
+        cld
+        rep movsw
+        pop es
+        pop di
+        pop si
+    }
+}
+
+/* Appends <bytes> (even) to the stage of capture <index>, the caller checks that they fit */
+static void vfm_capStage(u16 index, const void *src, u16 bytes) {
+    vfm_CaptureState *cap = &g_vfm_capture[index];
+    u8 *stage = s_stage[index];
+    u16 size = s_stageSize[index];
+    u16 tail = cap->stageHead + cap->stageUsed;
+    u16 chunk;
+
+    if (tail >= size) tail -= size;
+
+    chunk = size - tail;
+    if (chunk > bytes) chunk = bytes;
+
+    vfm_capCopy(stage + tail, src, chunk);
+    vfm_capCopy(stage, (const u8 *) src + chunk, bytes - chunk);
+
+    cap->stageUsed += bytes;
+}
+
+void vfm_capFlush(void) {
+    u16 i;
+
+    if (g_XMS_Busy) return;
+
+    for (i = 0; i < VFM_CAP_COUNT; i++) {
+        vfm_CaptureState *cap = &g_vfm_capture[i];
+
+        /* Also while paused, so the dump command can wait for the stage to run empty */
+        while (cap->stageUsed) {
+            u16 chunk = s_stageSize[i] - cap->stageHead;
+
+            if (chunk > cap->stageUsed) chunk = cap->stageUsed;
+
+            /* The driver failed and the capture has stopped, what's left is thrown away */
+            if (!vfm_capWrite(cap, s_stage[i] + cap->stageHead, chunk)) {
+                cap->stageUsed = 0;
+                break;
+            }
+
+            cap->stageHead += chunk;
+            if (cap->stageHead >= s_stageSize[i]) cap->stageHead = 0;
+            cap->stageUsed -= chunk;
+        }
+    }
+}
+
+void vfm_capRecordBlock(const vfm_OplQueueEntry *entries, u16 count) {
+    vfm_CaptureState *cap = &g_vfm_capture[VFM_CAP_REGS];
+    u16 bytes = count * sizeof(vfm_OplQueueEntry);
+    u16 room = s_stageSize[VFM_CAP_REGS] - cap->stageUsed;
+
+    /*  The stage holds two blocks, so it only runs full if the XMS driver was busy for longer than that.
+        The writes are dropped then, but the block end keeps the timing of the next ones right */
+    if (bytes + sizeof(s_blockEnd) > room) {
+        cap->lost += count;
+        bytes = 0;
+    }
+
+    if (sizeof(s_blockEnd) > room) {
+        cap->lost++;
+        return;
+    }
+
+    if (bytes) {
+        vfm_capStage(VFM_CAP_REGS, entries, bytes);
+    }
+
+    vfm_capStage(VFM_CAP_REGS, &s_blockEnd, sizeof(s_blockEnd));
+}
+
+void vfm_capRecordOutput(const i16 *out, u32 time, u32 trapTime, u16 queueDepth, u16 writes) {
+    vfm_CaptureState *cap = &g_vfm_capture[VFM_CAP_OUTPUT];
+    vfm_CapBlockHeader header;
+    u16 bytes = cap->sampsPerBuf * STEREO * sizeof(i16);
+
+    /* The stage holds two blocks, if the XMS driver was busy for longer the block is dropped */
+    if (sizeof(header) + bytes > s_stageSize[VFM_CAP_OUTPUT] - cap->stageUsed) {
+        cap->blocks++;
+        cap->lost++;
+        return;
+    }
+
+    header.block        = cap->blocks++;
+    header.time         = time;
+    header.trapTime     = trapTime;
+    header.queueDepth   = queueDepth;
+    header.writes       = writes;
+
+    vfm_capStage(VFM_CAP_OUTPUT, &header, sizeof(header));
+    vfm_capStage(VFM_CAP_OUTPUT, out, bytes);
+}
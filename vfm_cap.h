@@ -0,0 +1,104 @@
+#ifndef _VFM_CAP_H_
+#define _VFM_CAP_H_
+
+#include "types.h"
+#include "vfm_core.h"
+
+/*  OPL register and output capture
+    The DMA ISR appends every register write it applies to a ring buffer in XMS, followed by a block end
+    marker after each rendered block. Writes take effect one sample after another from the start of their
+    block, so their exact position in time is known from the block size and sample rate.
+    The output capture records every rendered block with a vfm_CapBlockHeader in front of it.
+    The XMS driver isn't reentrant and the DMA ISR may interrupt a program that is calling it. So the ISR
+    first puts the records into a stage in conventional memory, and only moves them on to XMS when
+    g_XMS_Busy says it didn't interrupt a call through the XMS entry point (see vfm_xmsHook).
+    Programs that call the driver without going through its entry point aren't covered. */
+
+/* bankedIndex of the entry that ends a block (same as in the DBGREG format) */
+#define VFM_CAP_BLOCK_END       0xFFFF
+
+/* Capture ring buffer size limits in KB (/cap:<KB>, /capout:<KB>) */
+#define VFM_CAP_MIN_KB          4
+#define VFM_CAP_MAX_KB          65000
+
+/* Stage of the register capture: two blocks with a write on every sample */
+#define VFM_CAP_REG_STAGE       ((SAMPS_PER_BUF + 1) * sizeof(vfm_OplQueueEntry) * 2)
+/* Stage of the output capture: two blocks of the largest size */
+#define VFM_CAP_OUT_STAGE       ((sizeof(vfm_CapBlockHeader) + SAMPS_PER_BUF * 2 * sizeof(i16)) * 2)
+
+/* Captures, index into g_vfm_capture */
+#define VFM_CAP_REGS            0           /* Register writes */
+#define VFM_CAP_OUTPUT          1           /* Rendered blocks */
+#define VFM_CAP_COUNT           2
+
+/* Dump file formats */
+typedef enum {
+    VFM_CAP_FMT_DBGREG = 0,                 /* 3-byte register/value records, 0xFFFF/0xFF after every 512 samples */
+    VFM_CAP_FMT_DRO,                        /* DOSBox Raw OPL v2.0 */
+    VFM_CAP_FMT_WAV                         /* Output capture as WAV, timing of the blocks as CSV next to it */
+} vfm_CapFormat;
+
+/* XMS function 0Bh (move extended memory block) parameters, handle 0 = real mode seg:ofs address */
+#pragma pack(1)
+typedef struct {
+    u32 length;
+    u16 srcHandle;
+    u32 srcOffset;
+    u16 dstHandle;
+    u32 dstOffset;
+} vfm_XmsMove;
+#pragma pack()
+
+/* Capture state, kept resident. The dump command gets to it through VFM_API_GET_CAPTURE */
+#pragma pack(1)
+typedef struct {
+    void _far  *xmsEntry;                   /* XMS driver entry point */
+    u32         size;                       /* Ring buffer size in bytes, multiple of the record size */
+    u32         pos;                        /* Write position in the ring buffer */
+    u32         blocks;                     /* Blocks rendered since the capture was started, also counted while paused */
+    u32         timeHz;                     /* Timestamp frequency, see vfm_isrTimestamp */
+    u32         lost;                       /* Records dropped because the stage was full (writes/block ends or blocks) */
+    u16         handle;                     /* XMS handle of the ring buffer, 0 = no capture */
+    u16         recordSize;                 /* Size of a record (register write or output block) */
+    u16         sampsPerBuf;                /* Samples per captured block */
+    u16         rate;                       /* Sample rate in Hz */
+    u16         stageHead;                  /* Oldest byte in the stage */
+    u16         stageUsed;                  /* Bytes in the stage that aren't in XMS yet */
+    u8          active;                     /* Capture is being recorded */
+    u8          wrapped;                    /* Ring buffer has wrapped around, the oldest data is lost */
+} vfm_CaptureState;
+
+/* Put in front of every block of the output capture, followed by sampsPerBuf 16-bit stereo samples */
+typedef struct {
+    u32         block;                      /* Block index since the capture was started */
+    u32         time;                       /* Timestamp of the DMA interrupt that rendered the block */
+    u32         trapTime;                   /* Timestamp of the first write queued since the queue was last empty, 0 = none */
+    u16         queueDepth;                 /* Register writes queued when the block was rendered */
+    u16         writes;                     /* Register writes applied in the block */
+} vfm_CapBlockHeader;
+#pragma pack()
+
+extern vfm_CaptureState             g_vfm_capture[VFM_CAP_COUNT];
+extern volatile u8                  g_XMS_Busy;                 /* Calls through the XMS entry point in progress, from vfm_isr.asm */
+extern u32                          g_OPL_TrapTime;             /* Timestamp of the first write queued since the queue was last empty */
+extern u8                           g_OPL_StampTraps;           /* The NMI handler and write API take g_OPL_TrapTime */
+
+/* Called by the DMA ISR: records the <count> writes applied to the block that was just rendered */
+void vfm_capRecordBlock(const vfm_OplQueueEntry *entries, u16 count);
+/* Called by the DMA ISR: records the block at <out> that was just rendered */
+void vfm_capRecordOutput(const i16 *out, u32 time, u32 trapTime, u16 queueDepth, u16 writes);
+/* Called by the DMA ISR: moves the staged records to XMS, unless it interrupted the XMS driver */
+void vfm_capFlush(void);
+
+/* Allocates a <kb> KB ring buffer in XMS for capture <index> and starts recording, false if there is no XMS or not enough of it */
+bool vfm_capSetup(u16 index, u16 kb, u16 sampsPerBuf, u16 rate);
+/* Points the XMS entry point at vfm_xmsHook, false if it doesn't look like one that can be hooked */
+bool vfm_capHookXms(void);
+/* Moves the hook along with the resident code when it's copied to <codeSeg> */
+void vfm_capMoveXmsHook(u16 codeSeg);
+/* Stops recording, frees the ring buffers and unhooks the XMS driver (only when not going resident) */
+void vfm_capFree(void);
+/* Dumps a capture of the resident TSR to <filename> and restarts it */
+bool vfm_capDump(const char *filename, vfm_CapFormat format);
+
+#endif
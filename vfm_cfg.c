@@ -0,0 +1,227 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * Hot reconfiguration - Resident part, switches the buffers and core settings of the loaded TSR
+ */
+
+#include "vfm_cfg.h"
+#include "vfm_core.h"
+#include "vfm_cap.h"
+#include "vfm_adp.h"
+#include "v97_reg.h"
+#include "386asm.h"
+
+#define STEREO 2
+#define VFM_CFG_MAX_VOICES      18
+
+/* Definitions from vfm_tsr.c */
+extern v97_SgdTableEntry           *g_vfm_fmDmaTable;                       /* Pointer to SGD Table */
+extern u32                          g_vfm_fmDmaTablePhysAddress;            /* Physical 32-Bit address of SGD table */
+extern i16                         *g_vfm_fmDmaBuffers[];                   /* Pointer list for all DMA buffers */
+extern u16                          g_vfm_sampsPerBuf;                      /* Samples per DMA buffer in use */
+extern u16                          g_vfm_numBufs;                          /* DMA buffers in use */
+extern u16                          g_vfm_ioBaseDma;                        /* Base I/O port for Audio Codec / SGD Interface */
+
+/* The port functions of vfm_mini.c are gone once the TSR is resident */
+
+static void vfm_cfgOutB(u16 port, u8 val) {
+    _asm {
+        mov dx, port
+        mov al, val
+        out dx, al
+    }
+}
+
+static void vfm_cfgOutL(u16 port, u32 val) {
+    u32 _far *valFarPtr = (u32 _far *) &val;
+    (void) valFarPtr; /* asm macro below doesn't detect it as used */
+    _asm {
+        PUSH32(_EAX)
+        mov dx, port
+        MOV_REG_DWORDPTR(_EAX, valFarPtr)
+        OUT_DX_EAX
+        POP32(_EAX)
+    }
+}
+
+static void vfm_cfgIoDelay(u16 loops) {
+    while (loops--) {
+        _asm {
+            mov al, 1
+            out 0xED, al
+        }
+    }
+}
+
+/* Stops the FM SGD channel, same as vfm_tsrStopDma without the delay after it */
+static void vfm_cfgStopDma(void) {
+    v97_SgdChannelType sgdType;
+    v97_SgdChannelCtrl sgdCtrl;
+
+    sgdType.raw = 0;
+    vfm_cfgOutB(g_vfm_ioBaseDma + V97_FM_SGD_TYPE, sgdType.raw);
+
+    sgdCtrl.raw = 0;
+    sgdCtrl.terminate = 1;
+    vfm_cfgOutB(g_vfm_ioBaseDma + V97_FM_SGD_CTRL, sgdCtrl.raw);
+}
+
+/* Starts the FM SGD channel from the first buffer of the DMA table, same as vfm_tsrStartDma without loading the table */
+static void vfm_cfgStartDma(void) {
+    v97_SgdChannelType sgdType;
+    v97_SgdChannelCtrl sgdCtrl;
+
+    sgdType.raw = 0;
+    sgdType.intOnFlag = 1;
+    sgdType.intOnEOL = 1;
+    sgdType.autoStartSgdAtEOL = 1;
+    vfm_cfgOutB(g_vfm_ioBaseDma + V97_FM_SGD_TYPE, sgdType.raw);
+
+    sgdCtrl.raw = 0;
+    sgdCtrl.start = 1;
+    vfm_cfgOutB(g_vfm_ioBaseDma + V97_FM_SGD_CTRL, sgdCtrl.raw);
+}
+
+void vfm_cfgBuildDmaTable(void) {
+    u16 size = g_vfm_sampsPerBuf * (sizeof(i16) * STEREO);
+    u8 *ptr = (u8 *) (g_vfm_fmDmaTable + g_vfm_numBufs);
+    u32 physAddr = g_vfm_fmDmaTablePhysAddress + sizeof(v97_SgdTableEntry) * g_vfm_numBufs;
+    u16 i;
+
+    /* The buffers start at the end of the DMA table */
+    for (i = 0; i < g_vfm_numBufs; i++) {
+        g_vfm_fmDmaBuffers[i] = (i16 *) ptr;
+
+        g_vfm_fmDmaTable[i].baseAddress = physAddr;
+        g_vfm_fmDmaTable[i].countFlags.stop = 0;
+        g_vfm_fmDmaTable[i].countFlags.length = (u32) size;
+
+        /* If this is the final buffer, mark it as EOL, else FLAG */
+        g_vfm_fmDmaTable[i].countFlags.flag = (i + 1 == g_vfm_numBufs) ? 0 : 1;
+        g_vfm_fmDmaTable[i].countFlags.eol  = (i + 1 == g_vfm_numBufs) ? 1 : 0;
+
+        ptr         += size;
+        physAddr    += size;
+    }
+}
+
+u16 vfm_cfgGet(vfm_ApiConfig _far *config) {
+    config->sampsPerBuf     = g_vfm_sampsPerBuf;
+    config->numBufs         = g_vfm_numBufs;
+    config->core            = (u16) vfm_coreGetType();
+    config->halfRate        = g_vfm_adapt.baseTier == VFM_TIER_HALF_RATE ? 1 : 0;
+    config->voiceLimit      = vfm_coreGetVoiceLimit();
+    config->adaptPct        = g_vfm_adapt.enabled ? g_vfm_adapt.percent : 0;
+    config->timeHz          = g_vfm_adapt.timeHz;
+    config->maxSampsPerBuf  = SAMPS_PER_BUF;
+    config->maxBufs         = NUM_BUFS;
+    return VFM_API_CFG_OK;
+}
+
+u16 vfm_cfgSet(const vfm_ApiConfig _far *config) {
+    vfm_ApiConfig cfg;
+    bool buffers;
+    bool reset;
+    i16 *buf;
+    u16 i;
+
+    vfm_cfgGet(&cfg);
+    if (config->sampsPerBuf != VFM_API_KEEP)    cfg.sampsPerBuf = config->sampsPerBuf;
+    if (config->numBufs != VFM_API_KEEP)        cfg.numBufs     = config->numBufs;
+    if (config->core != VFM_API_KEEP)           cfg.core        = config->core;
+    if (config->halfRate != VFM_API_KEEP)       cfg.halfRate    = config->halfRate;
+    if (config->voiceLimit != VFM_API_KEEP)     cfg.voiceLimit  = config->voiceLimit;
+    if (config->adaptPct != VFM_API_KEEP)       cfg.adaptPct    = config->adaptPct;
+    if (config->timeHz != 0)                    cfg.timeHz      = config->timeHz;
+
+    if (cfg.sampsPerBuf < 2 || cfg.sampsPerBuf > SAMPS_PER_BUF
+     || cfg.numBufs < 2 || cfg.numBufs > NUM_BUFS
+     || cfg.core >= VFM_CORE_COUNT || cfg.halfRate > 1
+     || cfg.voiceLimit > VFM_CFG_MAX_VOICES
+     || (cfg.adaptPct != 0 && (cfg.adaptPct < VFM_ADAPT_MIN_PCT || cfg.adaptPct > VFM_ADAPT_MAX_PCT))) {
+        return VFM_API_CFG_ERR_RANGE;
+    }
+
+    /* Only the core selected at load time is resident with DBOPL (see vfm_terminateAndStayResident) */
+    if (!vfm_coreIsAvailable((vfm_CoreType) cfg.core)) {
+        return VFM_API_CFG_ERR_CORE;
+    }
+
+    if (cfg.halfRate && (cfg.sampsPerBuf & 1)) {
+        return VFM_API_CFG_ERR_HALF;
+    }
+
+    /* The captures are laid out for the block size they were set up with */
+    if (cfg.sampsPerBuf != g_vfm_sampsPerBuf
+     && (g_vfm_capture[VFM_CAP_REGS].handle != 0 || g_vfm_capture[VFM_CAP_OUTPUT].handle != 0)) {
+        return VFM_API_CFG_ERR_CAPTURE;
+    }
+
+    if (cfg.adaptPct != 0 && cfg.timeHz == 0) {
+        return VFM_API_CFG_ERR_TIMEHZ;
+    }
+
+    buffers = cfg.sampsPerBuf != g_vfm_sampsPerBuf || cfg.numBufs != g_vfm_numBufs;
+    reset   = (vfm_CoreType) cfg.core != vfm_coreGetType();
+
+    if (buffers) {
+        vfm_cfgStopDma();
+    }
+
+    /*  Laying out the buffers and resetting a core take a while, so interrupts are on for that.
+        The DMA ISR doesn't touch the buffers or the core in the meantime (g_API_Busy), so they are
+        cleared first: a channel that keeps running plays silence instead of what was in them */
+    if (buffers || reset) {
+        _asm sti
+
+        if (buffers) {
+            vfm_cfgIoDelay(1000);
+
+            g_vfm_sampsPerBuf   = cfg.sampsPerBuf;
+            g_vfm_numBufs       = cfg.numBufs;
+            vfm_cfgBuildDmaTable();
+        }
+
+        /* The DMA ISR fills them again from its first interrupt after this on */
+        buf = g_vfm_fmDmaBuffers[0];
+        for (i = 0; i < g_vfm_sampsPerBuf * g_vfm_numBufs * STEREO; i++) {
+            buf[i] = 0;
+        }
+
+        if (buffers) {
+            vfm_cfgOutL(g_vfm_ioBaseDma + V97_FM_SGD_TABLE_PTR, g_vfm_fmDmaTablePhysAddress);
+            vfm_cfgIoDelay(1000);
+        }
+
+        /* A new core starts from reset */
+        if (reset) {
+            vfm_coreInit((vfm_CoreType) cfg.core, vfm_coreGetRate(), cfg.halfRate != 0);
+        }
+
+        _asm cli
+    }
+
+    /* Otherwise the rate is switched with phases and envelopes carrying on */
+    if (!reset) {
+        vfm_coreSetHalfRate(cfg.halfRate != 0);
+    }
+
+    vfm_coreSetVoiceLimit((u8) cfg.voiceLimit);
+
+    g_vfm_adapt.timeHz = cfg.timeHz;
+    if (cfg.adaptPct != 0) {
+        vfm_adaptSetBudget(cfg.adaptPct, g_vfm_sampsPerBuf, (u16) vfm_coreGetRate());
+        g_vfm_adapt.enabled = 1;
+    } else {
+        g_vfm_adapt.enabled = 0;
+    }
+
+    if (buffers) {
+        vfm_cfgStartDma();
+    }
+
+    return VFM_API_CFG_OK;
+}
@@ -0,0 +1,25 @@
+#ifndef _VFM_CFG_H_
+#define _VFM_CFG_H_
+
+#include "types.h"
+#include "vfm_api.h"
+
+/*  Hot reconfiguration ("V97TSR set")
+    VFM_API_SET_CONFIG switches the settings of the loaded TSR. New buffer settings stop the FM SGD channel,
+    lay out the DMA table and buffers in the memory pool again and restart it. The pool is sized for the
+    limits of the build and stays where it is, so its physical address (and the VDS lock) carries over.
+    Both API functions run on their own stack with interrupts off (see vfm_apiConfig in vfm_isr.asm).
+    vfm_cfgSet only turns them on while it lays out the buffers or resets the core. */
+
+/* Fills in the settings in use (resident, VFM_API_GET_CONFIG), returns VFM_API_CFG_OK */
+u16 vfm_cfgGet(vfm_ApiConfig _far *config);
+/* Switches to the settings in <config>, VFM_API_KEEP fields stay as they are (resident, VFM_API_SET_CONFIG).
+   Returns VFM_API_CFG_OK or a VFM_API_CFG_ERR_... code, nothing is changed on errors */
+u16 vfm_cfgSet(const vfm_ApiConfig _far *config);
+/* Lays out the DMA table and buffers for g_vfm_sampsPerBuf x g_vfm_numBufs at g_vfm_fmDmaTable (resident) */
+void vfm_cfgBuildDmaTable(void);
+
+/* Sends <config> to the resident TSR and prints the settings it uses, only prints them if everything is VFM_API_KEEP */
+bool vfm_cfgChange(vfm_ApiConfig *config);
+
+#endif
@@ -12,7 +12,14 @@ IFNDEF DEBUG
 
     .model small, c
     .586p
-    .stack 300h
+    ; Not kept when resident, so this doesn't cost memory (the capture dump needs the room)
+    .stack 400h
+
+; The stack is the last thing in the program image, so this marks its end (see vfm_loadShrinkMemory)
+STACK SEGMENT PARA STACK 'STACK'
+PUBLIC vfm_imageEnd
+vfm_imageEnd LABEL BYTE
+STACK ENDS
 
     .code
 
@@ -50,94 +57,6 @@ _dos_keep       proc C _rc:WORD, _size: WORD
     int     21h             ; DOS - DOS 2+ - TERMINATE BUT STAY RESIDENT
 _dos_keep      endp         ; AL = exit code, DX = program size, in paragraphs
 
-; Signed Long Multiplication
-; dx:ax = _a * _b
-_aNlmul         proc C a:DWORD, b:DWORD
-    mov     eax, a          ; Load first operand into EAX
-    mul     b               ; Multiply: (EDX:EAX) = EAX * B
-    mov     edx, eax
-    shr     edx, 16
-    and     eax, 0ffffh
-    ret                     ; Return (DX:AX layout)
-_aNlmul         endp
-
-; Unsigned Long Multiplication
-; dx:ax = _a * _b
-_aNulmul        proc C a:DWORD, b:DWORD
-    mov     eax, a          ; Load first operand into EAX
-    mul     b               ; Multiply: (EDX:EAX) = EAX * B
-    mov     edx, eax
-    shr     edx, 16
-    and     eax, 0ffffh
-    ret                     ; Return (DX:AX layout)
-_aNulmul endp
-
-; Signed Long Shift Left
-; dx:ax <<= cl
-_aNlshl         proc near
-    shl     edx, 16
-    mov     dx, ax
-    sal     edx, cl
-    mov     ax, dx
-    shr     edx, 16
-    ret
-_aNlshl         endp
-
-; Unsigned Long Shift Right
-; dx:ax >>= cl
-_aNulshr        proc near
-    shl     edx, 16
-    mov     dx, ax
-    shr     edx, cl
-    mov     ax, dx
-    shr     edx, 16
-    ret
-_aNulshr        endp
-
-; Unsigned Long Division
-; uint32_t aNuldiv(uint32_t _a, uint32_t b)
-; dx:ax = _a / _b
-_aNuldiv        proc C _a:DWORD, _b:DWORD
-    push    ebx
-    mov     eax, _a
-    mov     ebx, _b
-    xor     edx, edx
-
-    ; Perform 32-bit division: EDX:EAX / EBX
-    div     ebx
-    ; EAX = quotient, EDX = remainder
-
-    ; Return the result in DX:AX
-    mov     edx, eax
-    shr     edx, 16     ; High word
-    and     eax, 0ffffh ; Low word
-    
-    pop     ebx
-    ret
-_aNuldiv       endp
-
-; Unsigned Long Remainder
-; uint32_t aNulrem(uint32_t _a, uint32_t b)
-; dx:ax = remainder of _a / _b
-_aNulrem       proc C _a:DWORD, _b:DWORD
-    push    ebx 
-    mov     eax, _a
-    mov     ebx, _b
-    xor     edx, edx
-
-    ; Perform 32-bit division: EDX:EAX / EBX
-    div     ebx
-    ; EAX = quotient, EDX = remainder
-
-    ; Return the remainder in DX:AX
-    mov     eax, edx
-    shr     edx, 16     ; High word
-    and     eax, 0ffffh ; Low word
-    
-    pop     ebx
-    ret
-_aNulrem       endp
-
 ; Yeah i don't understand this sh*t so this is just the original code disassembled...
 ; int __cdecl memcmp(const void *, const void *, size_t)
 _fmemcmp       proc far C _ptr1: DWORD, _ptr2: DWORD, _size:WORD
@@ -211,7 +130,7 @@ kbhit           endp
 
     .data
 
-str_CmdLine db 32 dup (0)                   ; temporary storage for the command line arguments
+str_CmdLine db 128 dup (0)                  ; temporary storage for the command line arguments
 str_TooLong db 'Command Line too long!$'    ; Error message for command line length
     .code
 
@@ -249,7 +168,7 @@ _whiteSpaceEnd:
     or      cx, cx
     jz      _noArgs
 
-    cmp     cx, 31
+    cmp     cx, 127
     jle     _lenOK
 
     mov     ah, 09h
@@ -0,0 +1,404 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * OPL Core Interface - Both emulation cores behind one API, selected at load time
+ */
+
+#include "vfm_core.h"
+#include "vfm_tsr.h"
+#include "vfm_cap.h"
+#include "vfm_trc.h"
+#include "vfm_adp.h"
+
+#include "dbopl/dbopl.h"
+#include "nukedopl/opl3.h"
+
+#define STEREO 2
+
+typedef struct {
+    const char *name;
+    void (*init)        (u32 rate);
+    void (*writeReg)    (u16 reg, u8 val);
+    void (*generate)    (i16 *out, u16 samples);
+    bool (*isSilent)    (void);
+    void (*setRate)     (u32 rate);
+    void (*setQuality)  (bool blockLfo, bool blockEnvelope);
+    void (*setVoiceLimit)(u8 voices);
+    u8   tiers;                             /* Adaptive quality tiers it supports, bit per vfm_AdaptTier */
+} vfm_CoreFuncs;
+
+/* Only one core runs at a time, so they share the chip state.
+   DGROUP only aligns it to a WORD, DBOPL is moved up to the next DWORD within it (see s_dbopl) */
+typedef union {
+    u8                              dbopl[sizeof(Chip) + 3];
+    opl3_chip                       nuked;
+} vfm_OplChip;
+
+vfm_OplChip                         g_vfm_oplChip;
+vfm_AdaptState                      g_vfm_adapt;
+
+static Chip                        *s_dbopl     = (Chip *) g_vfm_oplChip.dbopl; /* DWORD aligned DBOPL chip, set by vfm_coreDboplInit */
+
+#if CPU_LEVEL >= 6
+static i32                          s_mixBuf32[SAMPS_PER_BUF * STEREO];     /* Unclipped Nuked output, saturated with MMX */
+#endif
+
+/* Definitions from vfm_icmn.asm */
+extern vfm_OplQueueEntry            g_OPL_RegQueue[];                       /* Register writes queued by the NMI handler */
+extern u16                          g_OPL_RegCount;                         /* Amount of queued register writes */
+
+/* Definitions from vfm_tsr.c */
+extern u16                          g_vfm_sampsPerBuf;                      /* Samples per DMA buffer in use */
+
+/* DOSBox OPL core */
+
+static void vfm_coreDboplInit(u32 rate) {
+    /* The hot fields of Chip, Channel and Operator are DWORDs, keep them aligned */
+    s_dbopl = (Chip *) (((u16) g_vfm_oplChip.dbopl + 3) & ~3);
+
+    Chip_Reset(s_dbopl, true, rate);
+
+#if CPU_LEVEL >= 6
+    s_dbopl->mixHandler  = (Chip_MixHandler) vfm_mmxMixChannel;
+    s_dbopl->packHandler = (Chip_PackHandler) vfm_mmxPack32;
+#elif CPU_LEVEL >= 5
+    s_dbopl->mixHandler  = (Chip_MixHandler) vfm_p5MixChannel;
+    s_dbopl->packHandler = (Chip_PackHandler) vfm_pack32;
+#else
+    s_dbopl->packHandler = (Chip_PackHandler) vfm_pack32;
+#endif
+}
+
+static void vfm_coreDboplWriteReg(u16 reg, u8 val) {
+    Chip_WriteReg(s_dbopl, reg, val);
+}
+
+static void vfm_coreDboplGenerate(i16 *out, u16 samples) {
+    Chip_Generate(s_dbopl, out, samples);
+}
+
+static void vfm_coreDboplSetRate(u32 rate) {
+    Chip_SetRate(s_dbopl, rate);
+}
+
+static void vfm_coreDboplSetQuality(bool blockLfo, bool blockEnvelope) {
+    Chip_SetQuality(s_dbopl, blockLfo, blockEnvelope);
+}
+
+static void vfm_coreDboplSetVoiceLimit(u8 voices) {
+    Chip_SetVoiceLimit(s_dbopl, voices);
+}
+
+static bool vfm_coreDboplIsSilent(void) {
+    const Channel *ch = s_dbopl->chan;
+    u16 i;
+
+    for (i = 0; i < 18; i++, ch++) {
+        if (ch->op[0].state != OFF || ch->op[1].state != OFF) return false;
+    }
+
+    return true;
+}
+
+/* Nuked-OPL3 core */
+
+static void vfm_coreNukedInit(u32 rate) {
+    OPL3_Reset(&g_vfm_oplChip.nuked, rate);
+}
+
+static void vfm_coreNukedWriteReg(u16 reg, u8 val) {
+    OPL3_WriteReg(&g_vfm_oplChip.nuked, reg, val);
+}
+
+static void vfm_coreNukedGenerate(i16 *out, u16 samples) {
+#if CPU_LEVEL >= 6
+    /* Render unclipped and saturate in one go with MMX */
+    while (samples) {
+        u16 chunk = samples > SAMPS_PER_BUF ? SAMPS_PER_BUF : samples;
+        i32 *mix = s_mixBuf32;
+        u16 i;
+
+        for (i = 0; i < chunk; i++) {
+            OPL3_Generate2ChResampled32(&g_vfm_oplChip.nuked, mix);
+            mix += STEREO;
+        }
+
+        vfm_mmxPack32(out, s_mixBuf32, chunk * STEREO);
+
+        out     += chunk * STEREO;
+        samples -= chunk;
+    }
+#else
+    while (samples) {
+        OPL3_Generate2ChResampled(&g_vfm_oplChip.nuked, out);
+        out += STEREO;
+        samples--;
+    }
+#endif
+}
+
+static void vfm_coreNukedSetRate(u32 rate) {
+    OPL3_SetRate(&g_vfm_oplChip.nuked, rate);
+}
+
+/* Nuked-OPL3 has nothing to skip between samples, it only has the half rate tier */
+static void vfm_coreNukedSetQuality(bool blockLfo, bool blockEnvelope) {
+    (void) blockLfo;
+    (void) blockEnvelope;
+}
+
+/* Nuked-OPL3 runs all channels through one pipeline per OPL sample, there are no voices to drop */
+static void vfm_coreNukedSetVoiceLimit(u8 voices) {
+    (void) voices;
+}
+
+static bool vfm_coreNukedIsSilent(void) {
+    const opl3_slot *slot = g_vfm_oplChip.nuked.slot;
+    u16 i;
+
+    for (i = 0; i < 36; i++, slot++) {
+        if (slot->eg_rout != 0x1ff) return false;
+    }
+
+    return true;
+}
+
+#define TIER(t) (1 << (t))
+
+static const vfm_CoreFuncs s_cores[VFM_CORE_COUNT] = {
+    { "DBOPL",      vfm_coreDboplInit, vfm_coreDboplWriteReg, vfm_coreDboplGenerate, vfm_coreDboplIsSilent,
+                    vfm_coreDboplSetRate, vfm_coreDboplSetQuality, vfm_coreDboplSetVoiceLimit,
+                    TIER(VFM_TIER_FULL) | TIER(VFM_TIER_BLOCK_LFO) | TIER(VFM_TIER_BLOCK_ENV) | TIER(VFM_TIER_HALF_RATE) },
+    { "Nuked-OPL3", vfm_coreNukedInit, vfm_coreNukedWriteReg, vfm_coreNukedGenerate, vfm_coreNukedIsSilent,
+                    vfm_coreNukedSetRate, vfm_coreNukedSetQuality, vfm_coreNukedSetVoiceLimit,
+                    TIER(VFM_TIER_FULL) | TIER(VFM_TIER_HALF_RATE) },
+};
+
+static vfm_CoreType                 s_coreType  = VFM_CORE_DEFAULT;
+static const vfm_CoreFuncs         *s_core      = &s_cores[VFM_CORE_DEFAULT];
+static u32                          s_rate      = 0;                        /* DMA sample rate */
+static u16                          s_rateShift = 0;                        /* 1 = core runs at half the DMA rate */
+static i16                          s_upLast[STEREO];                       /* Last sample of the previous half rate block */
+static u8                           s_voiceLimit = 0;                       /* Most voices rendered at once, 0 = all */
+static u8                           s_dropped   = 0;                        /* Cores whose code wasn't kept, bit per vfm_CoreType */
+
+void vfm_coreInit(vfm_CoreType type, u32 rate, bool halfRate) {
+    if (type >= VFM_CORE_COUNT) type = VFM_CORE_DEFAULT;
+
+    s_coreType  = type;
+    s_core      = &s_cores[type];
+    s_rate      = rate;
+    s_rateShift = halfRate ? 1 : 0;
+    s_upLast[0] = 0;
+    s_upLast[1] = 0;
+    s_core->init(rate >> s_rateShift);
+    s_core->setVoiceLimit(s_voiceLimit);
+
+    g_vfm_adapt.tiers       = s_core->tiers;
+    g_vfm_adapt.baseTier    = halfRate ? VFM_TIER_HALF_RATE : VFM_TIER_FULL;
+    g_vfm_adapt.tier        = g_vfm_adapt.baseTier;
+    g_vfm_adapt.calm        = 0;
+}
+
+void vfm_coreSetVoiceLimit(u8 voices) {
+    s_voiceLimit = voices;
+    s_core->setVoiceLimit(voices);
+}
+
+u8 vfm_coreGetVoiceLimit(void) {
+    return s_voiceLimit;
+}
+
+u32 vfm_coreGetRate(void) {
+    return s_rate;
+}
+
+vfm_CoreType vfm_coreGetType(void) {
+    return s_coreType;
+}
+
+void vfm_coreDrop(vfm_CoreType type) {
+    s_dropped |= (u8) (1 << type);
+}
+
+bool vfm_coreIsAvailable(vfm_CoreType type) {
+    return type < VFM_CORE_COUNT && !(s_dropped & (1 << type));
+}
+
+const char *vfm_coreGetName(vfm_CoreType type) {
+    if (type >= VFM_CORE_COUNT) return "?";
+    return s_cores[type].name;
+}
+
+void vfm_coreWriteReg(u16 reg, u8 val) {
+    s_core->writeReg(reg, val);
+}
+
+void vfm_coreGenerate(i16 *out, u16 samples) {
+    s_core->generate(out, samples);
+}
+
+bool vfm_coreIsSilent(void) {
+    return s_core->isSilent();
+}
+
+/* Checks whether <tier> can be used with the selected core and buffer size */
+static bool vfm_coreHasTier(u8 tier) {
+    if (!(g_vfm_adapt.tiers & TIER(tier))) return false;
+
+    /* Half rate renders half of the samples, so there have to be an even number of them */
+    return tier < VFM_TIER_HALF_RATE || !(g_vfm_sampsPerBuf & 1);
+}
+
+/* Switches the selected core to <tier>, phases and envelopes carry on */
+static void vfm_coreSetTier(u8 tier) {
+    u16 rateShift = tier >= VFM_TIER_HALF_RATE ? 1 : 0;
+
+    if (rateShift != s_rateShift) {
+        s_rateShift = rateShift;
+        s_core->setRate(s_rate >> rateShift);
+    }
+
+    s_core->setQuality(tier >= VFM_TIER_BLOCK_LFO, tier >= VFM_TIER_BLOCK_ENV);
+    g_vfm_adapt.tier = (u8) tier;
+}
+
+void vfm_coreSetHalfRate(bool halfRate) {
+    g_vfm_adapt.baseTier    = halfRate ? VFM_TIER_HALF_RATE : VFM_TIER_FULL;
+    g_vfm_adapt.calm        = 0;
+    vfm_coreSetTier(g_vfm_adapt.baseTier);
+}
+
+void vfm_adaptSetBudget(u16 percent, u16 sampsPerBuf, u16 rate) {
+    vfm_AdaptState *adapt = &g_vfm_adapt;
+    u32 hz = adapt->timeHz;
+
+    /* Split up so the multiplications can't overflow */
+    adapt->period       = (hz / rate) * sampsPerBuf + (hz % rate) * sampsPerBuf / rate;
+    adapt->budget       = (adapt->period / 100UL) * percent + (adapt->period % 100UL) * percent / 100UL;
+    adapt->calm         = 0;
+    adapt->calmBlocks   = rate / sampsPerBuf;
+    adapt->percent      = percent;
+}
+
+/* Steps down a tier when a block took longer than the budget, back up after enough blocks within half of it */
+static void vfm_adaptUpdate(u32 time) {
+    vfm_AdaptState *adapt = &g_vfm_adapt;
+    u8 tier;
+
+    adapt->last = time;
+    if (time > adapt->worst) adapt->worst = time;
+
+    if (time > adapt->budget) {
+        adapt->calm = 0;
+
+        for (tier = adapt->tier + 1; tier < VFM_TIER_COUNT; tier++) {
+            if (vfm_coreHasTier(tier)) {
+                vfm_coreSetTier(tier);
+                adapt->stepsDown++;
+                break;
+            }
+        }
+        return;
+    }
+
+    if (adapt->tier <= adapt->baseTier || time > (adapt->budget >> 1)) {
+        adapt->calm = 0;
+        return;
+    }
+
+    if (++adapt->calm < adapt->calmBlocks) return;
+
+    adapt->calm = 0;
+
+    for (tier = adapt->tier; tier-- > adapt->baseTier; ) {
+        if (vfm_coreHasTier(tier)) {
+            vfm_coreSetTier(tier);
+            adapt->stepsUp++;
+            break;
+        }
+    }
+}
+
+void vfm_renderBlock(i16 *out) {
+    u16 samples = g_vfm_sampsPerBuf >> s_rateShift;
+    u16 count = g_OPL_RegCount;
+    u16 queueDepth = count;
+    const vfm_OplQueueEntry *entry = g_OPL_RegQueue;
+    i16 *block = out;
+    u32 start = 0;
+    u16 applied;
+    u16 i;
+
+    if (g_vfm_adapt.enabled || g_vfm_capture[VFM_CAP_OUTPUT].active) {
+        start = vfm_isrTimestamp();
+    }
+
+    /* At half rate the core renders into the second half of the block, which is upsampled in place */
+    out += (g_vfm_sampsPerBuf - samples) * STEREO;
+
+    /* So we don't miss any note-on events we must generate one sample per write */
+    while (count && samples) {
+        s_core->writeReg(entry->bankedIndex, entry->data);
+        s_core->generate(out, 1);
+
+        out += STEREO;
+        entry++;
+        count--;
+        samples--;
+    }
+
+    applied = queueDepth - count;
+
+    VFM_TRACE_EVENT(VFM_TRC_WRITES, applied);
+
+    if (g_vfm_capture[VFM_CAP_REGS].active) {
+        vfm_capRecordBlock(g_OPL_RegQueue, applied);
+    }
+
+    /* Move the writes that didn't fit into this block to the start of the queue */
+    for (i = 0; i < count; i++) {
+        g_OPL_RegQueue[i] = entry[i];
+    }
+
+    g_OPL_RegCount = count;
+
+    /* Generate the rest of the block */
+    VFM_TRACE_EVENT(VFM_TRC_GEN_START, samples);
+
+    if (samples) {
+        s_core->generate(out, samples);
+    }
+
+    if (s_rateShift) {
+        vfm_upsample2x(block, g_vfm_sampsPerBuf >> 1, s_upLast);
+    } else {
+        /* Lets the upsampler carry on smoothly if the adaptive quality goes down to half rate */
+        s_upLast[0] = block[(g_vfm_sampsPerBuf - 1) * STEREO + 0];
+        s_upLast[1] = block[(g_vfm_sampsPerBuf - 1) * STEREO + 1];
+    }
+
+    VFM_TRACE_EVENT(VFM_TRC_GEN_END, 0);
+
+    if (g_vfm_adapt.enabled) {
+        u32 elapsed = vfm_isrTimestamp() - start;
+
+#if CPU_LEVEL < 5
+        /* BIOS tick : PIT count, the tick may not have been counted yet with interrupts off */
+        elapsed &= 0xFFFFUL;
+#endif
+        vfm_adaptUpdate(elapsed);
+    }
+
+    if (g_vfm_capture[VFM_CAP_OUTPUT].active) {
+        vfm_capRecordOutput(block, start, queueDepth ? g_OPL_TrapTime : 0, queueDepth, applied);
+    } else if (g_vfm_capture[VFM_CAP_OUTPUT].handle != 0) {
+        /* Paused while a dump reads XMS, the blocks it missed show up as a gap in the block numbers */
+        g_vfm_capture[VFM_CAP_OUTPUT].blocks++;
+    }
+
+    vfm_capFlush();
+}
@@ -0,0 +1,55 @@
+#ifndef _VFM_CORE_H_
+#define _VFM_CORE_H_
+
+#include "types.h"
+
+/* OPL emulation cores that can be selected at load time */
+typedef enum {
+    VFM_CORE_DBOPL = 0,
+    VFM_CORE_NUKED,
+    VFM_CORE_COUNT
+} vfm_CoreType;
+
+/* Core used when nothing is given on the command line (NUKED=1 in the makefile changes this) */
+#ifndef VFM_CORE_DEFAULT
+#define VFM_CORE_DEFAULT VFM_CORE_DBOPL
+#endif
+
+/* Register write as queued by the NMI handler, 4 bytes so it is written in one go */
+#pragma pack(1)
+typedef struct {
+    u16 bankedIndex;                        /* Register index, bit 8 set = bank B */
+    u8  reserved;
+    u8  data;
+} vfm_OplQueueEntry;
+#pragma pack()
+
+/* Selects and resets an OPL core for <rate>, or half of it upsampled to <rate> by vfm_renderBlock */
+void vfm_coreInit(vfm_CoreType type, u32 rate, bool halfRate);
+/* Limits the voices the core renders at once (DBOPL only), the quietest ones are dropped. 0 = no limit, kept across vfm_coreInit */
+void vfm_coreSetVoiceLimit(u8 voices);
+/* Gets the voice limit set with vfm_coreSetVoiceLimit */
+u8 vfm_coreGetVoiceLimit(void);
+/* Switches between full and half rate synthesis without a reset, back to the best adaptive quality tier */
+void vfm_coreSetHalfRate(bool halfRate);
+/* Gets the DMA sample rate given to vfm_coreInit */
+u32 vfm_coreGetRate(void);
+/* Gets the selected core */
+vfm_CoreType vfm_coreGetType(void);
+/* Marks <type> as not resident, it can't be selected with vfm_coreInit anymore */
+void vfm_coreDrop(vfm_CoreType type);
+/* Checks whether <type> can be selected (its code was kept when going resident) */
+bool vfm_coreIsAvailable(vfm_CoreType type);
+/* Gets the display name of a core */
+const char *vfm_coreGetName(vfm_CoreType type);
+/* Writes a register to the selected core, bit 8 set = bank B */
+void vfm_coreWriteReg(u16 reg, u8 val);
+/* Renders <samples> 16-bit stereo samples with the selected core */
+void vfm_coreGenerate(i16 *out, u16 samples);
+/* Checks whether all operators of the selected core are silent */
+bool vfm_coreIsSilent(void);
+
+/* Called by the DMA ISR: applies the queued register writes and renders one DMA block */
+void vfm_renderBlock(i16 *out);
+
+#endif
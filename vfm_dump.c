@@ -0,0 +1,1058 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * OPL register capture, event trace, adaptive quality and settings - Load time setup and the dump/query/set commands (not resident)
+ *
+ * DBGREG: 3-byte records (u16 register, bit 8 set = bank B, u8 value) with 0xFFFF/0xFF after every
+ *         512 samples at 24 kHz, the writes of a block are applied one sample after another from its start.
+ *         Same as teraterm.log, so captures can be replayed with the 'o' benchmark of DBG_BENCH builds.
+ * DRO:    DOSBox Raw OPL v2.0, with millisecond delays
+ * WAV:    Output capture, 16-bit stereo. The CSV file next to it has the block index, DMA interrupt
+ *         timestamp, timestamp of the first queued write, queue depth and applied writes of every block
+ * Trace:  vfm_TraceFileHeader and the events, oldest first (see vfm_trc.h)
+ */
+
+#include "vfm_cap.h"
+#include "vfm_api.h"
+#include "vfm_tsr.h"
+#include "vfm_trc.h"
+#include "vfm_adp.h"
+#include "vfm_cfg.h"
+
+#define VFM_DUMP_CHUNK          32          /* Entries read from XMS at once */
+#define VFM_DUMP_OUT_SIZE       128         /* Output buffer size */
+#define VFM_DBGREG_BLOCK        512         /* Samples per block in the DBGREG format */
+#define VFM_DRO_MAX_CODES       126         /* Register codes in a DRO file, the delay codes come after them */
+#define VFM_CAP_TIME_TICKS      2           /* BIOS ticks to measure the TSC frequency over */
+#define VFM_PIT_HZ              1193182UL   /* PIT input clock */
+#define VFM_CAP_FLUSH_TICKS     4           /* BIOS ticks to wait for the DMA ISR to empty the stages */
+#define VFM_XMS_MAX_HOOKS       16          /* Far jumps of earlier XMS hooks followed at most */
+#define STEREO 2
+
+typedef void (*vfm_CapWriteFunc)(void *ctx, u32 time, const vfm_OplQueueEntry *entry);
+
+/* From vfm_isr.asm, in the code segment */
+extern void _far                    vfm_xmsHook(void);
+extern void _far * _far             g_XMS_OldEntry;
+
+static u8 _far                     *s_xmsPatch = NULL;     /* XMS entry point that jumps to vfm_xmsHook */
+static u8                           s_xmsPatchOrig[5];     /* What was there before */
+
+/* Buffered output file */
+typedef struct {
+    u16 handle;
+    u16 used;
+    bool ok;
+    u8  buf[VFM_DUMP_OUT_SIZE];
+} vfm_DumpFile;
+
+typedef struct {
+    vfm_DumpFile   *file;
+    u32             nextBlock;              /* Time the current block ends at */
+} vfm_DbgRegWriter;
+
+typedef struct {
+    vfm_DumpFile   *file;
+    u16             rate;
+    u32             lastTime;               /* Time of the last write in samples */
+    u32             frac;                   /* Remainder of the sample to millisecond conversion */
+    u32             pairs;
+    u32             ms;
+    bool            opl3;
+    bool            overflow;
+    u8              codemapLength;
+    u8              codemap[VFM_DRO_MAX_CODES];
+} vfm_DroWriter;
+
+/* Measures the frequency of the timestamps returned by <timestamp> */
+static u32 vfm_dumpMeasureHz(u32 (*timestamp)(void)) {
+    volatile u32 _far *biosTicks = (volatile u32 _far *) 0x0040006CUL;
+    u32 start;
+    u32 delta;
+
+    start = *biosTicks;
+    while (*biosTicks == start) {}
+    start = *biosTicks;
+
+    delta = timestamp();
+    while (*biosTicks - start < VFM_CAP_TIME_TICKS) {}
+    delta = timestamp() - delta;
+
+    /* Ticks are 65536 / 1193182 s, split so the multiplication can't overflow */
+    return (delta / 4096UL) * 37287UL + (delta % 4096UL) * 37287UL / 4096UL;
+}
+
+bool vfm_capSetup(u16 index, u16 kb, u16 sampsPerBuf, u16 rate) {
+    vfm_CaptureState *cap = &g_vfm_capture[index];
+    void _far *xms = vfm_tsrGetXmsEntry();
+    u16 recordSize = sizeof(vfm_OplQueueEntry);
+    u16 handle = 0;
+    u16 ok = 0;
+
+    if (xms == NULL) return false;
+
+    _asm {
+        mov ah, 0x09
+        mov dx, kb
+        call dword ptr [xms]
+        mov ok, ax
+        mov handle, dx
+    }
+
+    if (ok != 1) return false;
+
+    if (index == VFM_CAP_OUTPUT) {
+        recordSize = sizeof(vfm_CapBlockHeader) + sampsPerBuf * STEREO * sizeof(i16);
+    }
+
+    cap->xmsEntry       = xms;
+    cap->size           = ((u32) kb * 1024UL / recordSize) * recordSize;
+    cap->pos            = 0;
+    cap->blocks         = 0;
+    cap->handle         = handle;
+    cap->recordSize     = recordSize;
+    cap->sampsPerBuf    = sampsPerBuf;
+    cap->rate           = rate;
+    cap->wrapped        = 0;
+    cap->lost           = 0;
+    cap->stageHead      = 0;
+    cap->stageUsed      = 0;
+    cap->timeHz         = 0;
+
+    /* Same timestamps as the adaptive quality, the first queued write of every block gets one too */
+    if (index == VFM_CAP_OUTPUT) {
+        cap->timeHz         = vfm_adaptMeasureHz();
+        g_OPL_StampTraps    = 1;
+    }
+
+    cap->active         = 1;
+    return true;
+}
+
+/*  XMS drivers start their entry point with a short jump over three NOPs, so it can be hooked by
+    putting a far jump there. Earlier hooks have done the same, their far jumps are followed to the
+    entry point at the end of the chain, whose short jump then goes on to the driver */
+bool vfm_capHookXms(void) {
+    u8 _far *entry = (u8 _far *) vfm_tsrGetXmsEntry();
+    u16 i;
+
+    if (s_xmsPatch != NULL) return true;
+    if (entry == NULL) return false;
+
+    for (i = 0; i < VFM_XMS_MAX_HOOKS && entry[0] == 0xEA; i++) {
+        entry = *((u8 _far * _far *) (entry + 1));
+    }
+
+    if (entry[0] != 0xEB || entry[2] != 0x90 || entry[3] != 0x90 || entry[4] != 0x90) return false;
+
+    for (i = 0; i < sizeof(s_xmsPatchOrig); i++) {
+        s_xmsPatchOrig[i] = entry[i];
+    }
+
+    g_XMS_OldEntry = (void _far *) (entry + 2 + (signed char) entry[1]);
+    s_xmsPatch = entry;
+
+    _asm cli
+    *((void _far * _far *) (entry + 1)) = (void _far *) vfm_xmsHook;
+    entry[0] = 0xEA;
+    _asm sti
+
+    return true;
+}
+
+void vfm_capMoveXmsHook(u16 codeSeg) {
+    if (s_xmsPatch == NULL) return;
+
+    *((u16 _far *) (s_xmsPatch + 3)) = codeSeg;
+}
+
+/* Puts back the XMS entry point, only before going resident, so nothing can have hooked it after us */
+static void vfm_capUnhookXms(void) {
+    u16 i;
+
+    if (s_xmsPatch == NULL) return;
+
+    _asm cli
+    for (i = 0; i < sizeof(s_xmsPatchOrig); i++) {
+        s_xmsPatch[i] = s_xmsPatchOrig[i];
+    }
+    _asm sti
+
+    s_xmsPatch = NULL;
+}
+
+void vfm_capFree(void) {
+    u16 i;
+
+    g_OPL_StampTraps = 0;
+
+    for (i = 0; i < VFM_CAP_COUNT; i++) {
+        void _far *xms = g_vfm_capture[i].xmsEntry;
+        u16 handle = g_vfm_capture[i].handle;
+
+        g_vfm_capture[i].active = 0;
+
+        if (handle == 0) continue;
+
+        _asm {
+            mov ah, 0x0A
+            mov dx, handle
+            call dword ptr [xms]
+        }
+
+        g_vfm_capture[i].handle = 0;
+    }
+
+    vfm_capUnhookXms();
+}
+
+/* Gets the capture state of the resident TSR, NULL if it isn't loaded */
+static vfm_CaptureState _far *vfm_capGetResident() {
+    vfm_CaptureState _far *state = NULL;
+
+    _asm {
+        push es
+        push bx
+        xor bx, bx
+        mov es, bx
+        mov ah, VFM_API_MPX_ID
+        mov al, VFM_API_GET_CAPTURE
+        int 0x2F
+        mov word ptr state, bx
+        mov word ptr state + 2, es
+        pop bx
+        pop es
+    }
+
+    return state;
+}
+
+/* Reads <bytes> (even) from <offset> in the ring buffer */
+static bool vfm_capXmsRead(const vfm_CaptureState *cap, void *dst, u32 offset, u16 bytes) {
+    vfm_XmsMove move;
+    void _far *xms = cap->xmsEntry;
+    void *movePtr = &move;
+    u16 ok;
+
+    move.length     = bytes;
+    move.srcHandle  = cap->handle;
+    move.srcOffset  = offset;
+    move.dstHandle  = 0;
+    move.dstOffset  = (u32) (void _far *) dst;
+
+    _asm {
+        push si
+        mov si, movePtr
+        mov ah, 0x0B
+        call dword ptr [xms]
+        mov ok, ax
+        pop si
+    }
+
+    return ok == 1;
+}
+
+/*  Calls <func> for every captured write with its time in samples and stores the total captured time.
+    After a wrap around, the writes before the first complete block are skipped */
+static bool vfm_capWalk(const vfm_CaptureState *cap, vfm_CapWriteFunc func, void *ctx, u32 *total) {
+    vfm_OplQueueEntry buf[VFM_DUMP_CHUNK];
+    u32 offset      = cap->wrapped ? cap->pos  : 0;
+    u32 left        = cap->wrapped ? cap->size : cap->pos;
+    bool synced     = !cap->wrapped;
+    u32 blockStart  = 0;
+    u16 inBlock     = 0;
+
+    while (left) {
+        u16 chunk = left > sizeof(buf) ? sizeof(buf) : (u16) left;
+        u16 i;
+
+        if ((u32) chunk > cap->size - offset) chunk = (u16) (cap->size - offset);
+
+        if (!vfm_capXmsRead(cap, buf, offset, chunk)) return false;
+
+        offset += chunk;
+        if (offset >= cap->size) offset = 0;
+        left -= chunk;
+
+        for (i = 0; i < chunk / sizeof(vfm_OplQueueEntry); i++) {
+            if (buf[i].bankedIndex == VFM_CAP_BLOCK_END) {
+                if (synced) blockStart += cap->sampsPerBuf;
+                synced  = true;
+                inBlock = 0;
+            } else if (synced) {
+                func(ctx, blockStart + inBlock, &buf[i]);
+                inBlock++;
+            }
+        }
+    }
+
+    *total = blockStart;
+    return true;
+}
+
+/* DOS file functions, the TSR isn't linked with the C library */
+
+static bool vfm_dumpCreate(vfm_DumpFile *file, const char *filename) {
+    u16 handle = 0;
+    u8 failed = 0;
+
+    _asm {
+        mov ah, 0x3C
+        xor cx, cx
+        mov dx, filename
+        int 0x21
+        mov handle, ax
+        jnc _created
+        mov failed, 1
+    _created:
+    }
+
+    file->handle    = handle;
+    file->used      = 0;
+    file->ok        = !failed;
+    return file->ok;
+}
+
+static void vfm_dumpFlush(vfm_DumpFile *file) {
+    u16 handle = file->handle;
+    u16 bytes = file->used;
+    u8 *data = file->buf;
+    u16 written = 0;
+    u8 failed = 0;
+
+    if (bytes == 0) return;
+
+    _asm {
+        mov ah, 0x40
+        mov bx, handle
+        mov cx, bytes
+        mov dx, data
+        int 0x21
+        mov written, ax
+        jnc _written
+        mov failed, 1
+    _written:
+    }
+
+    if (failed || written != bytes) file->ok = false;
+    file->used = 0;
+}
+
+static void vfm_dumpPut(vfm_DumpFile *file, const void *data, u16 bytes) {
+    const u8 *src = (const u8 *) data;
+
+    while (bytes--) {
+        if (file->used == sizeof(file->buf)) vfm_dumpFlush(file);
+        file->buf[file->used++] = *src++;
+    }
+}
+
+/* Flushes and moves the file pointer to <offset> */
+static void vfm_dumpSeek(vfm_DumpFile *file, u32 offset) {
+    u16 handle = file->handle;
+    u16 offHigh = (u16) (offset >> 16);
+    u16 offLow = (u16) offset;
+    u8 failed = 0;
+
+    vfm_dumpFlush(file);
+
+    _asm {
+        mov ax, 0x4200
+        mov bx, handle
+        mov cx, offHigh
+        mov dx, offLow
+        int 0x21
+        jnc _seeked
+        mov failed, 1
+    _seeked:
+    }
+
+    if (failed) file->ok = false;
+}
+
+static bool vfm_dumpClose(vfm_DumpFile *file) {
+    u16 handle = file->handle;
+
+    vfm_dumpFlush(file);
+
+    _asm {
+        mov ah, 0x3E
+        mov bx, handle
+        int 0x21
+    }
+
+    return file->ok;
+}
+
+/* DBGREG */
+
+static void vfm_dbgRegBlockEnd(vfm_DbgRegWriter *w) {
+    static const u8 blockEnd[3] = { 0xFF, 0xFF, 0xFF };
+
+    vfm_dumpPut(w->file, blockEnd, sizeof(blockEnd));
+    w->nextBlock += VFM_DBGREG_BLOCK;
+}
+
+static void vfm_dbgRegWrite(void *ctx, u32 time, const vfm_OplQueueEntry *entry) {
+    vfm_DbgRegWriter *w = (vfm_DbgRegWriter *) ctx;
+    u8 record[3];
+
+    while (time >= w->nextBlock) vfm_dbgRegBlockEnd(w);
+
+    record[0] = (u8) entry->bankedIndex;
+    record[1] = (u8) (entry->bankedIndex >> 8);
+    record[2] = entry->data;
+    vfm_dumpPut(w->file, record, sizeof(record));
+}
+
+static bool vfm_dumpDbgReg(const vfm_CaptureState *cap, vfm_DumpFile *file) {
+    vfm_DbgRegWriter w;
+    u32 total;
+
+    w.file      = file;
+    w.nextBlock = VFM_DBGREG_BLOCK;
+
+    if (!vfm_capWalk(cap, vfm_dbgRegWrite, &w, &total)) return false;
+
+    while (w.nextBlock <= total) vfm_dbgRegBlockEnd(&w);
+    return true;
+}
+
+/* DRO */
+
+/* Gets the code of a register in the codemap, VFM_DRO_MAX_CODES if it isn't in there */
+static u8 vfm_droFindCode(const vfm_DroWriter *w, u8 reg) {
+    u8 i;
+
+    for (i = 0; i < w->codemapLength; i++) {
+        if (w->codemap[i] == reg) return i;
+    }
+
+    return VFM_DRO_MAX_CODES;
+}
+
+/* First pass, collects the registers used */
+static void vfm_droScan(void *ctx, u32 time, const vfm_OplQueueEntry *entry) {
+    vfm_DroWriter *w = (vfm_DroWriter *) ctx;
+    u8 reg = (u8) entry->bankedIndex;
+
+    (void) time;
+
+    if (entry->bankedIndex & 0x100) w->opl3 = true;
+    if (vfm_droFindCode(w, reg) != VFM_DRO_MAX_CODES) return;
+
+    if (w->codemapLength == VFM_DRO_MAX_CODES) {
+        w->overflow = true;
+        return;
+    }
+
+    w->codemap[w->codemapLength++] = reg;
+}
+
+static void vfm_droPair(vfm_DroWriter *w, u8 code, u8 val) {
+    u8 pair[2];
+
+    pair[0] = code;
+    pair[1] = val;
+    vfm_dumpPut(w->file, pair, sizeof(pair));
+    w->pairs++;
+}
+
+/* Emits the delay up to <time> */
+static void vfm_droDelay(vfm_DroWriter *w, u32 time) {
+    u32 delta = time - w->lastTime;
+    u32 ms;
+
+    /* Split so the multiplication can't overflow */
+    w->frac     += (delta % w->rate) * 1000UL;
+    ms           = (delta / w->rate) * 1000UL + w->frac / w->rate;
+    w->frac     %= w->rate;
+    w->lastTime  = time;
+    w->ms       += ms;
+
+    while (ms > 256) {
+        u32 n = ms >> 8;
+        if (n > 256) n = 256;
+
+        vfm_droPair(w, (u8) (w->codemapLength + 1), (u8) (n - 1));
+        ms -= n << 8;
+    }
+
+    if (ms) {
+        vfm_droPair(w, w->codemapLength, (u8) (ms - 1));
+    }
+}
+
+/* Second pass, writes the register/value pairs */
+static void vfm_droWrite(void *ctx, u32 time, const vfm_OplQueueEntry *entry) {
+    vfm_DroWriter *w = (vfm_DroWriter *) ctx;
+    u8 code = vfm_droFindCode(w, (u8) entry->bankedIndex);
+
+    vfm_droDelay(w, time);
+    vfm_droPair(w, (u8) (code | ((entry->bankedIndex & 0x100) ? 0x80 : 0)), entry->data);
+}
+
+static bool vfm_dumpDro(const vfm_CaptureState *cap, vfm_DumpFile *file) {
+    static const char signature[8] = "DBRAWOPL";
+    vfm_DroWriter w;
+    u32 total;
+    u8 header[12];
+
+    w.file          = file;
+    w.rate          = cap->rate;
+    w.lastTime      = 0;
+    w.frac          = 0;
+    w.pairs         = 0;
+    w.ms            = 0;
+    w.opl3          = false;
+    w.overflow      = false;
+    w.codemapLength = 0;
+
+    if (!vfm_capWalk(cap, vfm_droScan, &w, &total)) return false;
+
+    if (w.overflow) {
+        VFM_PUTS("ERROR: Too many different registers for DRO, use DBGREG\n");
+        return false;
+    }
+
+    /* Version 2.0, lengths are filled in at the end */
+    vfm_dumpPut(file, signature, sizeof(signature));
+    header[0]   = 2;
+    header[1]   = 0;
+    header[2]   = 0;
+    header[3]   = 0;
+    vfm_dumpPut(file, header, 4);
+    vfm_dumpPut(file, &w.pairs, sizeof(w.pairs));
+    vfm_dumpPut(file, &w.ms, sizeof(w.ms));
+
+    header[0]   = w.opl3 ? 2 : 0;               /* Hardware: OPL3 or OPL2 */
+    header[1]   = 0;                            /* Interleaved format */
+    header[2]   = 0;                            /* No compression */
+    header[3]   = w.codemapLength;              /* Short delay code */
+    header[4]   = (u8) (w.codemapLength + 1);   /* Long delay code */
+    header[5]   = w.codemapLength;
+    vfm_dumpPut(file, header, 6);
+    vfm_dumpPut(file, w.codemap, w.codemapLength);
+
+    if (!vfm_capWalk(cap, vfm_droWrite, &w, &total)) return false;
+    vfm_droDelay(&w, total);
+
+    vfm_dumpSeek(file, 12);
+    vfm_dumpPut(file, &w.pairs, sizeof(w.pairs));
+    vfm_dumpPut(file, &w.ms, sizeof(w.ms));
+    return true;
+}
+
+/* WAV */
+
+/* Copies <bytes> from <offset> in the ring buffer to the file, going through its buffer */
+static bool vfm_dumpCopyXms(const vfm_CaptureState *cap, vfm_DumpFile *file, u32 offset, u16 bytes) {
+    while (bytes) {
+        u16 chunk = bytes > sizeof(file->buf) ? sizeof(file->buf) : bytes;
+
+        vfm_dumpFlush(file);
+        if (!vfm_capXmsRead(cap, file->buf, offset, chunk)) return false;
+
+        file->used  = chunk;
+        offset     += chunk;
+        bytes      -= chunk;
+    }
+
+    return true;
+}
+
+static void vfm_dumpPutStr(vfm_DumpFile *file, const char *str) {
+    while (*str) vfm_dumpPut(file, str++, 1);
+}
+
+static void vfm_dumpPutDec(vfm_DumpFile *file, u32 val) {
+    char str[11];
+    char *c = str + sizeof(str) - 1;
+
+    *c = 0;
+
+    do {
+        *--c = (char) ('0' + (u16) (val % 10UL));
+        val /= 10UL;
+    } while (val);
+
+    vfm_dumpPutStr(file, c);
+}
+
+static void vfm_dumpPutU32(vfm_DumpFile *file, u32 val) {
+    vfm_dumpPut(file, &val, sizeof(val));
+}
+
+static void vfm_dumpPutU16(vfm_DumpFile *file, u16 val) {
+    vfm_dumpPut(file, &val, sizeof(val));
+}
+
+static bool vfm_dumpWav(const vfm_CaptureState *cap, vfm_DumpFile *file, const char *filename) {
+    u16 blockBytes  = cap->recordSize - sizeof(vfm_CapBlockHeader);
+    u32 offset      = cap->wrapped ? cap->pos  : 0;
+    u32 records     = (cap->wrapped ? cap->size : cap->pos) / cap->recordSize;
+    u32 dataBytes   = records * blockBytes;
+    bool ok         = true;
+    vfm_DumpFile csv;
+    char csvName[80];
+    u16 len = 0;
+    u16 i;
+
+    /* Timing goes to <name>.csv */
+    for (i = 0; filename[i] != 0 && i < sizeof(csvName) - 5; i++) {
+        csvName[i] = filename[i];
+        if (filename[i] == '.') len = i;
+        if (filename[i] == '\\' || filename[i] == ':') len = 0;
+    }
+
+    if (len == 0) len = i;
+
+    csvName[len + 0] = '.';
+    csvName[len + 1] = 'c';
+    csvName[len + 2] = 's';
+    csvName[len + 3] = 'v';
+    csvName[len + 4] = 0;
+
+    if (!vfm_dumpCreate(&csv, csvName)) return false;
+
+    vfm_dumpPutStr(&csv, "# time_hz=");
+    vfm_dumpPutDec(&csv, cap->timeHz);
+    vfm_dumpPutStr(&csv, " samples_per_block=");
+    vfm_dumpPutDec(&csv, cap->sampsPerBuf);
+    vfm_dumpPutStr(&csv, " rate=");
+    vfm_dumpPutDec(&csv, cap->rate);
+    vfm_dumpPutStr(&csv, "\r\nblock,time,trap_time,queue_depth,writes\r\n");
+
+    vfm_dumpPutStr(file, "RIFF");
+    vfm_dumpPutU32(file, 36UL + dataBytes);
+    vfm_dumpPutStr(file, "WAVEfmt ");
+    vfm_dumpPutU32(file, 16UL);
+    vfm_dumpPutU16(file, 1);                                    /* PCM */
+    vfm_dumpPutU16(file, STEREO);
+    vfm_dumpPutU32(file, cap->rate);
+    vfm_dumpPutU32(file, (u32) cap->rate * STEREO * sizeof(i16));
+    vfm_dumpPutU16(file, STEREO * sizeof(i16));
+    vfm_dumpPutU16(file, 16);
+    vfm_dumpPutStr(file, "data");
+    vfm_dumpPutU32(file, dataBytes);
+
+    while (records--) {
+        vfm_CapBlockHeader header;
+
+        if (!vfm_capXmsRead(cap, &header, offset, sizeof(header))) {
+            ok = false;
+            break;
+        }
+
+        vfm_dumpPutDec(&csv, header.block);
+        vfm_dumpPutStr(&csv, ",");
+        vfm_dumpPutDec(&csv, header.time);
+        vfm_dumpPutStr(&csv, ",");
+        vfm_dumpPutDec(&csv, header.trapTime);
+        vfm_dumpPutStr(&csv, ",");
+        vfm_dumpPutDec(&csv, header.queueDepth);
+        vfm_dumpPutStr(&csv, ",");
+        vfm_dumpPutDec(&csv, header.writes);
+        vfm_dumpPutStr(&csv, "\r\n");
+
+        if (!vfm_dumpCopyXms(cap, file, offset + sizeof(header), blockBytes)) {
+            ok = false;
+            break;
+        }
+
+        offset += cap->recordSize;
+        if (offset >= cap->size) offset = 0;
+    }
+
+    return vfm_dumpClose(&csv) && ok;
+}
+
+/*  Stops all captures and saves whether they were recording, then waits for the DMA ISR to move
+    what is still staged to XMS. The ring buffers don't change anymore while the dump reads them */
+static void vfm_capPauseAll(vfm_CaptureState _far *captures, u8 *active) {
+    volatile u32 _far *biosTicks = (volatile u32 _far *) 0x0040006CUL;
+    u32 start = *biosTicks;
+    u16 i;
+
+    for (i = 0; i < VFM_CAP_COUNT; i++) {
+        active[i] = captures[i].active;
+        captures[i].active = 0;
+    }
+
+    for (i = 0; i < VFM_CAP_COUNT; i++) {
+        volatile vfm_CaptureState _far *cap = captures + i;
+
+        while (cap->stageUsed != 0 && *biosTicks - start < VFM_CAP_FLUSH_TICKS) {}
+    }
+}
+
+/* Restarts the captures that were recording before vfm_capPauseAll */
+static void vfm_capResumeAll(vfm_CaptureState _far *captures, const u8 *active) {
+    u16 i;
+
+    for (i = 0; i < VFM_CAP_COUNT; i++) {
+        captures[i].active = active[i];
+    }
+}
+
+bool vfm_capDump(const char *filename, vfm_CapFormat format) {
+    vfm_CaptureState _far *captures = vfm_capGetResident();
+    vfm_CaptureState _far *resident;
+    u16 index = (format == VFM_CAP_FMT_WAV) ? VFM_CAP_OUTPUT : VFM_CAP_REGS;
+    vfm_CaptureState cap;
+    vfm_DumpFile file;
+    u8 active[VFM_CAP_COUNT];
+    bool ok;
+
+    if (captures == NULL) {
+        VFM_PUTS("ERROR: The TSR isn't loaded\n");
+        return false;
+    }
+
+    resident = captures + index;
+
+    if (resident->handle == 0) {
+        if (index == VFM_CAP_OUTPUT) {
+            VFM_PUTS("ERROR: Capture not enabled, load the TSR with /capout:<KB>\n");
+        } else {
+            VFM_PUTS("ERROR: Capture not enabled, load the TSR with /cap:<KB>\n");
+        }
+        return false;
+    }
+
+    /* Stop recording while the buffer is read, the dumped capture starts over afterwards */
+    vfm_capPauseAll(captures, active);
+    active[index] = 1;
+    cap = *resident;
+
+    if (!vfm_dumpCreate(&file, filename)) {
+        VFM_PUTS("ERROR: Can't create file\n");
+        vfm_capResumeAll(captures, active);
+        return false;
+    }
+
+    switch (format) {
+        case VFM_CAP_FMT_DRO:   ok = vfm_dumpDro(&cap, &file);              break;
+        case VFM_CAP_FMT_WAV:   ok = vfm_dumpWav(&cap, &file, filename);    break;
+        default:                ok = vfm_dumpDbgReg(&cap, &file);           break;
+    }
+
+    ok = vfm_dumpClose(&file) && ok;
+
+    if (!ok) {
+        VFM_PUTS("ERROR: Dump failed\n");
+    } else if (cap.wrapped) {
+        VFM_PUTS("Capture buffer was full, the oldest data is lost\n");
+    }
+
+    if (ok && cap.lost != 0) {
+        vfm_putDec(cap.lost > 0xFFFFUL ? 0xFFFF : (u16) cap.lost);
+        if (index == VFM_CAP_OUTPUT) {
+            VFM_PUTS(" blocks were dropped while the XMS driver was busy\n");
+        } else {
+            VFM_PUTS(" writes were dropped while the XMS driver was busy\n");
+        }
+    }
+
+    /* Start over with an empty buffer */
+    resident->pos       = 0;
+    resident->blocks    = 0;
+    resident->wrapped   = 0;
+    resident->lost      = 0;
+    vfm_capResumeAll(captures, active);
+    return ok;
+}
+
+#ifdef VFM_TRACE
+
+void vfm_traceSetup(void) {
+    g_vfm_trace.timeHz  = VFM_PIT_HZ;
+
+    if (g_vfm_trace.timeSource == VFM_TRACE_TIME_TSC) {
+        g_vfm_trace.timeHz = vfm_dumpMeasureHz(vfm_isrTimestamp);
+    }
+
+    g_vfm_trace.pos     = 0;
+    g_vfm_trace.wrapped = 0;
+    g_vfm_trace.active  = 1;
+}
+
+/* Gets the event trace of the resident TSR, NULL if it isn't loaded or wasn't built with TRACE */
+static vfm_TraceState _far *vfm_traceGetResident() {
+    vfm_TraceState _far *state = NULL;
+
+    _asm {
+        push es
+        push bx
+        xor bx, bx
+        mov es, bx
+        mov ah, VFM_API_MPX_ID
+        mov al, VFM_API_GET_TRACE
+        int 0x2F
+        mov word ptr state, bx
+        mov word ptr state + 2, es
+        pop bx
+        pop es
+    }
+
+    return state;
+}
+
+bool vfm_traceDump(const char *filename) {
+    vfm_TraceState _far *resident = vfm_traceGetResident();
+    vfm_TraceFileHeader header;
+    vfm_DumpFile file;
+    u16 pos;
+    u16 i;
+    bool ok;
+
+    if (resident == NULL) {
+        VFM_PUTS("ERROR: The TSR isn't loaded or wasn't built with TRACE=1\n");
+        return false;
+    }
+
+    /* Stop recording while the buffer is read */
+    resident->active = 0;
+
+    if (!vfm_dumpCreate(&file, filename)) {
+        VFM_PUTS("ERROR: Can't create file\n");
+        resident->active = 1;
+        return false;
+    }
+
+    for (i = 0; i < sizeof(header.magic); i++) {
+        header.magic[i] = VFM_TRACE_MAGIC[i];
+    }
+
+    pos                 = resident->wrapped ? resident->pos : 0;
+    header.timeHz       = resident->timeHz;
+    header.count        = resident->wrapped ? VFM_TRACE_EVENTS : resident->pos;
+    header.timeSource   = resident->timeSource;
+    header.reserved     = 0;
+    vfm_dumpPut(&file, &header, sizeof(header));
+
+    for (i = 0; i < header.count; i++) {
+        vfm_TraceEvent event = resident->events[pos];
+
+        vfm_dumpPut(&file, &event, sizeof(event));
+        if (++pos == VFM_TRACE_EVENTS) pos = 0;
+    }
+
+    ok = vfm_dumpClose(&file);
+
+    if (!ok) {
+        VFM_PUTS("ERROR: Dump failed\n");
+    } else if (resident->wrapped) {
+        VFM_PUTS("Trace buffer was full, the oldest events are lost\n");
+    }
+
+    /* Start over with an empty buffer */
+    resident->pos       = 0;
+    resident->wrapped   = 0;
+    resident->active    = 1;
+    return ok;
+}
+
+#endif
+
+static const char VFM_TEXT s_adaptTierNames[VFM_TIER_COUNT][16] = { "full", "block LFO", "block envelopes", "half rate" };
+
+u32 vfm_adaptMeasureHz(void) {
+#if CPU_LEVEL >= 5
+    return vfm_dumpMeasureHz(vfm_isrTimestamp);
+#else
+    return VFM_PIT_HZ;
+#endif
+}
+
+void vfm_adaptSetup(u16 percent, u16 sampsPerBuf, u16 rate) {
+    vfm_AdaptState *adapt = &g_vfm_adapt;
+
+    adapt->timeHz       = vfm_adaptMeasureHz();
+    vfm_adaptSetBudget(percent, sampsPerBuf, rate);
+    adapt->last         = 0;
+    adapt->worst        = 0;
+    adapt->stepsDown    = 0;
+    adapt->stepsUp      = 0;
+    adapt->enabled      = 1;
+}
+
+/* Gets the adaptive quality state of the resident TSR, NULL if it isn't loaded or is older than that */
+static vfm_AdaptState _far *vfm_adaptGetResident() {
+    vfm_AdaptState _far *state = NULL;
+
+    _asm {
+        push es
+        push bx
+        xor bx, bx
+        mov es, bx
+        mov ah, VFM_API_MPX_ID
+        mov al, VFM_API_GET_ADAPT
+        int 0x2F
+        mov word ptr state, bx
+        mov word ptr state + 2, es
+        pop bx
+        pop es
+    }
+
+    return state;
+}
+
+/* Prints <time> in percent of the block period */
+static void vfm_adaptPutLoad(u32 time, u32 period) {
+    u32 pct = (time / period) * 100UL + (time % period) * 100UL / period;
+
+    vfm_putDec(pct > 9999UL ? 9999 : (u16) pct);
+    VFM_PUTS("%");
+}
+
+bool vfm_adaptPrint(void) {
+    vfm_AdaptState _far *resident = vfm_adaptGetResident();
+    vfm_AdaptState adapt;
+
+    if (resident == NULL) {
+        VFM_PUTS("ERROR: The TSR isn't loaded\n");
+        return false;
+    }
+
+    /* Copy it first, the DMA ISR keeps changing it */
+    _asm cli
+    adapt = *resident;
+    _asm sti
+
+    VFM_PUTS("Quality tier:  ");
+    vfm_puts(s_adaptTierNames[adapt.tier < VFM_TIER_COUNT ? adapt.tier : 0]);
+    VFM_PUTS("\n");
+
+    if (!adapt.enabled || adapt.period == 0) {
+        VFM_PUTS("Adaptive quality is off (/adapt)\n");
+        return true;
+    }
+
+    VFM_PUTS("Best tier:     ");
+    vfm_puts(s_adaptTierNames[adapt.baseTier < VFM_TIER_COUNT ? adapt.baseTier : 0]);
+    VFM_PUTS("\nBudget:        ");
+    vfm_adaptPutLoad(adapt.budget, adapt.period);
+    VFM_PUTS(" of a block\nLast block:    ");
+    vfm_adaptPutLoad(adapt.last, adapt.period);
+    VFM_PUTS("\nWorst block:   ");
+    vfm_adaptPutLoad(adapt.worst, adapt.period);
+    VFM_PUTS("\nSteps down/up: ");
+    vfm_putDec(adapt.stepsDown);
+    VFM_PUTS("/");
+    vfm_putDec(adapt.stepsUp);
+    VFM_PUTS("\n");
+    return true;
+}
+
+/* Calls VFM_API_GET_CONFIG or VFM_API_SET_CONFIG of the resident TSR with <config>, returns AX */
+static u16 vfm_cfgCall(u8 function, vfm_ApiConfig *config) {
+    u16 result;
+
+    _asm {
+        push es
+        push bx
+        push ds
+        pop es
+        mov bx, config
+        mov ah, VFM_API_MPX_ID
+        mov al, function
+        int 0x2F
+        mov result, ax
+        pop bx
+        pop es
+    }
+
+    return result;
+}
+
+static void vfm_cfgPrint(const vfm_ApiConfig *config) {
+    VFM_PUTS("Core:          ");
+    vfm_puts(vfm_coreGetName((vfm_CoreType) config->core));
+    VFM_PUTS("\nBuffers:       ");
+    vfm_tsrPrintBufferSettings(config->sampsPerBuf, config->numBufs);
+    VFM_PUTS("Half rate:     ");
+    if (config->halfRate) {
+        VFM_PUTS("on\n");
+    } else {
+        VFM_PUTS("off\n");
+    }
+    VFM_PUTS("Polyphony:     ");
+    if (config->voiceLimit != 0) {
+        vfm_putDec(config->voiceLimit);
+        VFM_PUTS(" voices\n");
+    } else {
+        VFM_PUTS("no limit\n");
+    }
+    VFM_PUTS("Adaptive:      ");
+    if (config->adaptPct != 0) {
+        vfm_putDec(config->adaptPct);
+        VFM_PUTS("% of a block\n");
+    } else {
+        VFM_PUTS("off\n");
+    }
+}
+
+bool vfm_cfgChange(vfm_ApiConfig *config) {
+    vfm_ApiConfig current;
+    u16 result;
+
+    /* Older TSRs don't know the function and leave the buffer as it is */
+    current.maxSampsPerBuf = 0;
+    vfm_cfgCall(VFM_API_GET_CONFIG, &current);
+
+    if (current.maxSampsPerBuf == 0) {
+        VFM_PUTS("ERROR: The TSR isn't loaded or is older than this command\n");
+        return false;
+    }
+
+    if (config->sampsPerBuf != VFM_API_KEEP || config->numBufs != VFM_API_KEEP || config->core != VFM_API_KEEP
+     || config->halfRate != VFM_API_KEEP || config->voiceLimit != VFM_API_KEEP || config->adaptPct != VFM_API_KEEP) {
+        /* The timestamp frequency is only known to the TSR if it was loaded with /adapt */
+        if (config->adaptPct != 0 && config->adaptPct != VFM_API_KEEP && current.timeHz == 0) {
+            config->timeHz = vfm_adaptMeasureHz();
+        }
+
+        result = vfm_cfgCall(VFM_API_SET_CONFIG, config);
+
+        switch (result) {
+            case VFM_API_CFG_OK:
+                break;
+            case VFM_API_CFG_ERR_RANGE:
+                VFM_PUTS("ERROR: Invalid settings, the limits of the TSR are ");
+                vfm_putDec(current.maxSampsPerBuf);
+                VFM_PUTS(" samples x ");
+                vfm_putDec(current.maxBufs);
+                VFM_PUTS(" buffers\n");
+                return false;
+            case VFM_API_CFG_ERR_HALF:
+                VFM_PUTS("ERROR: Half rate synthesis needs an even number of samples per buffer\n");
+                return false;
+            case VFM_API_CFG_ERR_CAPTURE:
+                VFM_PUTS("ERROR: The samples per buffer can't change while capturing (/cap, /capout)\n");
+                return false;
+            case VFM_API_CFG_ERR_CORE:
+                VFM_PUTS("ERROR: The core isn't resident, load the driver with /core:nuked to switch between both\n");
+                return false;
+            case VFM_API_CFG_ERR_BUSY:
+                VFM_PUTS("ERROR: The TSR is busy switching its settings, try again\n");
+                return false;
+            default:
+                VFM_PUTS("ERROR: The TSR refused the settings\n");
+                return false;
+        }
+
+        vfm_cfgCall(VFM_API_GET_CONFIG, &current);
+    }
+
+    vfm_cfgPrint(&current);
+
+    if (current.voiceLimit != 0 && current.core != VFM_CORE_DBOPL) {
+        VFM_PUTS("WARNING: The polyphony limit only applies to DBOPL\n");
+    }
+
+    return true;
+}
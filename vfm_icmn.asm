@@ -1,6 +1,8 @@
     .model small, c
     .586p
 
+    INCLUDE vfm_mmx.inc
+
     .data
 
 STEREO                      EQU 2
@@ -10,8 +12,10 @@ DMATABLEENTRY STRUC
     dd countflags
 DMATABLEENTRY ENDS
 
+; 4 bytes so the NMI handler can index with a shift and store an entry with one write
 OPLQUEUEENTRY STRUC
     dw bankedIndex
+    db reserved
     db data
 OPLQUEUEENTRY ENDS
 
@@ -22,7 +26,7 @@ SWAP_STACK  MACRO BACKUP, NEWSTACK
     mov cs:[BACKUP+2], ss
     mov cs:[BACKUP+4], sp
     mov cs:[BACKUP+6], ds
-    mov ax, SEG NEWSTACK
+    mov ax, cs:[g_vfm_dataSeg]
     mov ds, ax
     mov ss, ax
     lea sp, NEWSTACK
@@ -36,15 +40,46 @@ RESTORE_STACK MACRO BACKUP
     mov ds, cs:[BACKUP+6]
     ENDM
 
+; MMX shares its registers with the FPU, so the MMX build has to save the
+; interrupted program's FPU state before the OPL core gets to touch them
+FPU_SAVE MACRO
+IF CPU_LEVEL GE 6
+    fnsave g_DMA_FpuState
+ENDIF
+    ENDM
+
+FPU_RESTORE MACRO
+IF CPU_LEVEL GE 6
+    EMMS_
+    frstor g_DMA_FpuState
+ENDIF
+    ENDM
+
+; Records an event in the trace (TRACE=1 builds only, see vfm_trc.h)
+; <type> is a constant, <arg> a 16-bit operand. Preserves all registers and flags, needs DS = our data
+TRACE MACRO type, arg
+IFDEF VFM_TRACE
+    push ax
+    push cx
+    mov cx, arg
+    mov al, type
+    call vfm_traceAsm
+    pop cx
+    pop ax
+ENDIF
+    ENDM
+
 ; General data
 EXTERN g_vfm_slaveIrq:              BYTE
 EXTERN g_vfm_ioBaseDma:             WORD
 EXTERN g_vfm_ioBaseNmi:             WORD
-EXTERN g_vfm_oplChip:               PTR
+EXTERN g_vfm_numBufs:               WORD
 
 EXTERN g_vfm_fmDmaTable:            PTR DMATABLEENTRY
 EXTERN g_vfm_fmDmaBuffers:          PTR WORD
 EXTERN g_vfm_fmDmaTablePhysAddress: DWORD
+EXTERN g_vfm_capture:               BYTE
+EXTERN g_vfm_adapt:                 BYTE
 
 
 ; Globals
@@ -52,11 +87,19 @@ PUBLIC g_DMA_IRQOccured
 PUBLIC g_DMA_BufferIndex
 PUBLIC g_vfm_oldPciIsr
 PUBLIC g_vfm_oldNmiIsr
+PUBLIC g_vfm_oldMpxIsr
+PUBLIC g_vfm_dataSeg
+PUBLIC g_OPL_RegQueue
+PUBLIC g_OPL_RegCount
+PUBLIC g_OPL_TrapTime
+PUBLIC g_OPL_StampTraps
+PUBLIC g_NMI_DwordIo
+PUBLIC g_XMS_Busy
+PUBLIC g_XMS_OldEntry
 
 ; NMI IRQ stuff
 
-g_NMI_Success               db 0
-g_NMI_Busy                  db 0
+g_NMI_DwordIo               db 0            ; Status, data and index can be read with one 32-bit read
 
 ; DMA IRQ stuff
 
@@ -65,19 +108,79 @@ g_DMA_IRQOccured            db 0
 
 g_DMA_BufferIndex           dw 0
 
+IF CPU_LEVEL GE 6
+; FPU state of the interrupted program (FNSAVE area, 94 bytes in real mode, 108 in 32-bit PM)
+g_DMA_FpuState              db 108  dup (0)
+ENDIF
+
 ; Our custom stacks
 ; Stack for PCI DMA Interupt 
 g_DMA_Stack                 db 512  dup (0)
 g_DMA_StackTop              = $
 
-; Stack for NMI Interrupt
-g_NMI_Stack                 db 512  dup (0)
-g_NMI_StackTop              = $
+; Stack for the configuration API, the DMA ISR can come in while it runs
+g_API_Stack                 db 512  dup (0)
+g_API_StackTop              = $
+
+; The configuration API is running, the DMA ISR doesn't render in the meantime
+g_API_Busy                  db 0
 
 ; OPL Register Write Queue
 OPL_REG_QUEUE_SIZE          EQU 512
-g_OPL_RegQueue              OPLQUEUEENTRY OPL_REG_QUEUE_SIZE dup (<0, 0>)
+g_OPL_RegQueue              OPLQUEUEENTRY OPL_REG_QUEUE_SIZE dup (<0, 0, 0>)
 g_OPL_RegCount               dw 0
+; Timestamp (vfm_isrStamp) of the first write queued since the queue was last empty,
+; only taken while g_OPL_StampTraps is set (output capture)
+g_OPL_TrapTime              dd 0
+g_OPL_StampTraps            db 0
+
+; Calls through the XMS driver entry point in progress (see vfm_xmsHook)
+g_XMS_Busy                  db 0
+
+IFDEF VFM_TRACE
+; Event trace (see vfm_trc.h)
+VFM_TRACE_EVENTS            EQU 2048
+
+VFM_TRC_ISR_START           EQU 1
+VFM_TRC_ISR_END             EQU 2
+VFM_TRC_NMI_ENTER           EQU 3
+VFM_TRC_NMI_EXIT            EQU 4
+VFM_TRC_QUEUE_FULL          EQU 5
+
+IF CPU_LEVEL GE 5
+VFM_TRACE_TIME_SOURCE       EQU 0       ; TSC
+ELSE
+VFM_TRACE_TIME_SOURCE       EQU 1       ; PIT
+ENDIF
+
+; Same layout as vfm_TraceState, the events follow right after it
+TRACESTATE STRUC
+    timeHz                  dd 0
+    pos                     dw 0
+    wrapped                 db 0
+    active                  db 0
+    timeSource              db 0
+    pad                     db 0
+TRACESTATE ENDS
+
+PUBLIC g_vfm_trace
+
+g_vfm_trace                 TRACESTATE <0, 0, 0, 0, VFM_TRACE_TIME_SOURCE, 0>
+g_TRC_Events                db VFM_TRACE_EVENTS * 8 dup (0)
+ENDIF
+
+; INT 2Fh multiplex API (see vfm_api.h)
+VFM_API_MPX_ID              EQU 0C9h
+VFM_API_INSTALL_CHECK       EQU 00h
+VFM_API_WRITE_REGS          EQU 01h
+VFM_API_GET_ENTRY           EQU 02h
+VFM_API_GET_CAPTURE         EQU 03h
+VFM_API_GET_TRACE           EQU 04h
+VFM_API_GET_ADAPT           EQU 05h
+VFM_API_GET_CONFIG          EQU 06h
+VFM_API_SET_CONFIG          EQU 07h
+VFM_API_SIGNATURE           EQU 0AC97h
+VFM_API_CFG_ERR_BUSY        EQU 6
 
 ; FM SGD Register definitions
 SGD_CHANNEL_STATUS_ACTIVE   EQU 080h
@@ -99,34 +202,17 @@ VFM_IO_FM_SGD_STATUS        EQU 20h
 ; Register backups for setting up custom stacks
 ; These have to be in code segment so we can access it
 g_DMA_Backup                dw 5    dup (0AA55h)
-g_NMI_Backup                dw 5    dup (0AA55h)
+; Same for the configuration API
+g_API_Backup                dw 5    dup (0AA55h)
+g_API_Result                dw 0
 
 ; After swapping back the original segment registers, we can no longer access DS,
 ; so we copy the chain ISR addresses to the code segment
 g_vfm_oldPciIsr             dd 0
 g_vfm_oldNmiIsr             dd 0
+g_vfm_oldMpxIsr             dd 0
+; Same for the XMS driver, vfm_xmsHook has to keep the caller's DS
+g_XMS_OldEntry              dd 0
 
-; After processing registers, 
-; si = current register queue entry
-; cx = amount of registers to move
-vfm_moveRegistersBackToStart proc near
-    ; Early return if c
-    or cx, cx
-    jz _moveEnd
-
-    ; int 3
-
-    ; es:di = start of register queue
-    push ds
-    pop es
-    mov di, offset g_OPL_RegQueue
-
-_moveLoop:
-    ; [es:di]++ = [si]++
-    movsw   ; reg index
-    movsb   ; data
-    loop _moveLoop
-
-_moveEnd:
-    ret
-vfm_moveRegistersBackToStart endp
\ No newline at end of file
+; Our data segment. Not a SEG fixup, because it changes when the data is moved down on going resident
+g_vfm_dataSeg               dw 0
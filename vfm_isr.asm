@@ -0,0 +1,605 @@
+; VIA_AC97.866 FM Emulation TSR
+; 
+; (C) 2025 Eric Voirin (Oerg866)
+;
+; LICENSE: CC-BY-NC-SA 4.0
+;
+; FM Emulation TSR Interrupt Handler Data & Assembly Code
+
+    INCLUDE vfm_icmn.asm
+
+vfm_renderBlock PROTO NEAR C, buf:PTR WORD
+vfm_cfgGet      PROTO NEAR C, config:FAR PTR
+vfm_cfgSet      PROTO NEAR C, config:FAR PTR
+
+vfm_dmaInterruptHandler PROC FAR
+    ;int 3
+
+    SWAP_STACK      g_DMA_Backup, g_DMA_StackTop
+    
+    ; Actual PCI Interrupt handler code
+
+    ; Read FM SGD Status register
+    pushad
+    push es
+
+    mov dx, [g_vfm_ioBaseDma]
+    add dx, VFM_IO_FM_SGD_STATUS
+    in al, dx
+
+    ; Is EOL or FLAG set?
+    mov g_DMA_OurIRQ, 0
+    test al, SGD_CHANNEL_STATUS_FLAG OR SGD_CHANNEL_STATUS_EOL
+    jz _skipIrqAck
+
+    ; It's our IRQ! Let's handle it
+    mov [g_DMA_OurIRQ], 1
+
+    ; Signal to the outside
+    mov [g_DMA_IRQOccured], 1
+
+    ; The configuration API is switching the buffers or the core, they're left alone until it's done
+    cmp byte ptr [g_API_Busy], 0
+    jne _dmaAck
+
+    ; Save FPU state, MMX kernels clobber it
+    FPU_SAVE
+    
+    ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+    ; Next step: update buffer writing position
+     
+    
+    ; Get NMI current pointer table entry address
+    add dx, 4
+    in eax, dx
+    ; Subtract base address and divide by 8 to get the bank index
+    sub eax, [g_vfm_fmDmaTablePhysAddress]
+    shr eax, 3
+    dec eax ; It's always pointing to the *next* table address so -1
+
+    ; Essentially, the bank index to write to is is that index minus 1
+    dec al
+    ; underflow?
+    jns _noNegBufferAdj
+    
+    ; Adjust
+    mov al, byte ptr [g_vfm_numBufs]
+    dec al
+   
+_noNegBufferAdj:
+    ; Update index with final value
+    mov [g_DMA_BufferIndex], ax
+
+    TRACE VFM_TRC_ISR_START, ax
+
+    ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+    ; Next step: Process pending OPL register writes & render the block
+   
+    mov di, offset g_vfm_fmDmaBuffers   ; DI = DMA buffer pointer array
+    add di, ax                          ; Calculate pointer to our current index's buffer pointer (sorry for the confusion)
+    add di, ax
+    mov di, [di]                        ; DI = Write Pointer to DMA buffer
+
+    ; The selected OPL core does the rest (vfm_core.c)
+    push di
+    call vfm_renderBlock
+    add sp, 2
+
+    FPU_RESTORE
+
+    TRACE VFM_TRC_ISR_END, 0
+
+_dmaAck:
+    ; Ack the interrupt to clear it, writing FLAG and EOL to clear them
+    mov al, SGD_CHANNEL_STATUS_FLAG OR SGD_CHANNEL_STATUS_EOL
+    mov dx, word ptr [g_vfm_ioBaseDma]
+    add dx, VFM_IO_FM_SGD_STATUS
+    out dx, al
+
+_skipIrqAck:
+    pop es
+    popad
+
+    ; Did we handle this IRQ? If not, chain to next ISR
+    cmp byte ptr [g_DMA_OurIRQ], 1
+    jnz _jmpToOldIrq
+
+    ; We handled the ISR, 
+_weHandledIRQ:
+    cmp byte ptr [g_vfm_slaveIrq], 1
+    jnz _noSlaveEOI
+
+    ; EOI to slave PIC
+    mov al, 20h
+    out 0A0h, al
+
+_noSlaveEOI:
+    ; EOI to master PIC
+    mov al, 20h
+    out 20h, al
+
+    ; Done :3
+    ; Restore interrupted program's stack
+    RESTORE_STACK   g_DMA_Backup
+    iret
+
+    ; Jump to other ISR
+_jmpToOldIrq:
+    ; Restore interrupted program's stack
+    RESTORE_STACK   g_DMA_Backup
+    jmp cs:[g_vfm_oldPciIsr]
+
+
+
+vfm_dmaInterruptHandler ENDP
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; NMI / SMI Handler
+;
+; Runs for every single OPL data write, so it is kept as short as possible:
+; - No stack switch, it only pushes 10 bytes onto the interrupted program's stack
+;   (up to 24 for the first write of a block while the output capture takes its timestamp)
+; - No busy flag, the CPU doesn't take another NMI before the IRET
+; - Status, data and index come from one 32-bit read if the chipset allows it
+; - Queue entries are 4 bytes, stored with a single write
+;
+; The cost of a trapped write can be measured with the DBG_BENCH build (g parameter).
+;
+vfm_nmiHandler PROC FAR
+    push eax
+    push dx
+    push bx
+    push ds
+
+    mov ax, cs:[g_vfm_dataSeg]
+    mov ds, ax
+
+    TRACE VFM_TRC_NMI_ENTER, 0
+
+    mov dx, word ptr [g_vfm_ioBaseNmi]
+
+    cmp byte ptr [g_NMI_DwordIo], 0
+    je _nmiByteIo
+
+    ; AL = status, AH = data (+1), byte 2 = index (+2)
+    in eax, dx
+
+    ; Bank = status - 1, anything but 0 or 1 is not our NMI
+    mov bl, al
+    and bl, 3
+    dec bl
+    cmp bl, 2
+    jae _nmiNotOurs
+
+    ror eax, 16                         ; AL = index, byte 3 = data
+    mov ah, bl                          ; AX = bank + register index
+    jmp _nmiQueue
+
+_nmiByteIo:
+    in al, dx
+    and al, 3
+    dec al
+    cmp al, 2
+    jae _nmiNotOurs
+
+    mov ah, al                          ; AH = bank
+    add dx, 2
+    in al, dx                           ; AL = index
+    ror eax, 16
+    dec dx
+    in al, dx                           ; AL = data
+    mov ah, al
+    ror eax, 16                         ; AX = bank + register index, byte 3 = data
+
+_nmiQueue:
+    mov bx, word ptr [g_OPL_RegCount]
+    cmp bx, OPL_REG_QUEUE_SIZE
+    jae _nmiQueueFull
+
+    ; First write since the queue was empty: the output capture wants to know when it came
+    test bx, bx
+    jnz _nmiNoStamp
+    cmp byte ptr [g_OPL_StampTraps], 0
+    je _nmiNoStamp
+    push eax
+    push edx
+    call vfm_isrStamp
+    mov dword ptr [g_OPL_TrapTime], eax
+    pop edx
+    pop eax
+
+_nmiNoStamp:
+    inc word ptr [g_OPL_RegCount]
+    shl bx, 2
+    mov dword ptr g_OPL_RegQueue[bx], eax
+
+    TRACE VFM_TRC_NMI_EXIT, <word ptr [g_OPL_RegCount]>
+
+    pop ds
+    pop bx
+    pop dx
+    pop eax
+    iret
+
+    ; TSR Signature
+    DW 0866h
+    DW 0866h
+    DW 0AC97h
+    DW 0AC97h
+
+    ; Write queue full, the write is lost
+_nmiQueueFull:
+    TRACE VFM_TRC_QUEUE_FULL, OPL_REG_QUEUE_SIZE
+
+_nmiNotOurs:
+    TRACE VFM_TRC_NMI_EXIT, <word ptr [g_OPL_RegCount]>
+
+    ; Wasn't for us (or couldn't be handled), jmp to previous NMI handler
+    pop ds
+    pop bx
+    pop dx
+    pop eax
+    jmp cs:[g_vfm_oldNmiIsr]
+
+vfm_nmiHandler ENDP
+
+vfm_nmiHandlerEnd PROC FAR
+vfm_nmiHandlerEnd ENDP
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; Direct register write API for our own programs, no NMI round trip per write
+;
+
+; Appends register writes to the queue
+; In:  ES:SI = vfm_OplQueueEntry array (bit 8 of the index = bank B), CX = count
+; Out: CX = entries queued, CF set if the queue was too full to take all of them
+; The queue space is reserved before copying, so trapped port writes can't land in it
+vfm_apiQueueRegs PROC NEAR
+    push ax
+    push di
+    push si
+    push ds
+    push es
+    push cx
+    pushf
+
+    mov ax, es
+    mov ds, ax                          ; DS:SI = caller's entries
+    mov ax, cs:[g_vfm_dataSeg]
+    mov es, ax                          ; ES = our data
+
+    cli
+    cld
+
+    ; Clip to the free space in the queue
+    mov ax, OPL_REG_QUEUE_SIZE
+    sub ax, word ptr es:[g_OPL_RegCount]
+    cmp cx, ax
+    jbe _apiFits
+    mov cx, ax
+
+_apiFits:
+    ; Same timestamp as for trapped writes, see _nmiQueue
+    cmp word ptr es:[g_OPL_RegCount], 0
+    jne _apiNoStamp
+    cmp byte ptr es:[g_OPL_StampTraps], 0
+    je _apiNoStamp
+    push eax
+    push edx
+    call vfm_isrStamp
+    mov dword ptr es:[g_OPL_TrapTime], eax
+    pop edx
+    pop eax
+
+_apiNoStamp:
+    ; DI = &g_OPL_RegQueue[count], entries are 4 bytes
+    mov di, word ptr es:[g_OPL_RegCount]
+    add word ptr es:[g_OPL_RegCount], cx
+    shl di, 2
+    add di, offset g_OPL_RegQueue
+
+    ; Same layout on both sides, so it's a plain copy
+    mov ax, cx
+    rep movsd
+
+    mov cx, ax                          ; CX = entries queued
+
+    popf                                ; Restores IF
+    pop ax
+    cmp cx, ax                          ; CF = less than requested
+    pop es
+    pop ds
+    pop si
+    pop di
+    pop ax
+    ret
+vfm_apiQueueRegs ENDP
+
+; Far call entry point, same registers as VFM_API_WRITE_REGS
+vfm_apiWriteRegs PROC FAR
+    call vfm_apiQueueRegs
+    ret
+vfm_apiWriteRegs ENDP
+
+; Runs vfm_cfgGet / vfm_cfgSet (vfm_cfg.c) for the caller's vfm_ApiConfig
+; In:  AL = VFM_API_GET_CONFIG or VFM_API_SET_CONFIG, ES:BX = vfm_ApiConfig
+; Out: AX = VFM_API_CFG_..., CF set if it isn't VFM_API_CFG_OK
+; Runs on its own stack. vfm_cfgSet turns interrupts on for the slow parts, g_API_Busy keeps the
+; DMA ISR away from the settings and buffers in the meantime and makes other calls fail until it's done
+vfm_apiConfig PROC NEAR
+    cli
+    push ds
+    mov ds, cs:[g_vfm_dataSeg]
+    cmp byte ptr [g_API_Busy], 0
+    pop ds
+    je _apiNotBusy
+    mov ax, VFM_API_CFG_ERR_BUSY
+    stc
+    ret
+
+_apiNotBusy:
+    SWAP_STACK      g_API_Backup, g_API_StackTop
+    mov byte ptr [g_API_Busy], 1
+
+    pushad
+    push es
+
+    ; The cores may change the FPU/MMX state when they are reset
+    FPU_SAVE
+
+    push es
+    push bx
+    cmp byte ptr cs:[g_API_Backup], VFM_API_GET_CONFIG
+    jne _apiSetConfig
+    call vfm_cfgGet
+    jmp _apiConfigDone
+
+_apiSetConfig:
+    call vfm_cfgSet
+
+_apiConfigDone:
+    add sp, 4
+    cli
+    mov cs:[g_API_Result], ax
+
+    FPU_RESTORE
+
+    pop es
+    popad
+
+    mov byte ptr [g_API_Busy], 0
+    RESTORE_STACK   g_API_Backup
+    mov ax, cs:[g_API_Result]
+    cmp ax, 1                           ; CF = VFM_API_CFG_OK
+    cmc                                 ; CF = error
+    ret
+vfm_apiConfig ENDP
+
+; INT 2Fh handler, AH = VFM_API_MPX_ID
+;   AL = VFM_API_INSTALL_CHECK: Returns AL = 0FFh, BX = VFM_API_SIGNATURE
+;   AL = VFM_API_WRITE_REGS:    See vfm_apiQueueRegs
+;   AL = VFM_API_GET_ENTRY:     Returns ES:BX = vfm_apiWriteRegs, CX = queue size
+;   AL = VFM_API_GET_CAPTURE:   Returns ES:BX = capture states (vfm_CaptureState array)
+;   AL = VFM_API_GET_TRACE:     Returns ES:BX = event trace (vfm_TraceState), TRACE=1 builds only
+;   AL = VFM_API_GET_ADAPT:     Returns ES:BX = adaptive quality state (vfm_AdaptState)
+;   AL = VFM_API_GET_CONFIG:    See vfm_apiConfig
+;   AL = VFM_API_SET_CONFIG:    See vfm_apiConfig
+vfm_mpxHandler PROC FAR
+    cmp ah, VFM_API_MPX_ID
+    jne _mpxChain
+
+    cmp al, VFM_API_INSTALL_CHECK
+    jne _mpxNoCheck
+    mov al, 0FFh
+    mov bx, VFM_API_SIGNATURE
+    iret
+
+_mpxNoCheck:
+    cmp al, VFM_API_WRITE_REGS
+    jne _mpxNoWrite
+    call vfm_apiQueueRegs
+    sti
+    retf 2                              ; Return with our CF
+
+_mpxNoWrite:
+    cmp al, VFM_API_GET_ENTRY
+    jne _mpxNoEntry
+    push cs
+    pop es
+    mov bx, offset vfm_apiWriteRegs
+    mov cx, OPL_REG_QUEUE_SIZE
+    iret
+
+_mpxNoEntry:
+    cmp al, VFM_API_GET_CAPTURE
+    jne _mpxNoCapture
+    mov es, cs:[g_vfm_dataSeg]
+    mov bx, offset g_vfm_capture
+    iret
+
+_mpxNoCapture:
+    cmp al, VFM_API_GET_ADAPT
+    jne _mpxNoAdapt
+    mov es, cs:[g_vfm_dataSeg]
+    mov bx, offset g_vfm_adapt
+    iret
+
+_mpxNoAdapt:
+    cmp al, VFM_API_GET_CONFIG
+    je _mpxConfig
+    cmp al, VFM_API_SET_CONFIG
+    jne _mpxNoConfig
+
+_mpxConfig:
+    call vfm_apiConfig
+    sti
+    retf 2                              ; Return with our CF
+
+_mpxNoConfig:
+IFDEF VFM_TRACE
+    cmp al, VFM_API_GET_TRACE
+    jne _mpxChain
+    mov es, cs:[g_vfm_dataSeg]
+    mov bx, offset g_vfm_trace
+    iret
+ENDIF
+
+_mpxChain:
+    jmp cs:[g_vfm_oldMpxIsr]
+vfm_mpxHandler ENDP
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; XMS driver hook (set up by vfm_capHookXms when capturing)
+;
+; The XMS driver isn't reentrant, so the DMA ISR may only move the captures to XMS
+; when it didn't interrupt a call to it. Every call through the XMS entry point
+; comes through here and is counted in g_XMS_Busy. Starts with the same 5 bytes as
+; an XMS entry point, so later hooks can chain onto it the usual way.
+;
+vfm_xmsHook PROC FAR
+    jmp short _xmsHookStart
+    nop
+    nop
+    nop
+
+_xmsHookStart:
+    push ds
+    mov ds, cs:[g_vfm_dataSeg]
+    inc byte ptr [g_XMS_Busy]
+    pop ds
+
+    ; DS:SI, AX, BX, DX go through unchanged
+    call dword ptr cs:[g_XMS_OldEntry]
+
+    push ds
+    mov ds, cs:[g_vfm_dataSeg]
+    dec byte ptr [g_XMS_Busy]
+    pop ds
+    ret
+vfm_xmsHook ENDP
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; Timestamps (event trace and adaptive quality)
+;
+
+; Out: EAX = timestamp, EDX destroyed. Interrupts have to be off
+;   CPU_LEVEL 5/6: TSC
+;   CPU_LEVEL 3:   Low word of the BIOS tick count : PIT clocks since the tick
+vfm_isrStamp PROC NEAR
+IF CPU_LEVEL GE 5
+    RDTSC_
+ELSE
+    push cx
+    push es
+
+    ; Read-back command: latch status and count of counter 0
+    mov al, 0C2h
+    out 43h, al
+    in al, 40h
+    mov dl, al                          ; DL = status
+    in al, 40h
+    mov cl, al
+    in al, 40h
+    mov ch, al
+    neg cx                              ; CX = counted down since the reload
+
+    ; Mode 3 (square wave) counts down by 2, twice per period, OUT is low in the second half
+    mov al, dl
+    and al, 06h
+    cmp al, 06h
+    jne _stampMode2
+    shr cx, 1
+    test dl, 80h
+    jnz _stampMode2
+    or cx, 8000h
+
+_stampMode2:
+    mov ax, 40h
+    mov es, ax
+    mov ax, word ptr es:[6Ch]
+    shl eax, 16
+    mov ax, cx
+
+    pop es
+    pop cx
+ENDIF
+    ret
+vfm_isrStamp ENDP
+
+; u32 vfm_isrTimestamp(void), keeps the high halves of EAX and EDX like the C code expects
+vfm_isrTimestamp PROC C
+    pushf
+    push edx
+    push eax
+    cli
+    call vfm_isrStamp
+    mov cx, ax
+    shr eax, 16
+    mov bx, ax
+    pop eax
+    pop edx
+    popf
+    mov ax, cx
+    mov dx, bx
+    ret
+vfm_isrTimestamp ENDP
+
+IFDEF VFM_TRACE
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; Event trace (see vfm_trc.h)
+;
+
+; In: AL = event type, CX = argument, DS = our data. Preserves all registers and flags
+vfm_traceAsm PROC NEAR
+    pushf
+    cli
+
+    cmp byte ptr [g_vfm_trace.active], 0
+    je _traceOff
+
+    push eax
+    push edx
+    push bx
+    push si
+
+    mov bl, al                          ; BL = type
+    call vfm_isrStamp
+
+    mov si, word ptr [g_vfm_trace.pos]
+    inc word ptr [g_vfm_trace.pos]
+    cmp word ptr [g_vfm_trace.pos], VFM_TRACE_EVENTS
+    jb _traceNoWrap
+    mov word ptr [g_vfm_trace.pos], 0
+    mov byte ptr [g_vfm_trace.wrapped], 1
+
+_traceNoWrap:
+    ; Events are 8 bytes: time, type, reserved, arg
+    shl si, 3
+    mov dword ptr g_TRC_Events[si], eax
+    mov byte ptr g_TRC_Events[si + 4], bl
+    mov word ptr g_TRC_Events[si + 6], cx
+
+    pop si
+    pop bx
+    pop edx
+    pop eax
+
+_traceOff:
+    popf
+    ret
+vfm_traceAsm ENDP
+
+; void vfm_traceEvent(u8 type, u16 arg)
+vfm_traceEvent PROC C type:BYTE, arg:WORD
+    mov al, type
+    mov cx, arg
+    call vfm_traceAsm
+    ret
+vfm_traceEvent ENDP
+
+ENDIF
+    END
\ No newline at end of file
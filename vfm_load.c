@@ -0,0 +1,225 @@
+/* VIA_AC97.866 FM Emulation TSR
+ *
+ * (C) 2025 Eric Voirin (Oerg866)
+ *
+ * LICENSE: CC-BY-NC-SA 4.0
+ *
+ * TSR Loader - Detects the CPU and runs the matching TSR build (V97TSR3/5/6.EXE)
+ *
+ * The loader shrinks its memory block to its own image before running the TSR build
+ * and frees it when the TSR has gone resident. Unless the TSR moved into an upper
+ * memory block, that leaves a hole of the loader's size (PSP, code, data and stack)
+ * in conventional memory below the TSR.
+ */
+
+#include "types.h"
+
+#include "vfm_tsr.h"
+
+#define VFM_LOAD_PATH_SIZE  128
+#define VFM_LOAD_TAIL_SIZE  128
+
+#pragma pack(1)
+typedef struct {
+    u16 envSegment;                         /* Environment for the child, 0 = ours */
+    char _far *cmdTail;                     /* Command tail (length, string, CR) */
+    void _far *fcb1;                        /* Default FCBs */
+    void _far *fcb2;
+} vfm_DosExecParams;
+#pragma pack()
+
+static char                 s_exePath[VFM_LOAD_PATH_SIZE];
+static char                 s_cmdTail[VFM_LOAD_TAIL_SIZE];
+static vfm_DosExecParams    s_execParams;
+
+#ifndef DEBUG
+/* Definitions from vfm_clib.asm */
+extern u8                   vfm_imageEnd;   /* End of the stack, the last thing in DGROUP */
+#endif
+
+/* Picks the TSR build for this CPU: '6' = MMX, '5' = Pentium class, '3' = anything else */
+static char vfm_loadGetCpuLevel() {
+    u32 features = vfm_cpuGetFeatures();
+
+    if (features & VFM_CPU_MMX) return '6';
+    if (features & VFM_CPU_TSC) return '5';   /* Every CPU with CPUID and TSC is Pentium class */
+    return '3';
+}
+
+/* Gets the PSP segment of the loader */
+static u16 vfm_loadGetPsp() {
+    u16 psp;
+    _asm {
+        mov ah, 0x51
+        int 0x21
+        mov psp, bx
+    }
+    return psp;
+}
+
+/* Builds the path of the TSR build from our own path, V97TSR.EXE -> V97TSR<level>.EXE */
+static bool vfm_loadBuildExePath(u16 psp, char level) {
+    u16 envSegment = *((u16 _far *) (((u32) psp << 16) | 0x2C));
+    char _far *env = (char _far *) ((u32) envSegment << 16);
+    u16 i = 0;
+    u16 dot = 0xFFFF;
+
+    /* Skip the environment strings, the program path follows the double NUL and a word count */
+    while (env[0] != 0 || env[1] != 0) env++;
+    env += 4;
+
+    while (env[i] != 0) {
+        if (i >= VFM_LOAD_PATH_SIZE - 2) return false;
+
+        if (env[i] == '.')                          dot = i;
+        if (env[i] == '\\' || env[i] == ':')        dot = 0xFFFF;
+
+        s_exePath[i] = env[i];
+        i++;
+    }
+
+    if (dot == 0xFFFF) return false;
+
+    /* Insert the level before the extension */
+    s_exePath[i + 1] = 0;
+
+    for (; i > dot; i--) {
+        s_exePath[i] = s_exePath[i - 1];
+    }
+
+    s_exePath[dot] = level;
+    return true;
+}
+
+/* Builds a DOS command tail from our command line */
+static void vfm_loadBuildCmdTail(const char *cmdLine) {
+    u8 len = 0;
+
+    s_cmdTail[1] = ' ';
+
+    while (cmdLine[len] != 0 && len < VFM_LOAD_TAIL_SIZE - 3) {
+        s_cmdTail[len + 2] = cmdLine[len];
+        len++;
+    }
+
+    s_cmdTail[0] = len + 1;
+    s_cmdTail[len + 2] = '\r';
+}
+
+/* Shrinks the loader's memory block to its image (PSP up to the end of the stack) so the child has room */
+static bool vfm_loadShrinkMemory(u16 psp) {
+    u16 paras;
+    u16 err = 0;
+#ifdef DEBUG
+    u16 _ss;
+    u16 _sp;
+
+    _asm {
+        mov _ss, ss
+        mov _sp, sp
+    }
+
+    /* The C library's startup code has its own layout, so this guesses with some headroom */
+    paras = _ss + (_sp >> 4) - psp + 0x100;
+#else
+    u16 _ds;
+
+    _asm mov _ds, ds
+
+    /* DGROUP ends with the stack, everything in front of it belongs to the image */
+    paras = _ds - psp + (u16) (((u32) (u16) &vfm_imageEnd + 15) >> 4);
+#endif
+
+    _asm {
+        push es
+        mov es, psp
+        mov bx, paras
+        mov ah, 0x4A
+        int 0x21
+        pop es
+        jnc _shrinkOk
+        mov err, ax
+    _shrinkOk:
+    }
+
+    return err == 0;
+}
+
+/* Runs the TSR build, returns DOS error code or 0 */
+static u16 vfm_loadExec(u16 psp) {
+    u16 err = 0;
+
+    s_execParams.envSegment = 0;
+    s_execParams.cmdTail    = (char _far *) s_cmdTail;
+    s_execParams.fcb1       = (void _far *) (((u32) psp << 16) | 0x5C);
+    s_execParams.fcb2       = (void _far *) (((u32) psp << 16) | 0x6C);
+
+    _asm {
+        push ds
+        push es
+        push si
+        push di
+        push bp
+        push ds
+        pop es
+        mov dx, offset s_exePath
+        mov bx, offset s_execParams
+        mov ax, 0x4B00
+        int 0x21
+        pop bp
+        pop di
+        pop si
+        pop es
+        pop ds
+        jnc _execOk
+        mov err, ax
+    _execOk:
+    }
+
+    return err;
+}
+
+/* Gets the child's return code */
+static u8 vfm_loadGetReturnCode() {
+    u8 code;
+    _asm {
+        mov ah, 0x4D
+        int 0x21
+        mov code, al
+    }
+    return code;
+}
+
+int vfm_main(const char *cmdLine) {
+    u16 psp = vfm_loadGetPsp();
+
+    if (!vfm_loadBuildExePath(psp, vfm_loadGetCpuLevel())) {
+        vfm_puts("ERROR: Can't find own path!\n");
+        return -1;
+    }
+
+    vfm_loadBuildCmdTail(cmdLine);
+
+    if (!vfm_loadShrinkMemory(psp)) {
+        vfm_puts("ERROR: Can't free memory!\n");
+        return -1;
+    }
+
+    if (vfm_loadExec(psp) != 0) {
+        vfm_puts("ERROR: Can't run ");
+        vfm_puts(s_exePath);
+        vfm_puts("\n");
+        return -1;
+    }
+
+    return vfm_loadGetReturnCode();
+}
+
+#ifdef DEBUG
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        return vfm_main(argv[1]);
+    else
+        return vfm_main("");
+}
+#endif
@@ -19,6 +19,11 @@
 #include "sys.h"
 
 #include "vfm_tsr.h"
+#include "vfm_api.h"
+#include "vfm_cap.h"
+#include "vfm_trc.h"
+#include "vfm_adp.h"
+#include "vfm_cfg.h"
 #include "v97_reg.h"
 #include "version.h"
 
@@ -70,7 +75,7 @@ static void vfm_testToneLoopTest() {
 
     vfm_fmGenerateTestTone();
 
-    vfm_puts("<Key to quit>\n");
+    VFM_PUTS("<Key to quit>\n");
 
     while (!kbhit() && !cancel) {
         while (!cancel && !vfm_tsrHasIntOccurred()) {
@@ -92,7 +97,7 @@ static void vfm_fileLoopTest() {
     u16 bufferSize = vfm_tsrGetDmaBufferSize();
 
     if (0 != _dos_open("test.snd", O_RDONLY, &fileHandle)) {
-        vfm_puts("file open error\n");
+        VFM_PUTS("file open error\n");
         return;
     }
 
@@ -116,7 +121,7 @@ static void vfm_fileLoopTest() {
         _dos_read(fileHandle, dmaBuffer, bufferSize, &bytesRead);
         
         if (bytesRead == 0) {
-            vfm_puts("End of file!\n");
+            VFM_PUTS("End of file!\n");
             break;
         }
 
@@ -132,6 +137,25 @@ static void vfm_fileLoopTest() {
 }
 #endif
 
+/* Asks a resident TSR through the INT 2Fh API */
+static bool vfm_isApiInstalled() {
+    u8  result;
+    u16 signature;
+
+    _asm {
+        push bx
+        mov ah, VFM_API_MPX_ID
+        mov al, VFM_API_INSTALL_CHECK
+        xor bx, bx
+        int 0x2F
+        mov result, al
+        mov signature, bx
+        pop bx
+    }
+
+    return result == 0xFF && signature == VFM_API_SIGNATURE;
+}
+
 /* Attempts to find signature of NMI handler in the code pointed to by the NMI vector. */
 static bool vfm_isTsrLoaded() {
     u32 nmiHandlerSize = vfm_tsrGetNmiHandlerSize();
@@ -142,6 +166,8 @@ static bool vfm_isTsrLoaded() {
     u32 signature[] = { VFM_TSR_SIGNATURE_1, VFM_TSR_SIGNATURE_2 };
     u16 signatureSize = sizeof(signature);
 
+    if (vfm_isApiInstalled()) return true;
+
     /*  NMI vector doesn't exist, clear case
         actually this shouldn't happen, I think, as DOS has a default handler */
     if (nmiFunctionData == NULL) return false;
@@ -172,71 +198,435 @@ static void vfm_dumpDmaBuffers(const char *filename) {
 }
 #endif
 
+static char vfm_toLower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char) (c + ('a' - 'A')) : c;
+}
+
+/* Looks for "/<name>" (case insensitive) in the command line, returns the text following it or NULL */
+static const char *vfm_getOption(const char *cmdLine, const char *name) {
+    for (; *cmdLine; cmdLine++) {
+        const char *c = cmdLine + 1;
+        const char *n = name;
+
+        if (*cmdLine != '/') continue;
+
+        while (*n && vfm_toLower(*c) == *n) {
+            c++;
+            n++;
+        }
+
+        if (*n == 0) return c;
+    }
+
+    return NULL;
+}
+
+/* Checks if an option value (terminated by space or end of line) matches <str> (case insensitive) */
+static bool vfm_optionIs(const char *value, const char *str) {
+    for (; *str; str++, value++) {
+        if (vfm_toLower(*value) != *str) return false;
+    }
+
+    return *value == 0 || *value == ' ';
+}
+
+/* Parses an unsigned decimal number, returns pointer behind it or NULL if there is none */
+static const char *vfm_parseDec(const char *str, u16 *val) {
+    const char *start = str;
+
+    *val = 0;
+
+    while (*str >= '0' && *str <= '9' && *val < 10000) {
+        *val = *val * 10 + (u16) (*str - '0');
+        str++;
+    }
+
+    return str == start ? NULL : str;
+}
+
+/* Parses a capture buffer size option, false if it is invalid */
+static bool vfm_parseCaptureKb(const char *cmdLine, const char *name, u16 *kb) {
+    const char *value = vfm_getOption(cmdLine, name);
+
+    if (value == NULL) return true;
+
+    value = vfm_parseDec(value, kb);
+
+    return value != NULL && (*value == 0 || *value == ' ')
+        && *kb >= VFM_CAP_MIN_KB && *kb <= VFM_CAP_MAX_KB;
+}
+
+/* Checks that an option value ends at <value> (space or end of line), NULL = it didn't parse */
+static bool vfm_optionEnds(const char *value) {
+    return value != NULL && (*value == 0 || *value == ' ');
+}
+
+/* Parses the value of /core:, false if the core is unknown */
+static bool vfm_parseCore(const char *value, vfm_CoreType *core) {
+    if (vfm_optionIs(value, "dbopl")) {
+        *core = VFM_CORE_DBOPL;
+    } else if (vfm_optionIs(value, "nuked")) {
+        *core = VFM_CORE_NUKED;
+    } else {
+        VFM_PUTS("ERROR: Unknown core, use /core:dbopl or /core:nuked\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Parses the value of /buf:<samples>,<buffers>, false if it is invalid */
+static bool vfm_parseBuffers(const char *value, u16 *sampsPerBuf, u16 *numBufs) {
+    value = vfm_parseDec(value, sampsPerBuf);
+    if (value != NULL && *value == ',') {
+        value = vfm_parseDec(value + 1, numBufs);
+    } else {
+        value = NULL;
+    }
+
+    if (!vfm_optionEnds(value)
+     || *sampsPerBuf < 2 || *sampsPerBuf > SAMPS_PER_BUF
+     || *numBufs < 2 || *numBufs > NUM_BUFS) {
+        VFM_PUTS("ERROR: Invalid buffer settings, check the limits of this build\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Parses what follows /adapt ([:<percent>]), false if it is invalid */
+static bool vfm_parseAdapt(const char *value, u16 *adaptPct) {
+    *adaptPct = VFM_ADAPT_DEFAULT_PCT;
+
+    if (*value == ':') {
+        value = vfm_parseDec(value + 1, adaptPct);
+    }
+
+    if (!vfm_optionEnds(value) || *adaptPct < VFM_ADAPT_MIN_PCT || *adaptPct > VFM_ADAPT_MAX_PCT) {
+        VFM_PUTS("ERROR: Invalid adaptive quality budget, use /adapt or /adapt:<10-100>\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Parses the value of /poly:, false if it is invalid */
+static bool vfm_parsePoly(const char *value, u16 *voiceLimit) {
+    value = vfm_parseDec(value, voiceLimit);
+
+    if (!vfm_optionEnds(value) || *voiceLimit < 1 || *voiceLimit > 18) {
+        VFM_PUTS("ERROR: Invalid polyphony limit, use /poly:<1-18>\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Parses the load time settings from the command line */
+static bool vfm_parseConfig(const char *cmdLine, vfm_TsrConfig *config) {
+    const char *value;
+
+    config->core            = VFM_CORE_DEFAULT;
+    config->coreExplicit    = false;
+    config->sampsPerBuf     = 0;
+    config->numBufs         = 0;
+    config->captureKb       = 0;
+    config->captureOutKb    = 0;
+    config->halfRate        = vfm_getOption(cmdLine, "half") != NULL;
+    config->adaptPct        = 0;
+    config->voiceLimit      = 0;
+
+    value = vfm_getOption(cmdLine, "core:");
+    if (value != NULL) {
+        if (!vfm_parseCore(value, &config->core)) return false;
+        config->coreExplicit = true;
+    }
+
+    /* /buf:<samples>,<buffers> skips the calibration */
+    value = vfm_getOption(cmdLine, "buf:");
+    if (value != NULL) {
+        if (!vfm_parseBuffers(value, &config->sampsPerBuf, &config->numBufs)) return false;
+
+        if (config->halfRate && (config->sampsPerBuf & 1)) {
+            VFM_PUTS("ERROR: Half rate synthesis needs an even number of samples per buffer\n");
+            return false;
+        }
+    }
+
+    /* /adapt[:<percent>] lowers the quality when rendering takes longer than that share of a block */
+    value = vfm_getOption(cmdLine, "adapt");
+    if (value != NULL && !vfm_parseAdapt(value, &config->adaptPct)) {
+        return false;
+    }
+
+    /* /poly:<voices> caps the voices rendered at once */
+    value = vfm_getOption(cmdLine, "poly:");
+    if (value != NULL && !vfm_parsePoly(value, &config->voiceLimit)) {
+        return false;
+    }
+
+    /* /cap:<KB> records the register writes to XMS, /capout:<KB> the rendered output */
+    if (!vfm_parseCaptureKb(cmdLine, "cap:", &config->captureKb)
+     || !vfm_parseCaptureKb(cmdLine, "capout:", &config->captureOutKb)) {
+        VFM_PUTS("ERROR: Invalid capture buffer size\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*  Parses the options of the set command, the settings that aren't given stay VFM_API_KEEP.
+    Same options as at load time, /half, /adapt and /poly also take :off */
+static bool vfm_parseSetConfig(const char *cmdLine, vfm_ApiConfig *config) {
+    const char *value;
+    vfm_CoreType core;
+
+    config->sampsPerBuf     = VFM_API_KEEP;
+    config->numBufs         = VFM_API_KEEP;
+    config->core            = VFM_API_KEEP;
+    config->halfRate        = VFM_API_KEEP;
+    config->voiceLimit      = VFM_API_KEEP;
+    config->adaptPct        = VFM_API_KEEP;
+    config->timeHz          = 0;
+
+    value = vfm_getOption(cmdLine, "core:");
+    if (value != NULL) {
+        if (!vfm_parseCore(value, &core)) return false;
+        config->core = (u16) core;
+    }
+
+    value = vfm_getOption(cmdLine, "buf:");
+    if (value != NULL && !vfm_parseBuffers(value, &config->sampsPerBuf, &config->numBufs)) {
+        return false;
+    }
+
+    value = vfm_getOption(cmdLine, "half");
+    if (value != NULL) {
+        config->halfRate = vfm_optionIs(value, ":off") ? 0 : 1;
+
+        if (config->halfRate && !vfm_optionEnds(value)) {
+            VFM_PUTS("ERROR: Use /half or /half:off\n");
+            return false;
+        }
+    }
+
+    value = vfm_getOption(cmdLine, "adapt");
+    if (value != NULL) {
+        if (vfm_optionIs(value, ":off")) {
+            config->adaptPct = 0;
+        } else if (!vfm_parseAdapt(value, &config->adaptPct)) {
+            return false;
+        }
+    }
+
+    value = vfm_getOption(cmdLine, "poly:");
+    if (value != NULL) {
+        if (vfm_optionIs(value, "off")) {
+            config->voiceLimit = 0;
+        } else if (!vfm_parsePoly(value, &config->voiceLimit)) {
+            return false;
+        }
+    }
+
+    if (vfm_getOption(cmdLine, "cap") != NULL) {
+        VFM_PUTS("ERROR: Captures can only be set up at load time\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Changes the settings of the resident TSR, "set <options>", shows them without options */
+static bool vfm_setConfig(const char *cmdLine) {
+    vfm_ApiConfig config;
+
+    if (!vfm_parseSetConfig(cmdLine, &config)) return false;
+
+    return vfm_cfgChange(&config);
+}
+
+/* Checks if <filename> ends in .<ext> (three lower case letters) */
+static bool vfm_hasExtension(const char *filename, u16 len, const char *ext) {
+    return len > 4 && filename[len - 4] == '.'
+        && vfm_toLower(filename[len - 3]) == ext[0]
+        && vfm_toLower(filename[len - 2]) == ext[1]
+        && vfm_toLower(filename[len - 1]) == ext[2];
+}
+
+/* Gets the file name argument of a command into <filename> (<size> bytes), returns its length, 0 if there is none */
+static u16 vfm_getFilename(const char *cmdLine, char *filename, u16 size) {
+    u16 len = 0;
+
+    while (*cmdLine == ' ') cmdLine++;
+
+    while (cmdLine[len] != 0 && cmdLine[len] != ' ' && len < size - 1) {
+        filename[len] = cmdLine[len];
+        len++;
+    }
+
+    filename[len] = 0;
+
+    if (len == 0) {
+        VFM_PUTS("ERROR: No file name given\n");
+    }
+
+    return len;
+}
+
+/*  Dumps a capture of the resident TSR, "d <file>". Files ending in .wav get the output capture,
+    files ending in .dro the register capture as DRO, everything else the register capture as DBGREG */
+static bool vfm_dumpCapture(const char *cmdLine) {
+    char filename[80];
+    vfm_CapFormat format = VFM_CAP_FMT_DBGREG;
+    u16 len = vfm_getFilename(cmdLine, filename, sizeof(filename));
+
+    if (len == 0) return false;
+
+    if (vfm_hasExtension(filename, len, "dro")) {
+        format = VFM_CAP_FMT_DRO;
+    } else if (vfm_hasExtension(filename, len, "wav")) {
+        format = VFM_CAP_FMT_WAV;
+    }
+
+    if (!vfm_capDump(filename, format)) return false;
+
+    VFM_PUTS("Capture written to ");
+    vfm_puts(filename);
+    VFM_PUTS("\n");
+    return true;
+}
+
+#ifdef VFM_TRACE
+/* Dumps the event trace of the resident TSR, "t <file>" */
+static bool vfm_dumpTrace(const char *cmdLine) {
+    char filename[80];
+
+    if (vfm_getFilename(cmdLine, filename, sizeof(filename)) == 0) return false;
+    if (!vfm_traceDump(filename)) return false;
+
+    VFM_PUTS("Trace written to ");
+    vfm_puts(filename);
+    VFM_PUTS("\n");
+    return true;
+}
+#endif
+
 static void printUsage() {
-    vfm_puts("r   Load TSR\n");
-    vfm_puts("<for debugging only:>\n");
-    vfm_puts("g   Init, play test tone and wait for key press\n");
-    vfm_puts("p   Sends a test tone to OPL (no hw init)\n");
+    VFM_PUTS("r   Load TSR\n");
+    VFM_PUTS("d <file>  Dump capture: .wav = output, .dro = registers as DRO, else DBGREG\n");
+    VFM_PUTS("q   Show the adaptive quality state\n");
+    VFM_PUTS("set <options>  Change the settings of the loaded TSR (/core /buf /half /adapt /poly,\n");
+    VFM_PUTS("               :off turns off /half, /adapt and /poly), show them without options\n");
+#ifdef VFM_TRACE
+    VFM_PUTS("t <file>  Dump event trace\n");
+#endif
+    VFM_PUTS("<for debugging only:>\n");
+    VFM_PUTS("g   Init, play test tone and wait for key press\n");
+    VFM_PUTS("p   Sends a test tone to OPL (no hw init)\n");
+    VFM_PUTS("<options:>\n");
+    VFM_PUTS("/core:dbopl   DOSBox OPL core (fast)\n");
+    VFM_PUTS("/core:nuked   Nuked-OPL3 core (accurate, needs a fast CPU)\n");
+    VFM_PUTS("/buf:S,N      S samples x N DMA buffers (default: calibrate at load)\n");
+    VFM_PUTS("/half         Synthesize at 12 kHz and upsample (less CPU load, duller sound)\n");
+    VFM_PUTS("/adapt[:P]    Lower the quality when rendering takes over P% of a block (default 70)\n");
+    VFM_PUTS("/poly:N       Render at most N voices at once, the quietest are dropped (DBOPL)\n");
+    VFM_PUTS("/cap:KB       Capture register writes to a KB sized buffer in XMS\n");
+    VFM_PUTS("/capout:KB    Capture the rendered output to a KB sized buffer in XMS\n");
 #ifdef DBG_FILE
-    vfm_puts("f   Plays raw PCM S16LE file (test.snd)\n");
+    VFM_PUTS("f   Plays raw PCM S16LE file (test.snd)\n");
 #endif
 
 }
 
 int vfm_main(const char *cmdLine) {
     pci_Device  dev;
+    vfm_TsrConfig config;
     bool        tsrIsLoaded = vfm_isTsrLoaded();
 
-    vfm_puts("VIA_AC97.866     - VIA AC'97 FM Emulation TSR Version " V97_VERSION "\n");
-    vfm_puts("                   (C) 2025      Eric Voirin (oerg866)\n");
-#if defined(NUKED)
-    vfm_puts("Nuked-OPL3       - (C) 2013-2020 Nuke.YKT\n");
-#elif defined (DBOPL)
-    vfm_puts("DBOPL            - (C) 2002-2021 The DOSBox Team\n");
+    VFM_PUTS("VIA_AC97.866     - VIA AC'97 FM Emulation TSR Version " V97_VERSION "\n");
+    VFM_PUTS("                   (C) 2025      Eric Voirin (oerg866)\n");
+    VFM_PUTS("DBOPL            - (C) 2002-2021 The DOSBox Team\n");
+    VFM_PUTS("Nuked-OPL3       - (C) 2013-2020 Nuke.YKT\n");
+#if CPU_LEVEL >= 6
+    VFM_PUTS("Build            - MMX (Pentium MMX/II/III, K6, Athlon)\n");
+#elif CPU_LEVEL >= 5
+    VFM_PUTS("Build            - Pentium\n");
+#else
+    VFM_PUTS("Build            - 386/486\n");
 #endif
-    vfm_puts("\n");
+    VFM_PUTS("\n");
 
     if (cmdLine[0] == 0) {
         printUsage();
         return 1;
     }
 
+    /* check if program should change the settings of the resident TSR, it has options of its own */
+    if (cmdLine[0] == 's') {
+        return vfm_setConfig(cmdLine + 1) ? 0 : -1;
+    }
+
+    if (!vfm_parseConfig(cmdLine, &config)) {
+        return -1;
+    }
+
     /* check if program should send a test tone to OPL (not necessarily our device) */
     if (cmdLine[0] == 'p') {
         vfm_fmGenerateTestTone();
-        vfm_puts("OPL test tone sent\n");
+        VFM_PUTS("OPL test tone sent\n");
         return 0;
     }
 
 #ifdef DBG_BENCH
     /* check if program should do a OPL3 generation test & benchmark */
     if (cmdLine[0] == 'o') {
-        vfm_tsrOplTest();
+        vfm_tsrOplTest(&config);
         return 0;
     }
 #endif
 
+    /* check if program should dump the register capture of the resident TSR */
+    if (cmdLine[0] == 'd') {
+        return vfm_dumpCapture(cmdLine + 1) ? 0 : -1;
+    }
+
+    /* check if program should show the adaptive quality state of the resident TSR */
+    if (cmdLine[0] == 'q') {
+        return vfm_adaptPrint() ? 0 : -1;
+    }
+
+#ifdef VFM_TRACE
+    /* check if program should dump the event trace of the resident TSR */
+    if (cmdLine[0] == 't') {
+        return vfm_dumpTrace(cmdLine + 1) ? 0 : -1;
+    }
+#endif
+
     /* Abort if the TSR is already loaded */
     if (tsrIsLoaded) {
-        vfm_puts("The TSR is already loaded. Aborting...\n");
+        VFM_PUTS("The TSR is already loaded. Aborting...\n");
         return -1;
     }
 
     /* Check if PCI bus is accessible on this machine */
     if (!pci_test()) {
-        vfm_puts("PCI Bus Error\n");
+        VFM_PUTS("PCI Bus Error\n");
         return -1;
     }
 
     /* Check for VIA 686x Audio Device on the bus */
     if (!pci_findDevByID(0x1106, 0x3058, &dev)) {
-        vfm_puts("Audio Device not found\n");
+        VFM_PUTS("Audio Device not found\n");
         return -1;
     }
 
+    VFM_PUTS("Using ");
+    vfm_puts(vfm_coreGetName(config.core));
+    VFM_PUTS(" core\n");
+
     /* Set up the TSR's specific stuff - SB Mixer, Interrupt vectors, DMA tables, buffers */
-    if (!vfm_tsrInitialize(dev)) {
-        vfm_puts("Aborting...\n");
+    if (!vfm_tsrInitialize(dev, &config)) {
+        VFM_PUTS("Aborting...\n");
         return -1;
     }
     
@@ -249,6 +639,9 @@ int vfm_main(const char *cmdLine) {
 
     /* check if program should do a basic fm generation test */
     if (cmdLine[0] == 'g') {
+#ifdef DBG_BENCH
+        vfm_tsrNmiBench();
+#endif
         vfm_testToneLoopTest();
 
 #ifdef DBG_BUFFER
@@ -265,7 +658,7 @@ int vfm_main(const char *cmdLine) {
 #endif
 
     /* Done! :D */
-    vfm_puts("[Finished]\n");
+    VFM_PUTS("[Finished]\n");
 
     vfm_tsrCleanup();
     return 0;
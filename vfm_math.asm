@@ -0,0 +1,110 @@
+; VIA_AC97.866 FM Emulation TSR
+;
+; (C) 2025 Eric Voirin (Oerg866)
+;
+; LICENSE: CC-BY-NC-SA 4.0
+;
+; MS C-Library 32-bit math helpers for non-debug builds
+;
+; These are called by the OPL cores at run time, so unlike vfm_clib.asm
+; this module is part of the resident TSR.
+;
+
+IFNDEF DEBUG
+
+    .model small, c
+    .586p
+
+    .code
+
+; Signed Long Multiplication
+; dx:ax = _a * _b
+_aNlmul         proc C a:DWORD, b:DWORD
+    mov     eax, a          ; Load first operand into EAX
+    mul     b               ; Multiply: (EDX:EAX) = EAX * B
+    mov     edx, eax
+    shr     edx, 16
+    and     eax, 0ffffh
+    ret                     ; Return (DX:AX layout)
+_aNlmul         endp
+
+; Unsigned Long Multiplication
+; dx:ax = _a * _b
+_aNulmul        proc C a:DWORD, b:DWORD
+    mov     eax, a          ; Load first operand into EAX
+    mul     b               ; Multiply: (EDX:EAX) = EAX * B
+    mov     edx, eax
+    shr     edx, 16
+    and     eax, 0ffffh
+    ret                     ; Return (DX:AX layout)
+_aNulmul endp
+
+; Signed Long Shift Left
+; dx:ax <<= cl
+_aNlshl         proc near
+    shl     edx, 16
+    mov     dx, ax
+    sal     edx, cl
+    mov     ax, dx
+    shr     edx, 16
+    ret
+_aNlshl         endp
+
+; Unsigned Long Shift Right
+; dx:ax >>= cl
+_aNulshr        proc near
+    shl     edx, 16
+    mov     dx, ax
+    shr     edx, cl
+    mov     ax, dx
+    shr     edx, 16
+    ret
+_aNulshr        endp
+
+; Unsigned Long Division
+; uint32_t aNuldiv(uint32_t _a, uint32_t b)
+; dx:ax = _a / _b
+_aNuldiv        proc C _a:DWORD, _b:DWORD
+    push    ebx
+    mov     eax, _a
+    mov     ebx, _b
+    xor     edx, edx
+
+    ; Perform 32-bit division: EDX:EAX / EBX
+    div     ebx
+    ; EAX = quotient, EDX = remainder
+
+    ; Return the result in DX:AX
+    mov     edx, eax
+    shr     edx, 16     ; High word
+    and     eax, 0ffffh ; Low word
+    
+    pop     ebx
+    ret
+_aNuldiv       endp
+
+; Unsigned Long Remainder
+; uint32_t aNulrem(uint32_t _a, uint32_t b)
+; dx:ax = remainder of _a / _b
+_aNulrem       proc C _a:DWORD, _b:DWORD
+    push    ebx 
+    mov     eax, _a
+    mov     ebx, _b
+    xor     edx, edx
+
+    ; Perform 32-bit division: EDX:EAX / EBX
+    div     ebx
+    ; EAX = quotient, EDX = remainder
+
+    ; Return the remainder in DX:AX
+    mov     eax, edx
+    shr     edx, 16     ; High word
+    and     eax, 0ffffh ; Low word
+    
+    pop     ebx
+    ret
+_aNulrem       endp
+
+ENDIF
+
+    END
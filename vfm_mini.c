@@ -193,9 +193,8 @@ void sys_serialSend(const u8 *byte, u16 length) {
 #endif
 
 
-static char tmpBuf[80];
-
-void vfm_puts(const char *str) {
+void vfm_puts(const char _far *str) {
+    char tmpBuf[80];    /* On the stack, so it isn't kept in DGROUP when resident */
     u16 i = 0;
 
     while (1) {
@@ -212,12 +211,26 @@ void vfm_puts(const char *str) {
     tmpBuf[i] = '$';
 
     _asm {
-        mov dx, offset tmpBuf
+        lea dx, tmpBuf
 		mov ah, 0x09
 		int 0x21
     }
 }
 
+void vfm_putDec(u16 val) {
+    char str[6];
+    char *c = str + sizeof(str) - 1;
+
+    *c = 0;
+
+    do {
+        *--c = (char) ('0' + val % 10);
+        val /= 10;
+    } while (val);
+
+    vfm_puts(c);
+}
+
 bool vfm_vdsIsSupported() {
     u8 _far *vdfFlagBytePtr = MK_FP(0x40, 0x7b); /* 040:007b, bit 5 = VDS support */
     u8 errorCode = 0;
@@ -0,0 +1,271 @@
+; VIA_AC97.866 FM Emulation TSR
+;
+; (C) 2025 Eric Voirin (Oerg866)
+;
+; LICENSE: CC-BY-NC-SA 4.0
+;
+; CPU feature detection & CPU specific mixing kernels
+
+    .model small, c
+    .586p
+
+    INCLUDE vfm_mmx.inc
+
+    .code
+
+; u32 vfm_cpuGetFeatures(void)
+; Returns the CPUID function 1 feature flags (EDX) in DX:AX, 0 if there is no CPUID
+vfm_cpuGetFeatures PROC C
+    push ebx
+
+    ; CPUID is there if the ID bit (21) of EFLAGS can be toggled
+    pushfd
+    pop eax
+    mov ecx, eax
+    xor eax, 200000h
+    push eax
+    popfd
+    pushfd
+    pop eax
+    push ecx            ; Restore original EFLAGS
+    popfd
+    xor eax, ecx
+    test eax, 200000h
+    jz _noCpuid
+
+    mov eax, 1
+    CPUID_
+    mov ax, dx
+    shr edx, 16         ; DX:AX = feature flags
+    jmp _cpuidDone
+
+_noCpuid:
+    xor ax, ax
+    xor dx, dx
+
+_cpuidDone:
+    pop ebx
+    ret
+vfm_cpuGetFeatures ENDP
+
+; void vfm_upsample2x(i16 *buf, u16 samples, i16 *last)
+; Doubles the rate of <samples> stereo samples stored in the second half of <buf>, in place
+; Every sample is preceded by the average of it and the one before it (<last>, updated with the
+; final sample of the block), so the output runs half an input sample behind
+vfm_upsample2x PROC C USES si di, buf:PTR WORD, samples:WORD, last:PTR WORD
+    mov di, buf
+    mov cx, samples
+    or cx, cx
+    jz _upDone
+
+    mov si, cx
+    shl si, 2
+    add si, di          ; Input = second half of the block
+
+    mov bx, last
+    movsx eax, WORD PTR [bx]
+    movsx edx, WORD PTR [bx+2]
+
+    ; Output sample 2k+1 is written where input sample k is read in the last iteration,
+    ; everything else lands on input samples that were already read
+_upLoop:
+    movsx ebx, WORD PTR [si]
+    add eax, ebx
+    sar eax, 1
+    mov [di], ax        ; Left, average
+    mov [di+4], bx      ; Left
+    mov eax, ebx
+
+    movsx ebx, WORD PTR [si+2]
+    add edx, ebx
+    sar edx, 1
+    mov [di+2], dx      ; Right, average
+    mov [di+6], bx      ; Right
+    mov edx, ebx
+
+    add si, 2*2
+    add di, 2*2*2
+    dec cx
+    jnz _upLoop
+
+    mov bx, last
+    mov [bx], ax
+    mov [bx+2], dx
+
+_upDone:
+    ret
+vfm_upsample2x ENDP
+
+; void vfm_pack32(i16 *output, const i32 *input, u16 count)
+; Saturates <count> 32-bit samples to 16 bits, 386 version of vfm_mmxPack32
+vfm_pack32 PROC C USES si di, output:PTR WORD, input:PTR DWORD, count:WORD
+    mov di, output
+    mov si, input
+    mov cx, count
+    or cx, cx
+    jz _p32Done
+
+_p32Loop:
+    mov eax, [si]
+    movsx edx, ax
+    cmp eax, edx
+    je _p32Store        ; Fits into 16 bits
+    sar eax, 31         ; 0 if positive, -1 if negative
+    xor ax, 7FFFh       ; 7FFFh or 8000h
+_p32Store:
+    mov [di], ax
+    add si, 4
+    add di, 2
+    dec cx
+    jnz _p32Loop
+
+_p32Done:
+    ret
+vfm_pack32 ENDP
+
+IF CPU_LEVEL EQ 5
+
+; void vfm_p5MixChannel(i32 *output, const i16 *input, u16 samples, i16 maskLeft, i16 maskRight)
+; Scalar mixer for the Pentium, adds a mono block into a stereo block of 32-bit samples
+; Panning is resolved outside of the loops, so they only load, extend and add
+vfm_p5MixChannel PROC C USES si di, output:PTR DWORD, input:PTR WORD, samples:WORD, maskLeft:WORD, maskRight:WORD
+    mov di, output
+    mov si, input
+    mov cx, samples
+    or cx, cx
+    jz _p5Done
+
+    mov ax, maskLeft
+    and ax, maskRight
+    jnz _p5Both
+
+    cmp maskLeft, 0
+    jne _p5One
+    cmp maskRight, 0
+    je _p5Done
+    add di, 4           ; Right only: same as left only, one dword further
+
+_p5One:
+    movsx eax, WORD PTR [si]
+    add si, 2
+    add [di], eax
+    add di, 2*4
+    dec cx
+    jnz _p5One
+    jmp _p5Done
+
+_p5Both:
+    movsx eax, WORD PTR [si]
+    add si, 2
+    add [di], eax
+    add [di+4], eax
+    add di, 2*4
+    dec cx
+    jnz _p5Both
+
+_p5Done:
+    ret
+vfm_p5MixChannel ENDP
+
+ENDIF
+
+IF CPU_LEVEL GE 6
+
+; void vfm_mmxMixChannel(i32 *output, const i16 *input, u16 samples, i16 maskLeft, i16 maskRight)
+; Adds a mono block into a stereo block of 32-bit samples, masks are 0 or -1 per side
+; Drop-in for the DBOPL mix handler. Leaves MMX state dirty, caller has to EMMS!
+vfm_mmxMixChannel PROC C USES si di, output:PTR DWORD, input:PTR WORD, samples:WORD, maskLeft:WORD, maskRight:WORD
+    mov di, output
+    mov si, input
+
+    ; MM7 = maskLeft | maskRight as dwords
+    movsx eax, maskLeft
+    MMX_RR      MMX_OP_MOVD_LOAD,   7, MMX_GPR_EAX      ; movd mm7, eax
+    movsx eax, maskRight
+    MMX_RR      MMX_OP_MOVD_LOAD,   6, MMX_GPR_EAX      ; movd mm6, eax
+    MMX_RR      MMX_OP_PUNPCKLDQ,   7, 6                ; punpckldq mm7, mm6
+
+    mov cx, samples
+    mov bx, cx
+    shr cx, 1           ; 2 mono samples per iteration
+    jz _mixTail
+
+_mix2:
+    MMX_RM      MMX_OP_MOVD_LOAD,   0, MMX_RM_SI        ; movd mm0, [si]        ; s0 s1
+    MMX_RR      MMX_OP_PUNPCKLWD,   0, 0                ; punpcklwd mm0, mm0    ; s0 s0 s1 s1
+    MMX_RR      MMX_OP_MOVQ_LOAD,   1, 0                ; movq mm1, mm0
+    MMX_RR      MMX_OP_PUNPCKLWD,   0, 0                ; punpcklwd mm0, mm0    ; s0 s0 s0 s0
+    MMX_RR      MMX_OP_PUNPCKHWD,   1, 1                ; punpckhwd mm1, mm1    ; s1 s1 s1 s1
+    MMX_RI      MMX_OP_PSRAD_IMM,   MMX_EXT_PSRAD, 0, 16 ; psrad mm0, 16        ; s0 s0 (dwords)
+    MMX_RI      MMX_OP_PSRAD_IMM,   MMX_EXT_PSRAD, 1, 16 ; psrad mm1, 16        ; s1 s1 (dwords)
+    MMX_RR      MMX_OP_PAND,        0, 7                ; pand mm0, mm7
+    MMX_RR      MMX_OP_PAND,        1, 7                ; pand mm1, mm7
+    MMX_RM      MMX_OP_PADDD,       0, MMX_RM_DI        ; paddd mm0, [di]
+    MMX_RMD8    MMX_OP_PADDD,       1, MMX_RM_DI, 8     ; paddd mm1, [di+8]
+    MMX_RM      MMX_OP_MOVQ_STORE,  0, MMX_RM_DI        ; movq [di], mm0
+    MMX_RMD8    MMX_OP_MOVQ_STORE,  1, MMX_RM_DI, 8     ; movq [di+8], mm1
+    add si, 2*2
+    add di, 2*2*4
+    dec cx
+    jnz _mix2
+
+_mixTail:
+    test bx, 1
+    jz _mixDone
+
+    movzx eax, word ptr [si]
+    MMX_RR      MMX_OP_MOVD_LOAD,   0, MMX_GPR_EAX      ; movd mm0, eax
+    MMX_RR      MMX_OP_PUNPCKLWD,   0, 0                ; punpcklwd mm0, mm0    ; s0 s0
+    MMX_RR      MMX_OP_PUNPCKLWD,   0, 0                ; punpcklwd mm0, mm0    ; s0 s0 s0 s0
+    MMX_RI      MMX_OP_PSRAD_IMM,   MMX_EXT_PSRAD, 0, 16 ; psrad mm0, 16        ; s0 s0 (dwords)
+    MMX_RR      MMX_OP_PAND,        0, 7                ; pand mm0, mm7
+    MMX_RM      MMX_OP_PADDD,       0, MMX_RM_DI        ; paddd mm0, [di]
+    MMX_RM      MMX_OP_MOVQ_STORE,  0, MMX_RM_DI        ; movq [di], mm0
+
+_mixDone:
+    ret
+vfm_mmxMixChannel ENDP
+
+; void vfm_mmxPack32(i16 *output, const i32 *input, u16 count)
+; Saturates <count> 32-bit samples to 16 bits. Count must be even (stereo)
+; Leaves MMX state dirty, caller has to EMMS!
+vfm_mmxPack32 PROC C USES si di, output:PTR WORD, input:PTR DWORD, count:WORD
+    mov di, output
+    mov si, input
+
+    mov cx, count
+    mov bx, cx
+    shr cx, 2           ; 4 samples per iteration
+    jz _packTail
+
+_pack4:
+    MMX_RM      MMX_OP_MOVQ_LOAD,   0, MMX_RM_SI        ; movq mm0, [si]
+    MMX_RMD8    MMX_OP_PACKSSDW,    0, MMX_RM_SI, 8     ; packssdw mm0, [si+8]
+    MMX_RM      MMX_OP_MOVQ_STORE,  0, MMX_RM_DI        ; movq [di], mm0
+    add si, 4*4
+    add di, 4*2
+    dec cx
+    jnz _pack4
+
+_packTail:
+    test bx, 2
+    jz _packDone
+
+    MMX_RM      MMX_OP_MOVQ_LOAD,   0, MMX_RM_SI        ; movq mm0, [si]
+    MMX_RR      MMX_OP_PACKSSDW,    0, 0                ; packssdw mm0, mm0
+    MMX_RM      MMX_OP_MOVD_STORE,  0, MMX_RM_DI        ; movd [di], mm0
+
+_packDone:
+    ret
+vfm_mmxPack32 ENDP
+
+; void vfm_mmxEmms(void)
+; Marks the FPU registers as free again after using MMX
+vfm_mmxEmms PROC C
+    EMMS_
+    ret
+vfm_mmxEmms ENDP
+
+ENDIF
+
+    END
@@ -11,11 +11,9 @@
 
     .data
 
-IFDEF NUKED
 ; externals from opl3.c
 EXTERN exprom: WORD
 EXTERN logsinrom: WORD
-ENDIF
     .code
 __ldiv PROC C _out: PTR DWORD, _a:DWORD, _b:DWORD 
     push edx
@@ -189,9 +187,7 @@ noAdj:
     ret
 __printHexDigit ENDP
 
-IFDEF DBOPL
-; Nothing yet
-ELSE
+; Nuked-OPL3 helpers
 OPL3_ClipSampleFast PROC C sample:DWORD
     push ebx
     mov ebx, sample    
@@ -457,6 +453,4 @@ _sin7no200:
     ret    
 OPL3_EnvelopeCalcSin7Fast ENDP
 
-ENDIF
-
     END
\ No newline at end of file
@@ -0,0 +1,81 @@
+; VIA_AC97.866 FM Emulation TSR
+;
+; (C) 2025 Eric Voirin (Oerg866)
+;
+; LICENSE: CC-BY-NC-SA 4.0
+;
+; End of the resident part of the TSR with DBOPL
+;
+; The makefile links this right after everything the TSR needs once it is
+; resident with DBOPL (interrupt handlers, mixing kernels, DBOPL) and in front
+; of Nuked-OPL3, which is only kept when it is the selected core. vfm_rnuk.asm
+; after it marks the end of the resident code with both cores, the code that
+; is only used at load time follows. Loading with Nuked-OPL3 keeps DBOPL as
+; well: the cores are called through absolute offsets and call the resident
+; helpers with relative near calls, so neither can be moved down after linking.
+; The data marker is the first thing in the stack segment, which comes after
+; all other data in DGROUP. The tables and chip state of both cores are data,
+; so they stay either way.
+;
+; Everything in DGROUP in front of the marker is kept. The small model puts all
+; near data into the one segment the resident code addresses with fixed offsets,
+; so the load time modules (vfm_main.c, vfm_tsr.c, ...) keep their messages and
+; tables in their code segment instead (VFM_TEXT, VFM_PUTS in vfm_tsr.h), which
+; is dropped with the init code. Only their option names and a few small
+; variables are left in DGROUP.
+;
+; Memory layout at load time:   PSP | resident code | DBOPL | Nuked | init code | data | stack
+; Memory layout when resident:  PSP | resident code | DBOPL | (Nuked) | data
+
+    .model small, c
+    .586p
+
+STACK SEGMENT PARA STACK 'STACK'
+PUBLIC vfm_residentDataEnd
+vfm_residentDataEnd LABEL BYTE
+STACK ENDS
+
+DGROUP GROUP STACK
+
+    .code
+
+EXTERN g_vfm_dataSeg: WORD
+
+; void vfm_residentMoveAndKeep(u16 newDataSeg, u16 dataSize, u16 paras, u16 sgdCtrlPort, u8 sgdCtrl)
+; Copies the data down to newDataSeg (right behind the resident code), writes sgdCtrl to
+; sgdCtrlPort to start the DMA engine and goes resident with <paras> paragraphs. Doesn't return!
+; This has to be resident code itself, as the data is copied over the init code.
+vfm_residentMoveAndKeep PROC C newDataSeg:WORD, dataSize:WORD, paras:WORD, sgdCtrlPort:WORD, sgdCtrl:BYTE
+    cli
+    cld
+
+    ; The destination is below the source, so copying upwards is fine
+    mov ax, newDataSeg
+    mov es, ax
+    xor si, si
+    xor di, di
+    mov cx, dataSize
+    rep movsb
+
+    ; From now on the interrupt handlers use the new copy.
+    ; The stack (SS) is above the copied data, so the arguments are still there.
+    mov word ptr cs:[g_vfm_dataSeg], ax
+    mov ds, ax
+
+    mov dx, sgdCtrlPort
+    mov al, sgdCtrl
+    out dx, al
+
+    sti
+
+    mov dx, paras
+    mov ax, 3100h
+    int 21h
+vfm_residentMoveAndKeep ENDP
+
+; void vfm_residentDboplEnd(void)
+; Dummy function for a pointer to the end of the resident code without Nuked-OPL3
+vfm_residentDboplEnd PROC NEAR C
+vfm_residentDboplEnd ENDP
+
+    END
@@ -0,0 +1,22 @@
+; VIA_AC97.866 FM Emulation TSR
+;
+; (C) 2025 Eric Voirin (Oerg866)
+;
+; LICENSE: CC-BY-NC-SA 4.0
+;
+; End of the resident part of the TSR with Nuked-OPL3
+;
+; The makefile links this right after Nuked-OPL3, which comes after DBOPL
+; and vfm_rend.asm, so both cores are kept when Nuked-OPL3 is selected.
+
+    .model small, c
+    .586p
+
+    .code
+
+; void vfm_residentCodeEnd(void)
+; Dummy function for a pointer to the end of the resident code with both cores
+vfm_residentCodeEnd PROC NEAR C
+vfm_residentCodeEnd ENDP
+
+    END
@@ -0,0 +1,76 @@
+#ifndef _VFM_TRC_H_
+#define _VFM_TRC_H_
+
+#include "types.h"
+
+/*  Event trace (TRACE=1 in the makefile, TRACE=2 adds the progress marks of Nuked-OPL3)
+    The interrupt handlers record timestamped events into a ring buffer in resident memory.
+    "V97TSR t <file>" saves it, tools/trc2json.c turns that into a Chrome trace (chrome://tracing).
+    Timestamps are the TSC on CPU=5/6 builds, PIT clocks (1193182 Hz, assuming the BIOS timer rate)
+    within the BIOS tick on CPU=3 builds. Only the low 32 bits are kept. */
+
+/* Events in the ring buffer, same as VFM_TRACE_EVENTS in vfm_icmn.asm */
+#define VFM_TRACE_EVENTS        2048
+
+/* Event types and what their argument is */
+#define VFM_TRC_ISR_START       1           /* DMA ISR rendering a block, DMA buffer index */
+#define VFM_TRC_ISR_END         2           /* DMA ISR done, - */
+#define VFM_TRC_NMI_ENTER       3           /* Trapped OPL write, - */
+#define VFM_TRC_NMI_EXIT        4           /* Trapped OPL write queued, queue depth */
+#define VFM_TRC_QUEUE_FULL      5           /* Trapped OPL write lost to a full queue, queue size */
+#define VFM_TRC_WRITES          6           /* Queued writes applied to the block, count */
+#define VFM_TRC_GEN_START       7           /* Rest of the block being generated, samples */
+#define VFM_TRC_GEN_END         8           /* Block generated, - */
+#define VFM_TRC_MARK            9           /* Progress mark of the core (TRACE=2), mark code */
+
+/* Dump file: vfm_TraceFileHeader followed by <count> events, oldest first */
+#define VFM_TRACE_MAGIC         "VFMTRACE"
+#define VFM_TRACE_TIME_TSC      0
+#define VFM_TRACE_TIME_PIT      1
+
+#pragma pack(1)
+typedef struct {
+    u32         time;                       /* Timestamp, low 32 bits */
+    u8          type;                       /* VFM_TRC_... */
+    u8          reserved;
+    u16         arg;
+} vfm_TraceEvent;
+
+/* Same layout as TRACESTATE + g_TRC_Events in vfm_icmn.asm */
+typedef struct {
+    u32         timeHz;                     /* Timestamp frequency */
+    u16         pos;                        /* Next event to be written */
+    u8          wrapped;                    /* Ring buffer has wrapped around, the oldest events are lost */
+    u8          active;                     /* Events are being recorded */
+    u8          timeSource;                 /* VFM_TRACE_TIME_... */
+    u8          reserved;
+    vfm_TraceEvent events[VFM_TRACE_EVENTS];
+} vfm_TraceState;
+
+typedef struct {
+    char        magic[8];                   /* VFM_TRACE_MAGIC */
+    u32         timeHz;
+    u16         count;
+    u8          timeSource;
+    u8          reserved;
+} vfm_TraceFileHeader;
+#pragma pack()
+
+#ifdef VFM_TRACE
+
+extern vfm_TraceState               g_vfm_trace;
+
+/* Records an event (resident, vfm_isr.asm) */
+void vfm_traceEvent(u8 type, u16 arg);
+
+/* Measures the timestamp frequency and starts recording */
+void vfm_traceSetup(void);
+/* Dumps the event trace of the resident TSR to <filename> and restarts it */
+bool vfm_traceDump(const char *filename);
+
+#define VFM_TRACE_EVENT(type, arg)  vfm_traceEvent(type, arg)
+#else
+#define VFM_TRACE_EVENT(type, arg)
+#endif
+
+#endif
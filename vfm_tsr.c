@@ -8,6 +8,11 @@
  */
 
 #include "vfm_tsr.h"
+#include "vfm_cal.h"
+#include "vfm_cap.h"
+#include "vfm_trc.h"
+#include "vfm_adp.h"
+#include "vfm_cfg.h"
 #include "v97_reg.h"
 #include "386asm.h"
 #include "types.h"
@@ -27,7 +32,9 @@ typedef void (_interrupt _far *IRQHANDLER)(void);
 #define FM_PCM_SAMPLE_RATE 24000
 #define STEREO 2
 #define DMA_ALIGN 8
+/* SAMPS_PER_BUF and NUM_BUFS are the maximums, the sizes in use are picked at load time */
 #define FM_PCM_BUFFER_ALLOC_SIZE (sizeof(i16) * SAMPS_PER_BUF * STEREO)
+#define FM_PCM_BUFFER_SIZE (sizeof(i16) * g_vfm_sampsPerBuf * STEREO)
 #define VFM_MEM_POOL_SIZE (sizeof(v97_SgdTableEntry) * NUM_BUFS + FM_PCM_BUFFER_ALLOC_SIZE * NUM_BUFS + DMA_ALIGN)
 
 /*  Static memory pools for DMA table and FM DMA buffers
@@ -38,9 +45,12 @@ u8                                  g_vfm_fmDmaMemPool[VFM_MEM_POOL_SIZE] = { 0
 v97_SgdTableEntry                  *g_vfm_fmDmaTable = NULL;                /* Pointer to SGD Table */
 u32                                 g_vfm_fmDmaTablePhysAddress = 0;        /* Physical 32-Bit address of SGD table */
 i16                                *g_vfm_fmDmaBuffers[NUM_BUFS] = { 0 };   /* Pointer list for all DMA buffers */
+u16                                 g_vfm_sampsPerBuf = SAMPS_PER_BUF;      /* Samples per DMA buffer in use */
+u16                                 g_vfm_numBufs     = NUM_BUFS;           /* DMA buffers in use */
 
 pci_Device                          g_vfm_pciDevice     = { 0 };            /* PCI audio device structure (bus, slot, function) */
 u16                                 g_vfm_pciIrq        = 0;                /* Interrupt of the PCI Audio Device */
+u16                                 g_vfm_pciVector     = 0;                /* Interrupt vector of the PCI Audio Device */
 bool                                g_vfm_slaveIrq      = false;            /* Device is on master/slave PIC (true if IRQ > 7) */
 u16                                 g_vfm_ioBaseDma     = 0;                /* Base I/O port for Audio Codec / SGD Interface */
 u16                                 g_vfm_ioBaseNmi     = 0;                /* Base I/O port for FM NMI Status / Data */
@@ -50,31 +60,38 @@ bool                                g_vfm_vdsUsed       = false;            /* F
 /* Definitions from vfm_isr.asm */
 extern u8                           g_DMA_IRQOccured;                       /* Flag by ISR when device IRQ has occured *and* was handled by us */
 extern u8                           g_DMA_BufferIndex;                      /* Buffer Index currently used by DMA engine for writing */
+extern u8                           g_NMI_DwordIo;                          /* NMI handler reads status, data and index with one 32-bit read */
 
 /* These are far objects as they reside in cs, not ds! */
 extern IRQHANDLER _far              g_vfm_oldPciIsr;                        /* Previous Interrupt Handler for device IRQ */
 extern IRQHANDLER _far              g_vfm_oldNmiIsr;                        /* Previous Interrupt Handler for NMI */
+extern IRQHANDLER _far              g_vfm_oldMpxIsr;                        /* Previous Interrupt Handler for INT 2Fh */
 
 
 extern void _far _interrupt         vfm_dmaInterruptHandler(void);          /* Our ISR for device IRQ */
 extern void _far _interrupt         vfm_nmiHandler(void);                   /* Our ISR for NMI */
 extern void _far                    vfm_nmiHandlerEnd(void);                /* Dummy function for a pointer to end of the NMI */
-
-#ifndef DBOPL
-#include "nukedopl/opl3.h"
-opl3_chip                           g_vfm_oplChip;
-#define vfm_oplInit()               OPL3_Reset(&g_vfm_oplChip, FM_PCM_SAMPLE_RATE)
-#define vfm_oplGenOne(buf)          OPL3_Generate2ChResampled(&g_vfm_oplChip, buf)
-#define vfm_oplGen(buf, samps)      OPL3_GenerateStream(&g_vfm_oplChip, buf, samps)
-#define vfm_oplReg(reg, val)        OPL3_WriteReg(&g_vfm_oplChip, reg, val)
-#else
-#include "dbopl/dbopl.h"
-Chip                                g_vfm_oplChip;
-#define vfm_oplInit()               Chip_Reset(&g_vfm_oplChip, true, FM_PCM_SAMPLE_RATE)
-#define vfm_oplGenOne(buf)          Chip_Generate(&g_vfm_oplChip, buf, 1)
-#define vfm_oplGen(buf, samps)      Chip_Generate(&g_vfm_oplChip, buf, samps)
-#define vfm_oplReg(reg, val)        Chip_WriteReg(&g_vfm_oplChip, reg, val)
+extern void _far _interrupt         vfm_mpxHandler(void);                   /* Our INT 2Fh handler for the direct write API */
+extern u16 _far                     g_vfm_dataSeg;                          /* Data segment used by our interrupt handlers */
+
+/* Definitions from vfm_rend.asm */
+extern u8                           vfm_residentDataEnd;                    /* End of the data kept when resident (start of the stack) */
+extern void                         vfm_residentDboplEnd(void);             /* End of the code kept when resident with DBOPL */
+extern void                         vfm_residentMoveAndKeep(u16 newDataSeg, u16 dataSize, u16 paras, u16 sgdCtrlPort, u8 sgdCtrl);
+
+/* Definitions from vfm_rnuk.asm */
+extern void                         vfm_residentCodeEnd(void);              /* End of the code kept when resident with Nuked-OPL3 */
+
+/* Checks that the CPU can run this build */
+static bool vfm_tsrCheckCpu() {
+#if CPU_LEVEL >= 6
+    if (!(vfm_cpuGetFeatures() & VFM_CPU_MMX)) {
+        VFM_PUTS("ERROR: This build requires a CPU with MMX!\n");
+        return false;
+    }
 #endif
+    return true;
+}
 
 /* Get physical address for a FAR PTR - kinda hacky */
 static u32 vfm_tsrGetPhysAddr(void _far *ptr) {
@@ -133,7 +150,7 @@ static bool vfm_tsrSbMixerInit(pci_Device dev) {
     }
     
     if (timeout == 0) {
-        vfm_puts("ERROR: SB Not responding!\n");
+        VFM_PUTS("ERROR: SB Not responding!\n");
         return false;
     }
 
@@ -149,9 +166,8 @@ static bool vfm_tsrSbMixerInit(pci_Device dev) {
 }
 
 /* START FM SGD DMA playback stream */
-static void vfm_tsrStartDma() {
+static void vfm_tsrLoadDmaTable() {
     v97_SgdChannelType sgdType;
-    v97_SgdChannelCtrl sgdCtrl;
 
     /* Tell audio device the pointer table address */
     sys_outPortL(g_vfm_ioBaseDma + V97_FM_SGD_TABLE_PTR, g_vfm_fmDmaTablePhysAddress);
@@ -164,10 +180,21 @@ static void vfm_tsrStartDma() {
     sgdType.intSelect = 0;          /* Interrupt at PCI Read of Last Line */
     sgdType.autoStartSgdAtEOL = 1;  /* Auto-Restart DMA when last block is played (EOL) */
     sys_outPortB(g_vfm_ioBaseDma + V97_FM_SGD_TYPE, sgdType.raw);
-    
+}
+
+/* Gets the SGD control register value that starts the DMA engine */
+static u8 vfm_tsrGetDmaStartCtrl() {
+    v97_SgdChannelCtrl sgdCtrl;
+
     sgdCtrl.raw = 0;
     sgdCtrl.start = 1;              /* SGD Start */
-    sys_outPortB(g_vfm_ioBaseDma + V97_FM_SGD_CTRL, sgdCtrl.raw);
+    return sgdCtrl.raw;
+}
+
+static void vfm_tsrStartDma() {
+    vfm_tsrLoadDmaTable();
+
+    sys_outPortB(g_vfm_ioBaseDma + V97_FM_SGD_CTRL, vfm_tsrGetDmaStartCtrl());
 
     sys_ioDelay(1000);
 
@@ -189,7 +216,7 @@ static void vfm_tsrStopDma() {
     sys_ioDelay(1000);
 }
 
-/* Sets up device interrupt vector & mask as well as NMI vector */
+/* Sets up device interrupt vector & mask as well as NMI and INT 2Fh vectors */
 static void vfm_tsrSetupInterrupts() {
 #if 0
     u8  mask = ~(1 << (g_vfm_pciIrq & 0x07));
@@ -221,12 +248,22 @@ static void vfm_tsrSetupInterrupts() {
     }
 
 
+    /* Our handlers load DS from here */
+    _asm {
+        mov ax, ds
+        mov word ptr cs:[g_vfm_dataSeg], ax
+    }
+
+    g_vfm_pciVector = vector;
+
     /* Get old vectors & set new ones */
     g_vfm_oldPciIsr = (IRQHANDLER) _dos_getvect(vector);
     g_vfm_oldNmiIsr = (IRQHANDLER) _dos_getvect(0x02);
+    g_vfm_oldMpxIsr = (IRQHANDLER) _dos_getvect(0x2F);
 
     _dos_setvect(vector, vfm_dmaInterruptHandler);
     _dos_setvect(0x02,   vfm_nmiHandler);
+    _dos_setvect(0x2F,   vfm_mpxHandler);
 
     /* Unmask IRQ in Interrupt Mask Register */
 //    sys_outPortB(imrPort, mask & sys_inPortB(imrPort));
@@ -242,7 +279,7 @@ static void vfm_tsrSetupInterrupts() {
     DBG_PRINT("                      g_vfm_oldPciIsr: %lp\n",&g_vfm_oldNmiIsr);
 }
 
-/* Restores device interrupt vector & mask as well as NMI vector */
+/* Restores device interrupt vector & mask as well as NMI and INT 2Fh vectors */
 static void vfm_tsrRestoreInterrupts() {
     u8  mask = 1 << (g_vfm_pciIrq & 0x07);
     u16 vector;
@@ -264,6 +301,7 @@ static void vfm_tsrRestoreInterrupts() {
     /* Restore old ISRs */
     _dos_setvect(vector, g_vfm_oldPciIsr);
     _dos_setvect(0x02,   g_vfm_oldNmiIsr);
+    _dos_setvect(0x2F,   g_vfm_oldMpxIsr);
 }
 
 /*  Sets PCI registers so that we can... work :P */
@@ -299,6 +337,46 @@ static void vfm_tsrUnsetPCIRegisters() {
     pci_write8(g_vfm_pciDevice, V97_PCI_REG_AC_LINK_CTRL, acLinkCtrl.raw);
 }
 
+/* Writes <index> and <data> to the OPL port, they end up in the FM NMI registers */
+static void vfm_tsrTrapWrite(u8 index, u8 data) {
+    sys_outPortB(0x388, index); sys_ioDelay(3);
+    sys_outPortB(0x389, data);  sys_ioDelay(3);
+}
+
+/* Checks the trapped write in <raw> (status, data, index) against a write of <index> and <data> to bank A */
+static bool vfm_tsrCheckTrapped(u32 raw, u8 index, u8 data) {
+    return (raw & 3UL) == 1UL && (u8) (raw >> 8) == data && (u8) (raw >> 16) == index;
+}
+
+/*  Checks whether the FM NMI status, data and index registers can be read with one 32-bit read.
+    Writes known values to unused OPL registers (0x06, 0x07) and compares both ways of reading them back.
+    The trap interrupt is off meanwhile, if the chipset doesn't latch the writes like that, byte I/O is used. */
+static bool vfm_tsrCheckNmiDwordIo() {
+    v97_FmNmiCtrl fmNmiCtrl;
+    v97_FmNmiCtrl fmNmiSaved;
+    u32 bytes;
+    u32 dword;
+
+    fmNmiSaved.raw = pci_read8(g_vfm_pciDevice, V97_PCI_REG_FM_NMI_CTRL);
+    fmNmiCtrl.raw = fmNmiSaved.raw;
+    fmNmiCtrl.fmTrapIntDisable = 1;
+    pci_write8(g_vfm_pciDevice, V97_PCI_REG_FM_NMI_CTRL, fmNmiCtrl.raw);
+
+    vfm_tsrTrapWrite(0x06, 0x5A);
+    bytes = (u32) sys_inPortB(g_vfm_ioBaseNmi)
+          | ((u32) sys_inPortB(g_vfm_ioBaseNmi + 1) << 8)
+          | ((u32) sys_inPortB(g_vfm_ioBaseNmi + 2) << 16);
+
+    vfm_tsrTrapWrite(0x07, 0xA5);
+    dword = sys_inPortL(g_vfm_ioBaseNmi);
+
+    pci_write8(g_vfm_pciDevice, V97_PCI_REG_FM_NMI_CTRL, fmNmiSaved.raw);
+
+    DBG_PRINT("NMI trap probe: bytes %06lx, dword %08lx\n", bytes, dword);
+
+    return vfm_tsrCheckTrapped(bytes, 0x06, 0x5A) && vfm_tsrCheckTrapped(dword, 0x07, 0xA5);
+}
+
 /* Set up globals for us and our epical ASM core (tm) */
 static void vfm_tsrSetupGlobals(pci_Device dev) {
     u8 pciRevision = pci_read8(dev, V97_PCI_REG_REVISION);
@@ -313,15 +391,17 @@ static void vfm_tsrSetupGlobals(pci_Device dev) {
     DBG_PRINT("Chip revision: 0x%02x\n", pciRevision);
 
     if (pciRevision & 0xF0 == 0x40) {
-        vfm_puts("VT8231 detected!\n\n");
+        VFM_PUTS("VT8231 detected!\n\n");
         g_vfm_ioBaseDma += 0x0030;
     }
+
+    g_NMI_DwordIo = vfm_tsrCheckNmiDwordIo();
+    DBG_PRINT("NMI 32-bit I/O: %u\n", g_NMI_DwordIo);
 }    
 
 /* Set up Virtual DMA Services (VDS) if available */
-static bool vfm_setupVirtualDMA(u8 *ptr) {
+static bool vfm_setupVirtualDMA(u8 _far *farPtr) {
     bool vdsSupported = vfm_vdsIsSupported();
-    u8 _far *farPtr = (u8 _far*) ptr;
 
     if (!vdsSupported) {
         DBG_PRINT("VDS not supported, skipping...\n");
@@ -340,54 +420,31 @@ static bool vfm_setupVirtualDMA(u8 *ptr) {
 }
 
 /* Initialize the memory for the DMA table and buffers, set up DMA table */
-static void vfm_tsrSetupMemoryAndDma() {   
-    u32 physAddr;
-    u16 i;
-
-    /* We cannot change segment alignments so we need to align the buffers based on the memory pool */
-    u8 *alignedPtr =  g_vfm_fmDmaMemPool;
-    alignedPtr += DMA_ALIGN - 1;
-    alignedPtr -= ((u16) alignedPtr % DMA_ALIGN);
-    physAddr = vfm_tsrGetPhysAddr(alignedPtr);
-
+/* Gets the physical address of the memory pool at <farPtr>, locking it with VDS if available */
+static u32 vfm_tsrLockMemPool(u8 _far *farPtr) {
     /* Attempt to set up virtual DMA region in case we're being LoadHigh'd */
-    if (vfm_setupVirtualDMA(alignedPtr) && g_vfm_vdsDescriptor.physAddr != 0UL) {
+    if (vfm_setupVirtualDMA(farPtr) && g_vfm_vdsDescriptor.physAddr != 0UL) {
         /* Override since physAddr may be remapped for HMA */
-        physAddr = g_vfm_vdsDescriptor.physAddr;
+        return g_vfm_vdsDescriptor.physAddr;
     }
 
-    /* Safety first :-) */
-    g_DMA_IRQOccured = 0;
-    g_DMA_BufferIndex = 0;
- 
+    return vfm_tsrGetPhysAddr(farPtr);
+}
+
+/* Sets up the DMA table and buffers in the (aligned) memory pool at <alignedPtr> / <physAddr> */
+static void vfm_tsrSetupDmaTable(u8 *alignedPtr, u32 physAddr) {
+    u16 i;
+
     /* The first thing in the memory pool is the DMA table */
     g_vfm_fmDmaTable            = (v97_SgdTableEntry *) alignedPtr;
     g_vfm_fmDmaTablePhysAddress = physAddr;
 
     DBG_PRINT("[DMA Table    ] Base: %lp, Physical 0x%08lx\n", (u8 far*) alignedPtr, physAddr);
 
-    /* Set up DMA table and buffer pointers, starting at the *end* of the DMA table */
-    alignedPtr  +=       (sizeof(v97_SgdTableEntry) * NUM_BUFS);
-    physAddr    += (u32) (sizeof(v97_SgdTableEntry) * NUM_BUFS);
-
-    for (i = 0; i < NUM_BUFS; i++) {
-        /* In our local pointer table */
-        g_vfm_fmDmaBuffers[i] = (i16*) alignedPtr;
-        
-        /* In the sound chip's SGD DMA Table */
-        g_vfm_fmDmaTable[i].baseAddress = physAddr;
-        g_vfm_fmDmaTable[i].countFlags.stop = 0;
-        g_vfm_fmDmaTable[i].countFlags.length = (u32) FM_PCM_BUFFER_ALLOC_SIZE;
-        
-        /* If this is the final buffer, mark it as EOL, else FLAG */
-        if (NUM_BUFS == (i + 1)) {
-            g_vfm_fmDmaTable[i].countFlags.flag = 0;
-            g_vfm_fmDmaTable[i].countFlags.eol  = 1;
-        } else {
-            g_vfm_fmDmaTable[i].countFlags.flag = 1;
-            g_vfm_fmDmaTable[i].countFlags.eol  = 0;
-        }
+    /* Set up DMA table and buffer pointers, the same way the resident part does when the buffers are changed */
+    vfm_cfgBuildDmaTable();
 
+    for (i = 0; i < g_vfm_numBufs; i++) {
         DBG_PRINT("[DMA Buffer %2u] Base: %lp, Phys 0x%08lx, Length %lu, EOL %lu, FLAG %lu\n",
             i, 
             (void _far*) g_vfm_fmDmaBuffers[i],
@@ -395,39 +452,378 @@ static void vfm_tsrSetupMemoryAndDma() {
             g_vfm_fmDmaTable[i].countFlags.length,
             g_vfm_fmDmaTable[i].countFlags.eol,
             g_vfm_fmDmaTable[i].countFlags.flag);
+    }
+}
+
+static void vfm_tsrSetupMemoryAndDma() {   
+    /* We cannot change segment alignments so we need to align the buffers based on the memory pool */
+    u8 *alignedPtr =  g_vfm_fmDmaMemPool;
+    alignedPtr += DMA_ALIGN - 1;
+    alignedPtr -= ((u16) alignedPtr % DMA_ALIGN);
+
+    /* Safety first :-) */
+    g_DMA_IRQOccured = 0;
+    g_DMA_BufferIndex = 0;
+
+    vfm_tsrSetupDmaTable(alignedPtr, vfm_tsrLockMemPool((u8 _far *) alignedPtr));
+}
+
+/* Gets the XMS driver entry point, NULL if there is none */
+void _far *vfm_tsrGetXmsEntry() {
+    void _far *entry = NULL;
+
+    _asm {
+        mov ax, 0x4300
+        int 0x2F
+        cmp al, 0x80
+        jne _noXms
+        push es
+        mov ax, 0x4310
+        int 0x2F
+        mov word ptr entry, bx
+        mov word ptr entry + 2, es
+        pop es
+    _noXms:
+    }
+
+    return entry;
+}
+
+#ifndef DEBUG
+/*  Points the DMA engine at the memory pool as it will be once the data has been moved to <newDataSeg>.
+    Returns false if the new location can't be used for DMA (VDS is there but refused to lock it) */
+static bool vfm_tsrRelocateDma(u16 newDataSeg) {
+    u8 *alignedPtr = (u8 *) g_vfm_fmDmaTable;
+    u8 _far *newPtr = (u8 _far *) (((u32) newDataSeg << 16) | (u16) alignedPtr);
+
+    vfm_tsrStopDma();
+
+    if (g_vfm_vdsUsed) {
+        vfm_vdsUnlockDmaRegion(&g_vfm_vdsDescriptor);
+        g_vfm_vdsUsed = false;
+    }
+
+    vfm_tsrSetupDmaTable(alignedPtr, vfm_tsrLockMemPool(newPtr));
+    vfm_tsrLoadDmaTable();
+
+    return g_vfm_vdsUsed || !vfm_vdsIsSupported();
+}
+
+/* Copies <size> bytes from <src> to <dst>, the areas must not overlap */
+static void vfm_tsrFarCopy(void _far *dst, const void _far *src, u16 bytes) {
+    _asm {
+        push ds
+        push si
+        push di
+        mov cx, bytes
+        les di, dst
+        lds si, src
+        cld
+        rep movsb
+        pop di
+        pop si
+        pop ds
+    }
+}
+
+/* Allocates an upper memory block through DOS (DOS 5+, DOS=UMB), returns its segment or 0 */
+static u16 vfm_tsrAllocDosUmb(u16 paras) {
+    u16 umbSeg = 0;
+
+    _asm {
+        mov ax, 0x5800
+        int 0x21            /* Get allocation strategy */
+        push ax
+        mov ax, 0x5802
+        int 0x21            /* Get UMB link state */
+        push ax
+
+        mov ax, 0x5803
+        mov bx, 1
+        int 0x21            /* Link UMBs */
+        mov ax, 0x5801
+        mov bx, 0x40
+        int 0x21            /* High memory only, first fit */
+
+        mov ah, 0x48
+        mov bx, paras
+        int 0x21
+        jc _umbAllocFail
+        mov umbSeg, ax
+    _umbAllocFail:
+
+        pop bx
+        xor bh, bh
+        mov ax, 0x5803
+        int 0x21            /* Restore UMB link state */
+        pop bx
+        mov ax, 0x5801
+        int 0x21            /* Restore allocation strategy */
+    }
+
+    /* DOS versions without UMB support ignore the strategy and give us conventional memory */
+    if (umbSeg != 0 && umbSeg < 0xA000) {
+        _asm {
+            push es
+            mov es, umbSeg
+            mov ah, 0x49
+            int 0x21
+            pop es
+        }
+        umbSeg = 0;
+    }
+
+    return umbSeg;
+}
+
+/* Allocates an upper memory block through XMS, returns its segment or 0 */
+static u16 vfm_tsrAllocXmsUmb(void _far *xms, u16 paras) {
+    u16 umbSeg = 0;
+    u16 ok = 0;
 
-        alignedPtr  +=       FM_PCM_BUFFER_ALLOC_SIZE;
-        physAddr    += (u32) FM_PCM_BUFFER_ALLOC_SIZE;
+    if (xms == NULL) return 0;
+
+    _asm {
+        mov ah, 0x10
+        mov dx, paras
+        call dword ptr [xms]
+        mov ok, ax
+        mov umbSeg, bx
+    }
+
+    return ok == 1 ? umbSeg : 0;
+}
+
+/* Frees an upper memory block allocated through XMS */
+static void vfm_tsrFreeXmsUmb(void _far *xms, u16 umbSeg) {
+    _asm {
+        mov ah, 0x11
+        mov dx, umbSeg
+        call dword ptr [xms]
+    }
+}
+
+/* Frees a memory block allocated through DOS */
+static void vfm_tsrFreeDosMem(u16 umbSeg) {
+    _asm {
+        push es
+        mov es, umbSeg
+        mov ah, 0x49
+        int 0x21
+        pop es
+    }
+}
+
+/*  Copies the resident code and data into an upper memory block, moves our interrupt vectors
+    and the DMA engine there and exits. Returns false if there is no (usable) UMB */
+static bool vfm_tsrGoHigh(u16 codeSeg, u16 codeSize, u16 dataSize) {
+    static const char name[8] = "V97TSR";
+    IRQHANDLER _far *ivt = (IRQHANDLER _far *) 0L;
+    u16 codeParas = (codeSize + 15) >> 4;
+    u16 paras = codeParas + ((dataSize + 15) >> 4);
+    void _far *xms = NULL;
+    u16 umbSeg = vfm_tsrAllocDosUmb(paras);
+    u16 dataSeg;
+    u16 newDataSeg;
+
+    _asm mov dataSeg, ds
+
+    if (umbSeg == 0) {
+        xms = vfm_tsrGetXmsEntry();
+        umbSeg = vfm_tsrAllocXmsUmb(xms, paras);
+    }
+
+    if (umbSeg == 0) return false;
+
+    newDataSeg = umbSeg + codeParas;
+
+    /* UMBs are usually mapped by EMM386 & co., DMA needs VDS to get the physical address */
+    if (!vfm_tsrRelocateDma(newDataSeg)) {
+        VFM_PUTS("Upper memory block not usable for DMA\n");
+
+        if (xms != NULL) {
+            vfm_tsrFreeXmsUmb(xms, umbSeg);
+        } else {
+            vfm_tsrFreeDosMem(umbSeg);
+        }
+
+        return false;
+    }
+
+    /* DOS blocks: owned by themselves, so DOS doesn't free them when we exit */
+    if (xms == NULL) {
+        u8 _far *mcb = (u8 _far *) ((u32) (umbSeg - 1) << 16);
+        *((u16 _far *) (mcb + 1)) = umbSeg;
+        vfm_tsrFarCopy(mcb + 8, (const void _far *) name, sizeof(name));
+    }
+
+    _asm cli
+
+    vfm_tsrFarCopy((void _far *) ((u32) umbSeg << 16), (void _far *) ((u32) codeSeg << 16), codeSize);
+    vfm_tsrFarCopy((void _far *) ((u32) newDataSeg << 16), (void _far *) ((u32) dataSeg << 16), dataSize);
+
+    /* The copy of the handlers uses the copy of the data */
+    *((u16 _far *) (((u32) umbSeg << 16) | FP_OFF(&g_vfm_dataSeg))) = newDataSeg;
+
+    ivt[g_vfm_pciVector]    = (IRQHANDLER) (((u32) umbSeg << 16) | FP_OFF(vfm_dmaInterruptHandler));
+    ivt[0x02]               = (IRQHANDLER) (((u32) umbSeg << 16) | FP_OFF(vfm_nmiHandler));
+    ivt[0x2F]               = (IRQHANDLER) (((u32) umbSeg << 16) | FP_OFF(vfm_mpxHandler));
+    vfm_capMoveXmsHook(umbSeg);
+
+    sys_outPortB(g_vfm_ioBaseDma + V97_FM_SGD_CTRL, vfm_tsrGetDmaStartCtrl());
+
+    _asm sti
+
+    VFM_PUTS("Loaded into upper memory\n");
+
+    /* Nothing is left in conventional memory, so this is a normal exit */
+    _asm {
+        mov ax, 0x4C00
+        int 0x21
+    }
+
+    return true;
+}
+#endif
+
+void vfm_tsrPrintBufferSettings(u16 sampsPerBuf, u16 numBufs) {
+    vfm_putDec(sampsPerBuf);
+    VFM_PUTS(" samples x ");
+    vfm_putDec(numBufs);
+    VFM_PUTS(" buffers (");
+    vfm_putDec((u16) ((u32) sampsPerBuf * numBufs * 1000UL / FM_PCM_SAMPLE_RATE));
+    VFM_PUTS(" ms)\n");
+}
+
+/*  Picks the core and DMA buffer settings. Unless given on the command line, the core is timed
+    and the lowest latency settings that are safe for this CPU are used. Returns the core to use */
+static vfm_CoreType vfm_tsrSetupBuffers(const vfm_TsrConfig *config) {
+    vfm_CoreType core = config->core;
+    u16 load;
+
+    if (config->halfRate) {
+        VFM_PUTS("Half rate synthesis: ");
+        vfm_putDec(FM_PCM_SAMPLE_RATE / 2);
+        VFM_PUTS(" Hz, upsampled\n");
+    }
+
+    if (config->sampsPerBuf != 0) {
+        g_vfm_sampsPerBuf   = config->sampsPerBuf;
+        g_vfm_numBufs       = config->numBufs;
+        VFM_PUTS("Buffers: ");
+        vfm_tsrPrintBufferSettings(g_vfm_sampsPerBuf, g_vfm_numBufs);
+        return core;
     }
 
+    VFM_PUTS("Calibrating...\n");
+
+    /* The DMA memory pool isn't set up yet, so it serves as render target */
+    vfm_coreInit(core, FM_PCM_SAMPLE_RATE, config->halfRate);
+    load = vfm_calMeasureLoad((i16 *) g_vfm_fmDmaMemPool, FM_PCM_SAMPLE_RATE);
+
+    if (load > VFM_CAL_MAX_LOAD && core != VFM_CORE_DBOPL && !config->coreExplicit) {
+        vfm_puts(vfm_coreGetName(core));
+        VFM_PUTS(" is too slow for this CPU, using ");
+        core = VFM_CORE_DBOPL;
+        vfm_puts(vfm_coreGetName(core));
+        VFM_PUTS("\n");
+
+        vfm_coreInit(core, FM_PCM_SAMPLE_RATE, config->halfRate);
+        load = vfm_calMeasureLoad((i16 *) g_vfm_fmDmaMemPool, FM_PCM_SAMPLE_RATE);
+    }
+
+    VFM_PUTS("CPU load: ");
+    vfm_putDec(load);
+    VFM_PUTS("%, margin: ");
+    vfm_putDec(load < 100 ? 100 - load : 0);
+    VFM_PUTS("%\n");
+
+    if (!vfm_calPickBuffers(load, &g_vfm_sampsPerBuf, &g_vfm_numBufs)) {
+        VFM_PUTS("WARNING: CPU too slow, expect drop outs!\n");
+        g_vfm_sampsPerBuf   = SAMPS_PER_BUF;
+        g_vfm_numBufs       = NUM_BUFS;
+    }
+
+    VFM_PUTS("Buffers: ");
+    vfm_tsrPrintBufferSettings(g_vfm_sampsPerBuf, g_vfm_numBufs);
+    return core;
 }
 
-bool vfm_tsrInitialize(pci_Device dev) {
-    vfm_tsrSetupGlobals(dev);   vfm_puts("\xFE");
+bool vfm_tsrInitialize(pci_Device dev, const vfm_TsrConfig *config) {
+    vfm_CoreType core;
+
+    if (!vfm_tsrCheckCpu()) {
+        return false;
+    }
+
+    /* Before the calibration, so the buffers are picked for the capped load */
+    if (config->voiceLimit != 0) {
+        VFM_PUTS("Polyphony: ");
+        vfm_putDec(config->voiceLimit);
+        VFM_PUTS(" voices\n");
+        vfm_coreSetVoiceLimit((u8) config->voiceLimit);
+    }
+
+    core = vfm_tsrSetupBuffers(config);
+
+    if (config->voiceLimit != 0 && core != VFM_CORE_DBOPL) {
+        VFM_PUTS("WARNING: The polyphony limit only applies to DBOPL\n");
+    }
+
+    vfm_tsrSetupGlobals(dev);   VFM_PUTS("\xFE");
     
     DBG_PRINT("[TSR Init     ] I/O Port (DMA): 0x%04x, I/O Port (NMI): 0x%04x\n", g_vfm_ioBaseDma, g_vfm_ioBaseNmi);
 
     if (!vfm_tsrSbMixerInit(dev)) {                 /* Setup SB mixer to unmute FM */
-        vfm_puts("ERROR: SB Audio not enabled - run VIA_AC97.EXE\n");
+        VFM_PUTS("ERROR: SB Audio not enabled - run VIA_AC97.EXE\n");
+        return false;
+    }
+
+    VFM_PUTS("\xFE");
+
+    /* Register and output capture, recorded by the DMA ISR from the first block on */
+    if ((config->captureKb != 0 && !vfm_capSetup(VFM_CAP_REGS, config->captureKb, g_vfm_sampsPerBuf, FM_PCM_SAMPLE_RATE))
+     || (config->captureOutKb != 0 && !vfm_capSetup(VFM_CAP_OUTPUT, config->captureOutKb, g_vfm_sampsPerBuf, FM_PCM_SAMPLE_RATE))) {
+        VFM_PUTS("ERROR: Can't allocate the capture buffer in XMS\n");
+        vfm_capFree();
         return false;
     }
 
-    vfm_puts("\xFE");
+    /* The DMA ISR has to know when it interrupted the XMS driver */
+    if ((config->captureKb != 0 || config->captureOutKb != 0) && !vfm_capHookXms()) {
+        VFM_PUTS("ERROR: Can't hook the XMS driver for the capture\n");
+        vfm_capFree();
+        return false;
+    }
 
-    vfm_tsrStopDma();           vfm_puts("\xFE");   /* Stop any previous DMA (shouldn't happen but you never know) */
-    vfm_tsrSetupMemoryAndDma(); vfm_puts("\xFE");   /* Init DMA tables and buffers */
-    vfm_oplInit();              vfm_puts("\xFE");   /* Init OPL3 Emulator */
-    vfm_tsrSetupInterrupts();   vfm_puts("\xFE");   /* Set up vectors and PIC for our interrupts */
-    vfm_tsrSetupPCIRegisters(); vfm_puts("\xFE");   /* Set up PCI registers for playback & DMA */ 
-    vfm_tsrStartDma();          vfm_puts("\xFE");   /* Start DMA */
+#ifdef VFM_TRACE
+    vfm_traceSetup();
+#endif
 
-    vfm_puts("\n\nInit Complete\n");
+    /* Adaptive quality, the tiers are reset with the core below */
+    if (config->adaptPct != 0) {
+        VFM_PUTS("Adaptive quality: ");
+        vfm_putDec(config->adaptPct);
+        VFM_PUTS("% of a block\n");
+        vfm_adaptSetup(config->adaptPct, g_vfm_sampsPerBuf, FM_PCM_SAMPLE_RATE);
+    }
+
+    vfm_tsrStopDma();           VFM_PUTS("\xFE");   /* Stop any previous DMA (shouldn't happen but you never know) */
+    vfm_tsrSetupMemoryAndDma(); VFM_PUTS("\xFE");   /* Init DMA tables and buffers */
+    vfm_coreInit(core, FM_PCM_SAMPLE_RATE, config->halfRate); VFM_PUTS("\xFE"); /* Init selected OPL3 Emulator */
+    vfm_tsrSetupInterrupts();   VFM_PUTS("\xFE");   /* Set up vectors and PIC for our interrupts */
+    vfm_tsrSetupPCIRegisters(); VFM_PUTS("\xFE");   /* Set up PCI registers for playback & DMA */ 
+    vfm_tsrStartDma();          VFM_PUTS("\xFE");   /* Start DMA */
+
+    VFM_PUTS("\n\nInit Complete\n");
+    return true;
 }
 
 void vfm_tsrCleanup() {
     vfm_tsrStopDma();
     vfm_tsrUnsetPCIRegisters();
     vfm_tsrRestoreInterrupts();
+    vfm_capFree();
 
     /* If we had a VDS region locked, we need to unlocked */
     if (g_vfm_vdsUsed) {
@@ -484,14 +880,35 @@ static u32 vfm_tsrGetTicks() {
     return ret;
 }
 
-void vfm_tsrOplTest() {
+void vfm_tsrNmiBench() {
+    u32 startTime;
+    u32 elapsed;
+    u16 i;
+
+    /* Channel 0 F-Number low, doesn't change what is heard */
+    sys_outPortB(0x388, 0xA0);
+    sys_ioDelay(40);
+
+    startTime = vfm_tsrGetTicks();
+
+    for (i = 0; i < 256; i++) {
+        sys_outPortB(0x389, 0xFF);
+    }
+
+    elapsed = vfm_tsrGetTicks() - startTime;
+
+    /* Ticks are 4096 cycles */
+    printf("NMI trap: %lu cycles per write (%s I/O)\n", elapsed * 4096UL / 256UL, g_NMI_DwordIo ? "32-bit" : "8-bit");
+}
+
+void vfm_tsrOplTest(const vfm_TsrConfig *config) {
     FILE *f = fopen("teraterm.log", "rb");
     FILE *out = fopen("stream.bin", "wb");
     DBGREG reg;
     i16 *stream = malloc(512 * STEREO * sizeof(i16));
     i16 *streamOut = stream;
     u16 block = 0;
-    vfm_oplInit();
+    vfm_coreInit(config->core, FM_PCM_SAMPLE_RATE, false);
 
     printf("OPL Init done\n");
 
@@ -506,13 +923,13 @@ void vfm_tsrOplTest() {
             if (ferror(f) || ferror(out)) abort();
             if (reg.r == 0xffff && reg.v == 0xff) break;
             
-	        vfm_oplReg(reg.r, reg.v);
-            vfm_oplGenOne(streamOut);
+	        vfm_coreWriteReg(reg.r, reg.v);
+            vfm_coreGenerate(streamOut, 1);
             streamOut += STEREO;
             toWrite--;
         }
 
-        vfm_oplGen(streamOut, toWrite);
+        vfm_coreGenerate(streamOut, (u16) toWrite);
 
 //        while (toWrite) {
 //            vfm_oplGen(streamOut, toWrite);
@@ -523,6 +940,10 @@ void vfm_tsrOplTest() {
 //        vfm_oplGen(streamOut, toWrite);
         elapsed = vfm_tsrGetTicks() - startTime;
 
+#if CPU_LEVEL >= 6
+        vfm_mmxEmms();
+#endif
+
         printf("block %5u %5lu ticks \r", block++, elapsed);
         fwrite(stream, 512 * STEREO * sizeof(i16), 1, out);
     }
@@ -537,6 +958,7 @@ void vfm_tsrOplTest() {
 void vfm_terminateAndStayResident() {
     u16 paras;
     u16 _psp;   /* pspspspspspspspsps :3 */
+    u16 _cs;
     u16 _ss;
     u16 _sp;
 
@@ -550,18 +972,60 @@ void vfm_terminateAndStayResident() {
         int 0x21            /* Deallocate */
         pop es
 
+        mov _cs, cs
         mov _ss, ss         /* Save Stack segment and pointer for size calculation */
         mov _sp, sp
     }
 
-    /*  Calculation from A to Z of DOS Programming, Chapter 27 'TSR PROGRAMMING'.
-        I have no idea if this is correct. But it seems? to work? maybe? */
+#ifdef DEBUG
+    UNUSED_ARG(_cs);
+
+    /*  Debug builds link the MS C library, which brings its own segment layout, so the whole image stays.
+        Calculation from A to Z of DOS Programming, Chapter 27 'TSR PROGRAMMING'. */
 
     paras = _ss + (_sp >> 4) - _psp + 0x100; /* I kept adding to this value until it stopped crashing... Eto bleh...*/
 
     DBG_PRINT("psp %04x, ss %04x, sp %04x, paragraphs: %u\n", _psp, _ss, _sp, paras);
 
     _dos_keep(0, paras);
+#else
+    {
+        /*  Resident code comes first, the init code after it gets overwritten by the data,
+            which is moved down right behind the resident code. The stack isn't kept.
+            If there is an upper memory block, both go there instead and nothing stays below 640K. */
+        u16 codeSize    = (u16) vfm_residentCodeEnd;
+        u16 dataSize    = (u16) &vfm_residentDataEnd;
+        u16 newDataSeg;
+        u16 freed;
+
+        /* Nuked-OPL3 is linked last, with DBOPL its code is cut off and it can't be selected anymore */
+        if (vfm_coreGetType() == VFM_CORE_DBOPL) {
+            codeSize = (u16) vfm_residentDboplEnd;
+            vfm_coreDrop(VFM_CORE_NUKED);
+        }
+
+        newDataSeg  = _cs + ((codeSize + 15) >> 4);
+        freed       = (u16) ((_ss - newDataSeg) * 16UL + _sp - dataSize);
+        paras       = newDataSeg + ((dataSize + 15) >> 4) - _psp;
+
+        VFM_PUTS("Resident: ");
+        vfm_putDec(codeSize);
+        VFM_PUTS(" bytes code + ");
+        vfm_putDec(dataSize);
+        VFM_PUTS(" bytes data (");
+        vfm_putDec((paras + 63) >> 6);
+        VFM_PUTS(" KB)\n");
+
+        /* Doesn't return if it worked */
+        vfm_tsrGoHigh(_cs, codeSize, dataSize);
+
+        vfm_putDec(freed);
+        VFM_PUTS(" bytes of conventional memory freed\n");
+
+        vfm_tsrRelocateDma(newDataSeg);
+        vfm_residentMoveAndKeep(newDataSeg, dataSize, paras, g_vfm_ioBaseDma + V97_FM_SGD_CTRL, vfm_tsrGetDmaStartCtrl());
+    }
+#endif
 }
 
 void vfm_tsrUnload() {
@@ -589,11 +1053,11 @@ i16 *vfm_tsrGetDmaBufferWritePtr(i16 index) {
 }
 
 u16 vfm_tsrGetDmaBufferSize() {
-    return FM_PCM_BUFFER_ALLOC_SIZE;
+    return FM_PCM_BUFFER_SIZE;
 }
 
 u16 vfm_tsrGetDmaBufferCount() {
-    return NUM_BUFS;
+    return g_vfm_numBufs;
 }
 
 u16 vfm_tsrGetNmiHandlerSize() {
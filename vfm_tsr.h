@@ -6,6 +6,7 @@
 
 #include "pci.h"
 #include "types.h"
+#include "vfm_core.h"
 
 #ifdef DEBUG
 #include <stdio.h>
@@ -16,6 +17,12 @@
 #define DBG_PRINT()
 #endif
 
+/*  Text and tables only used at load time go into the code segment of their module. The load time code
+    comes after the resident code (see vfm_rend.asm), so they are dropped with it instead of staying in DGROUP */
+#define VFM_TEXT _based(_segname("_CODE"))
+/* Prints a string literal that is only needed at load time, see VFM_TEXT */
+#define VFM_PUTS(text) do { static const char VFM_TEXT _text[] = text; vfm_puts(_text); } while (0)
+
 #pragma pack (1)
 typedef struct {
     u32 size;
@@ -26,11 +33,41 @@ typedef struct {
 } vfm_VirtualDmaDescriptor;
 #pragma pack()
 
+/* CPU level the TSR is built for (3 = 386, 5 = Pentium, 6 = MMX), set by the makefile */
+#ifndef CPU_LEVEL
+#define CPU_LEVEL 3
+#endif
+
+/* CPUID function 1 feature flags (EDX) */
+#define VFM_CPU_FPU     0x00000001UL
+#define VFM_CPU_TSC     0x00000010UL
+#define VFM_CPU_CMOV    0x00008000UL
+#define VFM_CPU_MMX     0x00800000UL
+
+/* Load time settings, parsed from the command line */
+typedef struct {
+    vfm_CoreType core;                      /* OPL emulation core */
+    bool coreExplicit;                      /* Core was given on the command line, don't fall back to another one */
+    u16 sampsPerBuf;                        /* Samples per DMA buffer, 0 = calibrate at load time */
+    u16 numBufs;                            /* DMA buffer count, 0 = calibrate at load time */
+    u16 captureKb;                          /* Size of the register capture buffer in XMS, 0 = no capture */
+    u16 captureOutKb;                       /* Size of the output capture buffer in XMS, 0 = no capture */
+    bool halfRate;                          /* Core renders at half the DMA rate, upsampled to it */
+    u16 adaptPct;                           /* Render time budget of the adaptive quality in percent of a block, 0 = off */
+    u16 voiceLimit;                         /* Most voices rendered at once (DBOPL), 0 = no limit */
+} vfm_TsrConfig;
+
 void sys_outPortB(u16 port, u8 outVal);
 u8 sys_inPortB(u16 port);
 
 /* Hardware/IRQ/Mem init & dma engine start */
-bool vfm_tsrInitialize(pci_Device dev);
+bool vfm_tsrInitialize(pci_Device dev, const vfm_TsrConfig *config);
+#ifdef DBG_BENCH
+/* Renders teraterm.log (register dump) into stream.bin and prints timings per block */
+void vfm_tsrOplTest(const vfm_TsrConfig *config);
+/* Times trapped OPL data writes (needs the TSR to be initialized) */
+void vfm_tsrNmiBench();
+#endif
 /* Hardware/IRQ/Mem deinit & dma engine stop */
 void vfm_tsrCleanup();
 
@@ -48,11 +85,35 @@ i16 *vfm_tsrGetDmaBufferWritePtr(i16 index);
 u16 vfm_tsrGetDmaBufferSize();
 /* Gets the amount of DMA buffers in use */
 u16 vfm_tsrGetDmaBufferCount();
+/* Prints DMA buffer settings and the latency they add up to */
+void vfm_tsrPrintBufferSettings(u16 sampsPerBuf, u16 numBufs);
 /* Gets size of TSR's NMI handler */
 u16 vfm_tsrGetNmiHandlerSize();
 
+/* Gets a timestamp, TSC on CPU_LEVEL 5/6, BIOS tick : PIT clocks on CPU_LEVEL 3 (resident, vfm_isr.asm) */
+u32 vfm_isrTimestamp(void);
+/* Gets CPUID feature flags (VFM_CPU_*), 0 if the CPU has no CPUID */
+u32 vfm_cpuGetFeatures(void);
+/* Pentium scalar mixer for a mono block into a 32-bit stereo block, masks are 0 or -1 */
+void vfm_p5MixChannel(i32 *output, const i16 *input, u16 samples, i16 maskLeft, i16 maskRight);
+/* MMX mixer for a mono block into a 32-bit stereo block, masks are 0 or -1 */
+void vfm_mmxMixChannel(i32 *output, const i16 *input, u16 samples, i16 maskLeft, i16 maskRight);
+/* Saturates <count> 32-bit samples into 16-bit samples */
+void vfm_pack32(i16 *output, const i32 *input, u16 count);
+/* Saturates <count> 32-bit samples into 16-bit samples using MMX */
+void vfm_mmxPack32(i16 *output, const i32 *input, u16 count);
+/* Doubles the rate of <samples> stereo samples in the second half of <buf> into all of it, <last> is the previous block's last sample */
+void vfm_upsample2x(i16 *buf, u16 samples, i16 *last);
+/* Clears MMX state so the FPU can be used again */
+void vfm_mmxEmms(void);
+
 /* Custom puts method to avoid MS C Library usage */
-void vfm_puts(const char *str);
+void vfm_puts(const char _far *str);
+/* Prints an unsigned decimal number */
+void vfm_putDec(u16 val);
+
+/* Gets the XMS driver entry point, NULL if there is none */
+void _far *vfm_tsrGetXmsEntry();
 
 /* Checks if Virtual DMA Services (VDS) are supported */
 bool vfm_vdsIsSupported();